@@ -39,9 +39,12 @@ Usage:
        ./inst_efficiency.py pairs -q --peak 118 --left=-1 --right=0 --bins 20
 
 
-    5. Log measurements into a file
+    5. Log measurements into a file, or into a binary logfile which
+       'read_log' loads without parsing, e.g. for multi-day logs
 
        ./inst_efficiency.py pairs -q --logging pair_measurements
+       ./inst_efficiency.py pairs -q --logging pair_measurements \
+           --log_format binary
 
 
     6. Save configuration from (4) into default config file
@@ -64,6 +67,42 @@ Usage:
        ./inst_efficiency.py pairs -c asympair --time 3
 
 
+    8. Run against the simulated timestamp device of readevents7, with
+       1kcps background on channels 1 and 2, and 50kcps pairs detected
+       with 20% and 30% efficiency at +20ns delay (0.5ns rms jitter)
+
+       ./inst_efficiency.py pairs -q --peak 20 \
+           -U sim:1000,1000,0,0:1,2,50000,20,0.2,0.3,0.5
+
+
+    9. Keep the timestamp card streaming between integration windows
+
+       readevents7 -U /dev/ioboards/usbtmst0 -C /tmp/readevents.sock &
+       ./inst_efficiency.py pairs -q --control_socket /tmp/readevents.sock
+
+
+    10. Follow the events of a card while they are recorded to a file, via
+        the shared memory ring of readevents7, e.g. in a Python session
+
+        readevents7 -a1 -M tmst0 > events.bin &
+        >>> for events, lost in stream_events("tmst0"):
+        ...     print(len(events), lost)
+
+
+    11. Find the coincidence peak within +/-250ns automatically, and print
+        the '--peak', '--left' and '--right' arguments for it
+
+       ./inst_efficiency.py findpeak -c inst-efficiency.findpeak.conf \
+           --channel_start 1 --channel_stop 2
+
+
+    12. Scan the 625 LCVR settings of 5 voltages per channel within a single
+        acquisition, dropping 50ms after every change and integrating 0.1s
+
+       ./inst_efficiency.py lcvr --gapless --lcvr_steps 5 \
+           --settle_time 0.05 --time 0.1
+
+
 Author:
     Justin, 2022-12-01
 
@@ -87,10 +126,18 @@ References:
     [1] https://github.com/bw2/ConfigArgParse
 """
 
+import collections
+import ctypes
 import datetime as dt
 import logging
+import mmap
+import os
 import pathlib
 import re
+import select
+import signal
+import socket
+import subprocess
 import sys
 import time
 from itertools import product
@@ -106,6 +153,29 @@ from S15lib.instruments import LCRDriver, TimestampTDC2
 INT_MIN = np.iinfo(np.int64).min  # indicate invalid value in int64 array
 RE_ANSIESCAPE = re.compile(r"\x1B(?:[@-Z\\-_]|\[[0-?]*[ -/]*[@-~])")
 
+# Shared memory event ring of 'readevents7 -M', see 'tmstshm.h'
+SHM_MAGIC = 0x31524D5354534D54
+SHM_VERSION = 1
+SHM_RINGOFFSET, SHM_CAPACITY, SHM_COMMIT, SHM_RESERVE, SHM_PRODUCER = 2, 3, 4, 5, 6
+
+# Window duration of the pipelined LCVR scan, see 'scan_lcvr_singles'
+LCVR_SCAN_WINDOW = 0.01
+
+# Binary columnar logfiles, see 'BinaryLog'
+LOG_MAGIC = b"IELOG1"
+LOG_HEADERSIZE = 512
+LOG_DTYPES = {"time": "<M8[us]", int: "<i8", float: "<f8"}
+
+# Time index of 'readevents7 -x', see 'tmstindex.h'
+INDEX_MAGIC = 0x3158444954534D54
+INDEX_VERSION = 1
+INDEX_HEADERSIZE = 32
+INDEX_DTYPE = np.dtype([("time", "<u8"), ("offset", "<u8")])
+
+# Event decoding library of readevents7, see 'tmstreader.c'
+TMSTREADER_PATH = pathlib.Path(__file__).parent / "lib/usbtmst4/apps/libtmstreader.so"
+_TMSTREADER = None
+
 # Colorama
 COLORAMA_IMPORTED = False
 try:
@@ -172,7 +242,9 @@ def len_ansi(text):
     return len(strip_ansi(text))
 
 
-def _request_filecomment(comment_cache=".inst_efficiency.comment") -> pathlib.Path:
+def _request_filecomment(
+    comment_cache=".inst_efficiency.comment", suffix=".log"
+) -> pathlib.Path:
     """Request for comments to append to logfile and returns path to logfile."""
 
     # If logging is enabled, request for filename
@@ -190,7 +262,7 @@ def _request_filecomment(comment_cache=".inst_efficiency.comment") -> pathlib.Pa
         comment = _comment
 
     # Check writable to location
-    path_logfile = _append_datetime_logfile(comment)
+    path_logfile = _append_datetime_logfile(comment, suffix)
     with open(path_logfile, "a") as f:
         f.write("")
     with open(path_comment, "w") as f:
@@ -199,8 +271,8 @@ def _request_filecomment(comment_cache=".inst_efficiency.comment") -> pathlib.Pa
     return path_logfile
 
 
-def _append_datetime_logfile(comment):
-    return dt.datetime.now().strftime(f"%Y%m%d_inst_efficiency_{comment}.log")
+def _append_datetime_logfile(comment, suffix=".log"):
+    return dt.datetime.now().strftime(f"%Y%m%d_inst_efficiency_{comment}{suffix}")
 
 
 def print_fixedwidth(*values, width=7, out=None, pbar=None, end="\n"):
@@ -248,11 +320,16 @@ def read_log(filename: str, schema: list, merge: bool = False):
 
     Args:
         filename: Filename of log file.
-        schema: List of datatypes to parse each column in logfile.
+        schema: List of datatypes to parse each column in logfile. Ignored
+            for binary logfiles, which carry their own schema.
         merge:
             Whether multiple logging runs in the same file should
             be merged into a single list, or as a list-of-lists.
 
+    Binary logfiles written with '--log_format binary' (see 'BinaryLog')
+    are recognized by their header, and mapped instead of parsed: the
+    columns are views into the file, with the time as 'datetime64[us]'.
+
     Note:
         This code assumes tokens in columns do not contain spaces,
         including headers.
@@ -263,6 +340,10 @@ def read_log(filename: str, schema: list, merge: bool = False):
         Implement non-merge functionality.
     """
 
+    with open(filename, "rb") as f:
+        if f.read(len(LOG_MAGIC)) == LOG_MAGIC:
+            return BinaryLog.read(filename)
+
     # Custom datatype
     def convert_time(s):
         """Converts time in HHMMSS format to datetime object.
@@ -315,6 +396,230 @@ def read_log(filename: str, schema: list, merge: bool = False):
     return dict(_items)
 
 
+class BinaryLog:
+    """Append-only logfile with fixed-width binary records.
+
+    The file starts with a text header of 'LOG_HEADERSIZE' bytes, padded
+    with newlines, which holds the magic and the schema as one
+    'name:dtype' token per column, e.g.
+
+        IELOG1
+        TIME:<M8[us] ITIME:<f8 PAIRS:<i8 ...
+
+    followed by one record per line of the text logfile. All columns are
+    8 bytes wide, so the records can be mapped as a structured array
+    without any parsing, see 'BinaryLog.read'. Appending to an existing
+    logfile requires the same schema, so that several runs can share a
+    file like the text logfiles do.
+
+    Usage:
+        >>> log = BinaryLog("pairs.bin", [("TIME", "time"), ("PAIRS", int)])
+        >>> log.append(dt.datetime.now(), 1200)
+        >>> read_log("pairs.bin", None)["PAIRS"]
+
+    Args:
+        filename: Path of the logfile.
+        schema: List of column names and types, which are 'time', int or
+            float.
+    """
+
+    def __init__(self, filename, schema):
+        self.dtype = np.dtype([(name, LOG_DTYPES[kind]) for name, kind in schema])
+        header = self._header(self.dtype)
+        with open(filename, "ab+") as f:
+            f.seek(0)
+            existing = f.read(LOG_HEADERSIZE)
+            if not existing:
+                f.write(header)
+            elif existing != header:
+                raise ValueError(f"'{filename}' has a different log schema")
+        self.file = open(filename, "ab", buffering=0)
+
+    @staticmethod
+    def _header(dtype):
+        columns = " ".join(f"{name}:{dtype[name].str}" for name in dtype.names)
+        header = LOG_MAGIC + b"\n" + columns.encode() + b"\n"
+        if len(header) > LOG_HEADERSIZE:
+            raise ValueError("Too many columns for a binary logfile")
+        return header.ljust(LOG_HEADERSIZE, b"\n")
+
+    def append(self, *values):
+        """Writes one record, with the values in the order of the schema."""
+        record = np.zeros(1, dtype=self.dtype)
+        for name, value in zip(self.dtype.names, values):
+            if isinstance(value, dt.datetime):
+                value = np.datetime64(value, "us")
+            record[name] = value
+        self.file.write(record.tobytes())
+
+    def close(self):
+        self.file.close()
+
+    @staticmethod
+    def read(filename):
+        """Maps a binary logfile into a dictionary of columns.
+
+        The columns are read-only views into the file, so that logs of any
+        length load in constant time. An incomplete record at the end, e.g.
+        of a logfile still being written, is ignored.
+        """
+        with open(filename, "rb") as f:
+            header = f.read(LOG_HEADERSIZE)
+        lines = header.split(b"\n")
+        if lines[0] != LOG_MAGIC or len(header) < LOG_HEADERSIZE:
+            raise ValueError(f"'{filename}' is not a binary logfile")
+        columns = [token.split(":", 1) for token in lines[1].decode().split()]
+        dtype = np.dtype([(name, kind) for name, kind in columns])
+        n = (os.path.getsize(filename) - LOG_HEADERSIZE) // dtype.itemsize
+        if n == 0:
+            records = np.zeros(0, dtype=dtype)
+        else:
+            records = np.memmap(
+                filename, dtype=dtype, mode="r", offset=LOG_HEADERSIZE, shape=(n,)
+            )
+        return {name: records[name] for name in dtype.names}
+
+
+def _open_binary_log(params, schema):
+    """Returns a 'BinaryLog' on the logfile, if binary logging is selected."""
+    logfile = params.get("logfile", None)
+    if not logfile or params.get("log_format", "text") != "binary":
+        return None
+    return BinaryLog(logfile, schema)
+
+
+class RunningStatistics:
+    """Weighted mean and variance of per-window quantities, in O(1) per update.
+
+    Every update adds one integration window, e.g. the pairs, singles and
+    efficiencies of a window, weighted by its integration time. The running
+    moments follow Welford's algorithm, so that long runs neither overflow
+    nor lose precision. The mode selects which windows contribute:
+
+        "cumulative": All windows since the last reset.
+        "window": Only the last 'length' windows, which are kept in a ring
+            buffer and removed from the moments again as they drop out.
+        "ewma": All windows with exponentially decaying weights, i.e. the
+            weight of a window halves every 'length' seconds of
+            integration time after it.
+
+    Usage:
+        >>> stats = RunningStatistics(["pairs", "s1"], mode="ewma", length=60)
+        >>> stats.update(1.0, pairs=1200, s1=50000)
+        >>> mean, error = stats.snapshot()["pairs"]
+
+    Args:
+        fields: Names of the quantities.
+        mode: One of 'RunningStatistics.MODES'.
+        length: Number of windows for "window", half-life in seconds for
+            "ewma", ignored for "cumulative".
+    """
+
+    MODES = ("cumulative", "window", "ewma")
+
+    def __init__(self, fields, mode="cumulative", length=None):
+        if mode not in self.MODES:
+            raise ValueError(f"Unrecognized averaging mode - '{mode}'")
+        if mode != "cumulative" and not (length and length > 0):
+            raise ValueError(f"Averaging mode '{mode}' needs a positive length")
+        self.fields = list(fields)
+        self.mode = mode
+        self.length = length
+        self._mean = None
+        self.reset()
+
+    def reset(self):
+        """Starts over, and returns the last snapshot before the reset."""
+        snapshot = None if self._mean is None else self.snapshot()
+        self.count = 0  # number of contributing windows
+        self.inttime = 0.0  # total integration time of these
+        self._weight = 0.0
+        self._weight2 = 0.0  # sum of squared weights, for effective sample size
+        self._mean = np.zeros(len(self.fields))
+        self._m2 = np.zeros(len(self.fields))  # sum of weighted squared deviations
+        self._ring = collections.deque()
+        return snapshot
+
+    def update(self, inttime, **values):
+        """Adds a window of given integration time with a value for each field."""
+        x = np.array([values[field] for field in self.fields], dtype=np.float64)
+        if self.mode == "ewma":
+            decay = 0.5 ** (inttime / self.length)
+            self._weight *= decay
+            self._weight2 *= decay * decay
+            self._m2 *= decay
+        self._add(inttime, x)
+        self.count += 1
+        self.inttime += inttime
+        if self.mode == "window":
+            self._ring.append((inttime, x))
+            if len(self._ring) > self.length:
+                w, x = self._ring.popleft()
+                self._remove(w, x)
+                self.count -= 1
+                self.inttime -= w
+
+    def _add(self, w, x):
+        self._weight += w
+        self._weight2 += w * w
+        delta = x - self._mean
+        self._mean += (w / self._weight) * delta
+        self._m2 += w * delta * (x - self._mean)
+
+    def _remove(self, w, x):
+        """Reverses '_add' for a window that drops out of the ring."""
+        self._weight -= w
+        self._weight2 -= w * w
+        if self._weight <= 0:
+            self._weight = self._weight2 = 0.0
+            self._mean[:] = 0
+            self._m2[:] = 0
+            return
+        delta = x - self._mean
+        self._mean -= (w / self._weight) * delta
+        self._m2 -= w * delta * (x - self._mean)
+        np.maximum(self._m2, 0, out=self._m2)  # rounding errors
+
+    def snapshot(self):
+        """Returns the current statistics, without changing them.
+
+        Returns:
+            Dictionary with a tuple of mean and its standard error for every
+            field, as well as 'count' and 'inttime' of the contributing
+            windows. The standard error is based on the effective number of
+            windows for the weights, and is NaN for less than two windows.
+        """
+        neff = self._weight**2 / self._weight2 if self._weight2 > 0 else 0
+        if neff > 1:
+            variance = self._m2 / self._weight * neff / (neff - 1)
+            errors = np.sqrt(variance / neff)
+        else:
+            errors = np.full(len(self.fields), np.nan)
+        result = {"count": self.count, "inttime": self.inttime}
+        for field, mean, error in zip(self.fields, self._mean, errors):
+            result[field] = (float(mean), float(error))
+        return result
+
+
+def _averaging_statistics(params, fields):
+    """Returns the 'RunningStatistics' for the averaging options in 'params'."""
+    mode = params.get("averaging_mode", "cumulative")
+    averaging_time = params["averaging_time"]
+    if mode == "window":
+        length = max(1, round(averaging_time / params["integration_time"]))
+        return RunningStatistics(fields, mode, length)
+    if mode == "ewma":
+        return RunningStatistics(fields, mode, averaging_time)
+    return RunningStatistics(fields)
+
+
+def _format_error(value, error, digits=1):
+    """Returns value with its standard error, if there is one."""
+    if np.isnan(error):
+        return str(round(value, digits))
+    return f"{value:.{digits}f}±{error:.{digits}f}"
+
+
 #############
 #  SCRIPTS  #
 #############
@@ -336,37 +641,680 @@ def _collect_as_script(alias=None):
     return collector
 
 
-def read_pairs(params, use_cache=False):
+def read_histogram_record(filename, bins):
+    """Parses the single-line record emitted by 'readevents7 -a3'.
+
+    Args:
+        filename: Path to file containing the record.
+        bins: List of number of bins for each requested histogram.
+
+    Returns:
+        Tuple of histograms (one per entry in 'bins'), singles on all four
+        channels, and the elapsed time between first and last event in seconds.
+    """
+    with open(filename, "r") as f:
+        return parse_histogram_record(f.read(), bins)
+
+
+def parse_histogram_record(record, bins):
+    """Parses the record text, see 'read_histogram_record'."""
+    if record.startswith("#error"):
+        raise ValueError(f"readevents7 error: {record[6:].strip()}")
+    values = np.array(record.split(), dtype=np.int64)
+    if values.size != 5 + sum(bins):
+        raise ValueError("Histogram record is incomplete.")
+    inttime = values[0] * 1e-9  # convert to units of seconds
+    hists = np.split(values[5:], np.cumsum(bins)[:-1])
+    return hists, values[1:5], inttime
+
+
+def request_window(socket_path, duration, specs=()):
+    """Requests a single integration window from a persistent readevents7.
+
+    The daemon is started separately with 'readevents7 -C socket_path', and
+    keeps the timestamp card streaming between requests.
+
+    Args:
+        socket_path: Path to the control socket of readevents7.
+        duration: Integration time, in seconds.
+        specs: List of 'readevents7 -H' histogram definitions.
+
+    Returns:
+        Record text, in the same format as emitted by 'readevents7 -a3'.
+    """
+    request = f"{duration * 1000:g}"
+    for spec in specs:
+        request += f" -H {spec}"
+    chunks = []
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as s:
+        s.connect(socket_path)
+        s.sendall(f"{request}\n".encode())
+        while True:
+            chunk = s.recv(65536)
+            if not chunk:
+                break
+            chunks.append(chunk)
+    return b"".join(chunks).decode()
+
+
+def _histogram_spec(params):
+    """Returns the 'readevents7 -H' histogram definition for the pair."""
+    # Include window at position 1
+    min_range = params["peak"] + params["window_left_offset"] - 1
+    return (
+        f"{params['channel_start']},{params['channel_stop']},"
+        f"{params['bin_width']},{params['bins']},{min_range}"
+    )
+
+
+def _pair_statistics(params, hist, s1, s2, inttime):
+    """Calculates pair statistics from raw histogram and singles counts."""
+    bins = params["bins"]
+    roffset = params["window_right_offset"]
+    loffset = params["window_left_offset"]
+    darkcounts = [
+        params["darkcount_ch1"],
+        params["darkcount_ch2"],
+        params["darkcount_ch3"],
+        params["darkcount_ch4"],
+    ]
+    darkcount_start = darkcounts[params["channel_start"] - 1]
+    darkcount_stop = darkcounts[params["channel_stop"] - 1]
+    window_size = roffset - loffset + 1
+    acc_start = max(bins // 2, 1)  # location to compute accidentals
+
+    # Calculate statistics
+    acc = window_size * np.mean(hist[acc_start:])
+    pairs = sum(hist[1 : 1 + window_size]) - acc
+
+    # Normalize to per unit second
+    s1 = s1 / inttime - darkcount_start  # timestamp data more precise
+    s2 = s2 / inttime - darkcount_stop
+    pairs = pairs / inttime
+    acc = acc / inttime
+
+    if s1 == 0 or s2 == 0:
+        e1 = e2 = eavg = 0
+    else:
+        e1 = 100 * pairs / s2
+        e2 = 100 * pairs / s1
+        eavg = 100 * pairs / (s1 * s2) ** 0.5
+    return pairs, acc, s1, s2, e1, e2, eavg
+
+
+def read_multipairs(params, overrides):
+    """Compute pair statistics for several channel pairs in a single pass.
+
+    All histograms are accumulated by readevents7 from the same acquisition,
+    so the event stream is decoded only once regardless of number of pairs.
+
+    Args:
+        params: Parameter dictionary, see 'read_pairs'.
+        overrides: List of parameter overrides, one for each pair, e.g.
+            '[{"channel_start": 1, "channel_stop": 2, "peak": 219}, ...]'.
+
+    Returns:
+        List of 'read_pairs'-like results, in the same order as 'overrides'.
+    """
+    duration = params["integration_time"]
+    timestamp = params["timestamp"]
+    outfile = params.get("outfile_path", "/tmp/quick_timestamp")
+    control_socket = params.get("control_socket", None)
+    pair_params = [dict(params, **override) for override in overrides]
+    specs = [_histogram_spec(_params) for _params in pair_params]
+    bins = [_params["bins"] for _params in pair_params]
+
+    args = ["-a3"]
+    for spec in specs:
+        args += ["-H", spec]
+    while True:
+        # Request window from persistent acquisition, if available
+        if control_socket:
+            record = request_window(control_socket, duration, specs)
+            hists, singles, inttime = parse_histogram_record(record, bins)
+
+        # Invoke timestamp histogram recording, only a single record stored
+        else:
+            timestamp._call_with_duration(args, duration=duration)
+            hists, singles, inttime = read_histogram_record(outfile, bins)
+
+        # Integration time check for data validity
+        if 0.75 < inttime / duration < 2:
+            break
+
+    results = []
+    for _params, hist in zip(pair_params, hists):
+        s1 = singles[_params["channel_start"] - 1]
+        s2 = singles[_params["channel_stop"] - 1]
+        stats = _pair_statistics(_params, hist, s1, s2, inttime)
+        results.append((hist, inttime, *stats))
+    return results
+
+
+def _readevents_args(params, outmode, window=None):
+    """Returns readevents7 arguments for gapless windows of given duration.
+
+    Without 'window', the arguments are for a single acquisition instead.
+    """
+    # DAC value of 0 corresponds to -1.024V, in steps of 0.75mV
+    threshold = round((params["threshvolt"] + 1.024) / 0.00075)
+    args = [
+        params["readevents_path"],
+        "-U",
+        params["device_path"],
+        f"-a{outmode}",
+        "-t",
+        str(threshold),
+    ]
+    if window is not None:
+        args += ["-w", f"{window * 1000:g}"]
+    if params.get("fast", False):
+        args.append("-f")
+    return args
+
+
+def stream_singles(params, window):
+    """Yields singles counts from a long-running 'readevents7 -a4'.
+
+    Each item is a tuple of counts on all four channels and the window
+    duration in seconds. Sending True into the generator instead discards
+    all windows acquired so far, including the window in progress, e.g.
+    after changing the setup; this cuts the stream like "mark" below:
+
+        stream = stream_singles(params, 0.01)
+        counts, inttime = next(stream)
+        counts, inttime = stream.send(True)
+
+    Sending "mark" instead cuts the window in progress with SIGHUP, and
+    discards everything up to the cut. The following windows start at the
+    cut on the card timestamps, so the n-th window after a mark covers
+    exactly (n-1)*window to n*window of card time after it, see
+    'scan_settings'.
+
+    Args:
+        params: Parameter dictionary, see 'read_pairs'.
+        window: Duration of each window, in seconds.
+    """
+    args = _readevents_args(params, 4, window)
+    with subprocess.Popen(args, stdout=subprocess.PIPE, bufsize=0) as proc:
+        fd = proc.stdout.fileno()
+        buffer = b""
+        records = []
+
+        def read_records(block):
+            nonlocal buffer
+            while block or select.select([fd], [], [], 0)[0]:
+                chunk = os.read(fd, 65536)
+                if not chunk:
+                    raise EOFError("readevents7 terminated")
+                *lines, buffer = (buffer + chunk).split(b"\n")
+                records.extend(lines)
+                if block and records:
+                    return
+
+        def next_record():
+            if not records:
+                read_records(block=True)
+            return records.pop(0).decode()
+
+        try:
+            while True:
+                record = next_record()
+                if record.startswith("#mark"):
+                    continue
+                _, counts, inttime = parse_histogram_record(record, [])
+
+                # Only the last window at termination can be incomplete,
+                # and the windows cut by a mark
+                if inttime < 0.999 * window:
+                    continue
+
+                # Both ways of discarding cut at a card time, as a partial
+                # line in the buffer would make record counting unreliable
+                discard = yield counts, inttime
+                if discard:
+                    proc.send_signal(signal.SIGHUP)
+                    while not next_record().startswith("#mark"):
+                        pass
+        finally:
+            proc.terminate()
+
+
+def scan_settings(stream, settings, apply, settle_time, integration_time, window):
+    """Yields the singles counts of each setting of a scan.
+
+    All settings are measured within one continuous acquisition of
+    'stream_singles'. After a setting is applied, the stream is marked, and
+    the windows within 'settle_time' of card time after the mark are
+    dropped; the following windows are summed up to 'integration_time'.
+    The result of a setting is only yielded once the next setting has been
+    applied and marked, so the processing of the caller overlaps with the
+    settling of the next setting.
+
+    Args:
+        stream: Generator from 'stream_singles'.
+        settings: Iterable of settings.
+        apply: Function that applies a setting.
+        settle_time: Time to drop after each change, in seconds. Should be
+            longer than the delivery latency of readevents7.
+        integration_time: Time to integrate per setting, in seconds.
+        window: Window duration of the stream, in seconds.
+
+    Yields:
+        Tuple of setting, counts on all four channels and integration time.
+    """
+    settle = int(np.ceil(settle_time / window - 1e-6))
+    windows = max(1, int(round(integration_time / window)))
+    pending = None
+    for setting in settings:
+        apply(setting)
+        counts, inttime = stream.send("mark")
+        if pending:
+            yield pending
+
+        total, total_time = np.zeros(4, dtype=np.int64), 0.0
+        for n in range(settle + windows):
+            if n > 0:
+                counts, inttime = next(stream)
+            if n >= settle:
+                total += counts
+                total_time += inttime
+        pending = (setting, total, total_time)
+    if pending:
+        yield pending
+
+
+def stream_multipairs(params, overrides):
+    """Yields 'read_multipairs'-like results for gapless integration windows.
+
+    A single readevents7 process cuts the event stream into contiguous windows
+    of 'integration_time' on the timestamps of the card, so there is no dead
+    time between windows, and every window has the exact duration.
+
+    Args:
+        params: Parameter dictionary, see 'read_pairs'.
+        overrides: List of parameter overrides, see 'read_multipairs'.
+    """
+    duration = params["integration_time"]
+    pair_params = [dict(params, **override) for override in overrides]
+    specs = [_histogram_spec(_params) for _params in pair_params]
+    bins = [_params["bins"] for _params in pair_params]
+
+    args = _readevents_args(params, 3, duration)
+    for spec in specs:
+        args += ["-H", spec]
+
+    with subprocess.Popen(args, stdout=subprocess.PIPE, text=True) as proc:
+        try:
+            for record in proc.stdout:
+                hists, singles, inttime = parse_histogram_record(record, bins)
+
+                # Only the last window at termination can be incomplete
+                if inttime < 0.999 * duration:
+                    continue
+
+                results = []
+                for _params, hist in zip(pair_params, hists):
+                    s1 = singles[_params["channel_start"] - 1]
+                    s2 = singles[_params["channel_stop"] - 1]
+                    stats = _pair_statistics(_params, hist, s1, s2, inttime)
+                    results.append((hist, inttime, *stats))
+                yield results
+        finally:
+            proc.terminate()
+
+
+def attach_event_ring(name):
+    """Maps the shared memory event ring published by 'readevents7 -M'.
+
+    Both returned arrays are views into the shared memory, i.e. they follow
+    the producer without any copying. The first eight header words are
+    described in 'tmstshm.h'.
+
+    Args:
+        name: Name of the ring as given to readevents7.
+
+    Returns:
+        Tuple of header and event ring, both as uint64 arrays.
+
+    Raises:
+        ValueError: Object is not (yet) a ring of the supported version.
+    """
+    path = pathlib.Path("/dev/shm") / name.lstrip("/")
+    with open(path, "rb") as f:
+        buffer = mmap.mmap(f.fileno(), 0, prot=mmap.PROT_READ)
+    header = np.frombuffer(buffer, dtype=np.uint64, count=8)
+    if header[0] != SHM_MAGIC or header[1] != SHM_VERSION:
+        raise ValueError(f"'{path}' is not a readevents7 event ring")
+    ring = np.frombuffer(
+        buffer,
+        dtype=np.uint64,
+        count=int(header[SHM_CAPACITY]),
+        offset=int(header[SHM_RINGOFFSET]),
+    )
+    return header, ring
+
+
+def stream_events(name, poll_interval=0.01, copy=True, oldest=False):
+    """Yields events from the shared memory event ring of 'readevents7 -M'.
+
+    Any number of readers can follow the same ring, each with its own cursor.
+    The producer never waits for readers, so a reader that falls behind by
+    more than the ring capacity loses the overwritten events; this is
+    detected and reported, never silently returned as corrupted data.
+
+    Each item is a tuple of an uint64 array with events in the format of
+    outmode 1, and the number of events lost since the previous item. With
+    'copy=False', the array is a view into the ring that is only guaranteed
+    intact when it is yielded, and has to be consumed before the producer
+    laps it. The generator ends after the producer has terminated.
+
+        for events, lost in stream_events("tmst0"):
+            channels = events & 0xF
+
+    Args:
+        name: Name of the ring as given to readevents7.
+        poll_interval: Wait between checks for new events, in seconds.
+        copy: Whether to copy events out of the ring.
+        oldest: Start with the oldest event still in the ring, instead of
+            the next event published.
+    """
+    header, ring = attach_event_ring(name)
+    capacity = len(ring)
+    commit = int(header[SHM_COMMIT])
+    cursor = max(commit - capacity, 0) if oldest else commit
+    lost = 0
+    while True:
+        commit = int(header[SHM_COMMIT])
+        if commit == cursor:
+            if header[SHM_PRODUCER] == 0 and int(header[SHM_COMMIT]) == cursor:
+                return
+            time.sleep(poll_interval)
+            continue
+
+        # Only events up to the end of the ring, the rest comes next round
+        start = cursor % capacity
+        n = min(commit - cursor, capacity - start)
+        events = ring[start : start + n]
+        if copy:
+            events = events.copy()
+
+        # Producer writes up to 'reserve' before it publishes 'commit'
+        overwritten = int(header[SHM_RESERVE]) - capacity
+        if overwritten > cursor:
+            lost += overwritten - cursor
+            cursor = overwritten
+            continue
+
+        cursor += n
+        yield events, lost
+        lost = 0
+
+
+class _TmstDecoder(ctypes.Structure):
+    """Mirrors 'struct tmst_decoder' in 'tmstreader.c'."""
+
+    _fields_ = [
+        ("rolloveroffset", ctypes.c_uint32),
+        ("oldevent", ctypes.c_uint32),
+        ("fast", ctypes.c_int),
+        ("shortmode", ctypes.c_int),
+        ("offsettime", ctypes.c_uint64 * 16),
+    ]
+
+
+def _load_tmstreader():
+    """Returns the event decoding library, loaded on first use.
+
+    The library is built with readevents7, and is taken from the path in
+    the 'TMSTREADER_LIB' environment variable if set. It is loaded as a
+    PyDLL, i.e. calls keep the GIL, since the decoder is not reentrant.
+    """
+    global _TMSTREADER
+    if _TMSTREADER is None:
+        lib = ctypes.PyDLL(os.environ.get("TMSTREADER_LIB", str(TMSTREADER_PATH)))
+        array = np.ctypeslib.ndpointer
+        lib.tmst_decode_events.argtypes = [
+            array(np.uint64, flags="C_CONTIGUOUS"),
+            ctypes.c_long,
+            ctypes.c_int,
+            array(np.int64, flags="C_CONTIGUOUS"),
+            array(np.uint8, flags="C_CONTIGUOUS"),
+        ]
+        lib.tmst_decode_events.restype = ctypes.c_long
+        lib.tmst_init_decoder.argtypes = [
+            ctypes.POINTER(_TmstDecoder),
+            ctypes.c_int,
+            ctypes.c_int,
+            ctypes.POINTER(ctypes.c_int),
+        ]
+        lib.tmst_init_decoder.restype = None
+        lib.tmst_decode_raw.argtypes = [
+            ctypes.POINTER(_TmstDecoder),
+            array(np.uint32, flags="C_CONTIGUOUS"),
+            ctypes.c_long,
+            array(np.int64, flags="C_CONTIGUOUS"),
+            array(np.uint8, flags="C_CONTIGUOUS"),
+        ]
+        lib.tmst_decode_raw.restype = ctypes.c_long
+        lib.tmst_compact_events.argtypes = [
+            array(np.uint8, flags="C_CONTIGUOUS"),
+            ctypes.c_long,
+        ]
+        lib.tmst_compact_events.restype = ctypes.c_long
+        lib.tmst_decode_compact.argtypes = [
+            array(np.uint8, flags="C_CONTIGUOUS"),
+            ctypes.c_long,
+            array(np.uint64, flags="C_CONTIGUOUS"),
+        ]
+        lib.tmst_decode_compact.restype = ctypes.c_long
+        _TMSTREADER = lib
+    return _TMSTREADER
+
+
+def decode_events(events, legacy_swap=False, inplace=False):
+    """Splits postprocessed events into timestamps and detector patterns.
+
+    Args:
+        events: uint64 array of events, as written by 'readevents7 -a1'.
+        legacy_swap: Whether the events were written with the '-X' option.
+        inplace: Whether the timestamps can overwrite 'events'.
+
+    Returns:
+        Tuple of timestamps in units of 1/256 ns as int64 array, and
+        detector patterns (bit 0 for channel 1, etc.) as uint8 array.
+    """
+    events = np.ascontiguousarray(events, dtype=np.uint64)
+    if inplace:
+        times = events.view(np.int64)
+    else:
+        times = np.empty(len(events), dtype=np.int64)
+    patterns = np.empty(len(events), dtype=np.uint8)
+    _load_tmstreader().tmst_decode_events(
+        events, len(events), int(legacy_swap), times, patterns
+    )
+    return times, patterns
+
+
+def read_events(filename, legacy_swap=False):
+    """Reads a file written by 'readevents7 -a1', see 'decode_events'."""
+    events = np.fromfile(filename, dtype=np.uint64)
+    return decode_events(events, legacy_swap, inplace=True)
+
+
+def read_compact(filename):
+    """Reads a file written by 'readevents7 -a5', see 'decode_events'.
+
+    An incomplete block at the end, e.g. of a file still being written,
+    is ignored.
+
+    Raises:
+        ValueError: File contains a corrupted block.
+    """
+    data = np.fromfile(filename, dtype=np.uint8)
+    return decode_events(_decode_compact(data, filename), inplace=True)
+
+
+def _decode_compact(data, filename):
+    """Returns the events of the complete blocks of outmode 5 in 'data'."""
+    lib = _load_tmstreader()
+    n = lib.tmst_compact_events(data, len(data))
+    events = np.empty(max(n, 0), dtype=np.uint64)
+    if n < 0 or lib.tmst_decode_compact(data, len(data), events) != n:
+        raise ValueError(f"'{filename}' contains corrupted event blocks")
+    return events
+
+
+def read_index(filename):
+    """Maps the time index written by 'readevents7 -x'.
+
+    Returns:
+        Tuple of the outmode of the indexed stream, and the index entries
+        as a structured array with the fields 'time' in units of 1/256 ns
+        and 'offset' in bytes, which is a view into the file.
+
+    Raises:
+        ValueError: File is not a time index of the supported version.
+    """
+    header = np.fromfile(filename, dtype=np.uint64, count=4)
+    if len(header) < 4 or header[0] != INDEX_MAGIC:
+        raise ValueError(f"'{filename}' is not a readevents7 time index")
+    if int(header[1]) & 0xFFFFFFFF != INDEX_VERSION:
+        raise ValueError(f"'{filename}' is not a readevents7 time index")
+    outmode = int(header[1]) >> 32
+    n = (os.path.getsize(filename) - INDEX_HEADERSIZE) // INDEX_DTYPE.itemsize
+    if n == 0:
+        return outmode, np.zeros(0, dtype=INDEX_DTYPE)
+    entries = np.memmap(
+        filename, dtype=INDEX_DTYPE, mode="r", offset=INDEX_HEADERSIZE, shape=(n,)
+    )
+    return outmode, entries
+
+
+def read_events_window(filename, index, start, stop, legacy_swap=False):
+    """Reads the events within a time window of a capture with a time index.
+
+    Only the part of the capture between the index entries around the
+    window is read, which are found with a binary search, so the time to
+    pull a window does not depend on the size of the capture. Works for
+    'readevents7 -a1' and '-a5' captures written with '-x'.
+
+        times, patterns = read_events_window(
+            "events.bin", "events.idx", start, start + 60 * 256e9
+        )
+
+    Args:
+        filename: Filename of the capture.
+        index: Filename of its time index.
+        start: Start of the window, in units of 1/256 ns like the
+            timestamps of 'decode_events'.
+        stop: End of the window, exclusive.
+        legacy_swap: Whether the events were written with the '-X' option.
+
+    Returns:
+        Tuple of timestamps and detector patterns, see 'decode_events'.
+    """
+    outmode, entries = read_index(index)
+    times = entries["time"]
+    size = os.path.getsize(filename)
+
+    # Procedure of 'tmstindex.h': k1, k2 are the last entries at or before
+    # start and stop, and one more entry on each side covers events out of
+    # order by the skews
+    k1 = int(np.searchsorted(times, start, side="right")) - 1
+    k2 = int(np.searchsorted(times, stop, side="right")) - 1
+    first = max(k1 - 1, 0)
+    last = k2 + 2
+    begin = int(entries["offset"][first]) if len(entries) else 0
+    end = int(entries["offset"][last]) if last < len(entries) else size
+    end = max(min(end, size), begin)
+    with open(filename, "rb") as f:
+        f.seek(begin)
+        data = np.fromfile(f, dtype=np.uint8, count=end - begin)
+
+    if outmode == 5:
+        events = _decode_compact(data, filename)
+    else:
+        events = data[: len(data) // 8 * 8].view(np.uint64)
+    times, patterns = decode_events(events, legacy_swap, inplace=True)
+    selected = (times >= start) & (times < stop)
+    return times[selected], patterns[selected]
+
+
+def make_decoder(fast=False, shortmode=False, skew=None):
+    """Returns a decoder state for 'decode_raw'.
+
+    Args:
+        fast: Whether the raw data is in the 32-bit format ('-f').
+        shortmode: Whether to reduce the timing resolution as with '-s'.
+        skew: Delays of the four channels in units of 1/256 ns, as with '-D'.
+    """
+    decoder = _TmstDecoder()
+    _skew = (ctypes.c_int * 4)(*skew) if skew is not None else None
+    _load_tmstreader().tmst_init_decoder(
+        ctypes.byref(decoder), int(fast), int(shortmode), _skew
+    )
+    return decoder
+
+
+def decode_raw(raw, decoder):
+    """Decodes raw timestamp card data, as written by 'readevents7 -a -1'.
+
+    The same code as in readevents7 is used, so the results are identical to
+    that of '-a1'. Consecutive blocks of a stream can be passed one after the
+    other with the same decoder.
+
+        decoder = make_decoder(fast=True)
+        times, patterns = decode_raw(block, decoder)
+
+    Args:
+        raw: Raw data as bytes-like object or uint32 array.
+        decoder: Decoder state from 'make_decoder'.
+
+    Returns:
+        Tuple of timestamps and patterns, see 'decode_events'.
+    """
+    if not isinstance(raw, np.ndarray):
+        raw = np.frombuffer(raw, dtype=np.uint32)
+    raw = np.ascontiguousarray(raw, dtype=np.uint32)
+    size = len(raw) if decoder.fast else len(raw) // 2
+    times = np.empty(size, dtype=np.int64)
+    patterns = np.empty(size, dtype=np.uint8)
+    n = _load_tmstreader().tmst_decode_raw(
+        ctypes.byref(decoder), raw, len(raw), times, patterns
+    )
+    if n < 0:
+        raise ValueError("Error decoding raw timestamp data")
+    return times[:n], patterns[:n]
+
+
+def read_pairs(params, use_cache=False, cache=False):
     """Compute single pass pair statistics.
 
+    The histogram is accumulated directly within readevents7, unless the
+    timestamp events are explicitly cached into the temporary file, i.e.
+    'cache' is set, or a previously cached file is reused with 'use_cache'.
+
     Note:
         Parameter dictionary passed instead of directly into kwargs, since:
             1. Minimize dependency with parser argument names
             2. Functions in the stack can reuse arguments,
                e.g. monitor_pairs -> read_pairs
     """
+    if not (use_cache or cache):
+        return read_multipairs(params, [{}])[0]
 
     # Unpack arguments into aliases
     bin_width = params["bin_width"]
     bins = params["bins"]
     peak = params["peak"]
-    roffset = params["window_right_offset"]
     loffset = params["window_left_offset"]
     duration = params["integration_time"]
-    darkcounts = [
-        params["darkcount_ch1"],
-        params["darkcount_ch2"],
-        params["darkcount_ch3"],
-        params["darkcount_ch4"],
-    ]
     channel_start = params["channel_start"] - 1
     channel_stop = params["channel_stop"] - 1
     timestamp = params["timestamp"]
+    outfile = params.get("outfile_path", "/tmp/quick_timestamp")
 
-    darkcount_start = darkcounts[channel_start]
-    darkcount_stop = darkcounts[channel_stop]
-    window_size = roffset - loffset + 1
-    acc_start = max(bins // 2, 1)  # location to compute accidentals
     while True:
         # Invoke timestamp data recording
         if not use_cache:
@@ -374,7 +1322,7 @@ def read_pairs(params, use_cache=False):
 
         # Extract g2 histogram and other data
         data = g2.g2_extr(
-            "/tmp/quick_timestamp",
+            outfile,
             channel_start=channel_start,
             channel_stop=channel_stop,
             highres_tscard=True,
@@ -388,30 +1336,65 @@ def read_pairs(params, use_cache=False):
         inttime = data[4] * 1e-9  # convert to units of seconds
 
         # Integration time check for data validity
-        if not (0.75 < inttime / duration < 2):
-            continue
+        if 0.75 < inttime / duration < 2:
+            break
 
-        # Calculate statistics
-        acc = window_size * np.mean(hist[acc_start:])
-        pairs = sum(hist[1 : 1 + window_size]) - acc
+    stats = _pair_statistics(params, hist, s1, s2, inttime)
+    return (hist, inttime, *stats)
 
-        # Normalize to per unit second
-        s1 = s1 / inttime - darkcount_start  # timestamp data more precise
-        s2 = s2 / inttime - darkcount_stop
-        pairs = pairs / inttime
-        acc = acc / inttime
 
-        if s1 == 0 or s2 == 0:
-            e1 = e2 = eavg = 0
-        else:
-            e1 = 100 * pairs / s2
-            e2 = 100 * pairs / s1
-            eavg = 100 * pairs / (s1 * s2) ** 0.5
+def find_peak(params, progress=None):
+    """Locks onto the coincidence peak with the adaptive search of readevents7.
 
-        # Single datapoint collection completed
-        break
+    The search range is the histogram given by 'bins' and 'peak' in units of
+    'bin_width', e.g. the wide range in 'inst-efficiency.findpeak.conf'.
+    readevents7 starts with coarse bins over the whole range and narrows
+    them around the peak as counts come in, from the same event stream, so
+    there is no need to reacquire the full range for every step.
 
-    return hist, inttime, pairs, acc, s1, s2, e1, e2, eavg
+    Args:
+        params: Parameter dictionary, see 'read_pairs'.
+        progress: Optional callable, called with the bin width and center
+            of the peak in nanoseconds, and the peak and background counts,
+            every time the search zooms in.
+
+    Returns:
+        Tuple of peak bin location, left and right window offsets, in units
+        of 'bin_width' as for the '--peak', '--left' and '--right' arguments,
+        the location of the first bin of the histogram at the final bin
+        width, and that histogram.
+    """
+    spec = (
+        f"{params['channel_start']},{params['channel_stop']},"
+        f"{params['bin_width']},{params['bins']},{params['peak']}"
+    )
+    args = _readevents_args(params, 3) + ["-F", spec]
+    result = None
+    with subprocess.Popen(args, stdout=subprocess.PIPE, text=True) as proc:
+        for line in proc.stdout:
+            if line.startswith("#peak"):
+                width, center, counts, background = map(float, line.split()[1:])
+                if progress:
+                    progress(width, center, int(counts), background)
+            elif line.startswith("#locked"):
+                result = tuple(map(int, line.split()[1:]))
+            elif result is not None:
+                hist = np.array(line.split()[5:], dtype=np.int64)
+                return (*result, hist)
+    raise RuntimeError("readevents7 terminated before the peak was found")
+
+
+@_collect_as_script("findpeak")
+def print_peak(params):
+    """Searches for the coincidence peak, and prints the matching arguments."""
+
+    def progress(width, center, counts, background):
+        print(f"Peak @ {center:g}ns in {width:g}ns bins", end=" ")
+        print(f"({counts} vs {background:g} background)")
+
+    peak, left, right, first, hist = find_peak(params, progress)
+    print(f"Window: {list(hist[peak - first + left : peak - first + right + 1])}")
+    print(f"Args: --peak={peak} --left={left} --right={right}")
 
 
 @_collect_as_script("pairs_once")
@@ -437,15 +1420,35 @@ def monitor_pairs(params):
     enable_hist = params.get("histogram", False)
     disable_hist = params.get("no_histogram", False)
     logfile = params.get("logfile", None)
+    binlog = _open_binary_log(
+        params,
+        [
+            ("TIME", "time"),
+            ("ITIME", float),
+            ("PAIRS", int),
+            ("ACC", float),
+            ("SINGLE1", int),
+            ("SINGLE2", int),
+            ("EFF1", float),
+            ("EFF2", float),
+            ("EFF_AVG", float),
+        ],
+    )
+    if binlog:
+        logfile = None  # records go into the binary logfile instead
 
     is_header_logged = False
     i = 0
     is_initialized = False
     prev = None
-    longterm_data = {"count": 0, "inttime": 0, "pairs": 0, "acc": 0, "s1": 0, "s2": 0}
-    while True:
-        hist, inttime, pairs, acc, s1, s2, e1, e2, eavg = read_pairs(params)
-
+    longterm = _averaging_statistics(
+        params, ["pairs", "acc", "s1", "s2", "e1", "e2", "eavg"]
+    )
+    if params.get("gapless", False):
+        results = (result[0] for result in stream_multipairs(params, [{}]))
+    else:
+        results = iter(lambda: read_pairs(params), None)
+    for hist, inttime, pairs, acc, s1, s2, e1, e2, eavg in results:
         # Visualize g2 histogram
         HIST_ROWSIZE = 10
         if not is_initialized or enable_hist:
@@ -519,8 +1522,9 @@ def monitor_pairs(params):
         i -= 1
 
         # Print statistics
+        now = dt.datetime.now()
         print_fixedwidth(
-            style(dt.datetime.now().strftime("%H%M%S"), style="dim"),
+            style(now.strftime("%H%M%S"), style="dim"),
             round(inttime, 1),
             style(int(pairs), style="bright"),
             round(acc, 1),
@@ -531,46 +1535,34 @@ def monitor_pairs(params):
             style(round(eavg, 1), fg="cyan", style="bright"),
             out=logfile,
         )
+        if binlog:
+            binlog.append(now, inttime, pairs, acc, s1, s2, e1, e2, eavg)
 
         # Print long-term statistics, only if value supplied
         if params["averaging_time"] > 0:
-            # Update first
-            longterm_data["count"] += 1
-            longterm_data["inttime"] += inttime
-            longterm_data["pairs"] += pairs
-            longterm_data["acc"] += acc
-            longterm_data["s1"] += s1
-            longterm_data["s2"] += s2
-
-            # Cache long term results if reach threshold
-            if longterm_data["inttime"] >= params["averaging_time"]:
-                counts = longterm_data["count"]
-                inttime = longterm_data["inttime"]
-                p = longterm_data["pairs"] / counts
-                acc = longterm_data["acc"] / counts
-                s1 = longterm_data["s1"] / counts
-                s2 = longterm_data["s2"] / counts
+            longterm.update(
+                inttime, pairs=pairs, acc=acc, s1=s1, s2=s2, e1=e1, e2=e2, eavg=eavg
+            )
+
+            # Cumulative averages are shown once 'averaging_time' is reached,
+            # and restarted; the others follow every window
+            snapshot = None
+            if longterm.mode != "cumulative":
+                snapshot = longterm.snapshot()
+            elif longterm.inttime >= params["averaging_time"]:
+                snapshot = longterm.reset()
+            if snapshot:
                 prev = (
                     dt.datetime.now().strftime("%H%M%S"),
-                    round(inttime, 1),
-                    style(int(round(p, 0)), fg="red", style="bright"),
-                    round(acc, 1),
-                    int(round(s1, 0)),
-                    int(round(s2, 0)),
-                    round(100 * p / s2, 1),
-                    round(100 * p / s1, 1),
-                    style(
-                        round(100 * p / (s1 * s2) ** 0.5, 1), fg="red", style="bright"
-                    ),
+                    round(snapshot["inttime"], 1),
+                    style(int(round(snapshot["pairs"][0])), fg="red", style="bright"),
+                    round(snapshot["acc"][0], 1),
+                    int(round(snapshot["s1"][0])),
+                    int(round(snapshot["s2"][0])),
+                    _format_error(*snapshot["e1"]),
+                    _format_error(*snapshot["e2"]),
+                    style(_format_error(*snapshot["eavg"]), fg="red", style="bright"),
                 )
-                longterm_data = {
-                    "count": 0,
-                    "inttime": 0,
-                    "pairs": 0,
-                    "acc": 0,
-                    "s1": 0,
-                    "s2": 0,
-                }
 
             # Print if exists
             if prev:
@@ -588,20 +1580,43 @@ def monitor_singles(params):
     darkcount_ch4 = params["darkcount_ch4"]
     timestamp = params["timestamp"]
     logfile = params.get("logfile", None)
+    binlog = _open_binary_log(
+        params,
+        [("TIME", "time")]
+        + [(name, int) for name in ("CH1", "CH2", "CH3", "CH4", "TOTAL")],
+    )
+    if binlog:
+        logfile = None  # records go into the binary logfile instead
     enable_avg = params.get("averaging", False)
+    control_socket = params.get("control_socket", None)
+    stream = None
+    if params.get("gapless", False):
+        stream = stream_singles(params, duration)
 
     is_header_logged = False
     i = 0
-    avg = np.array([0, 0, 0, 0])  # averaging facility, e.g. for measuring dark counts
-    avg_iters = 0
+    # Averaging facility, e.g. for measuring dark counts
+    average = _averaging_statistics(params, ["ch1", "ch2", "ch3", "ch4"])
     while True:
+        # Request window from persistent acquisition, if available
+        if control_socket:
+            record = request_window(control_socket, duration)
+            _, counts, inttime = parse_histogram_record(record, [])
+            if inttime == 0:
+                continue
+
+        # Contiguous windows from long-running acquisition
+        elif stream:
+            counts, inttime = next(stream)
+
         # Invoke timestamp data recording
-        data = timestamp.get_counts(
-            duration=duration,
-            return_actual_duration=True,
-        )
-        counts = data[:4]
-        inttime = data[4]
+        else:
+            data = timestamp.get_counts(
+                duration=duration,
+                return_actual_duration=True,
+            )
+            counts = data[:4]
+            inttime = data[4]
 
         # Rough integration time check
         if not (0.75 < inttime / duration < 2):
@@ -621,11 +1636,11 @@ def monitor_singles(params):
         # VDHA
         # counts = counts/ np.array([1,0.631,0.788,1.057])
 
-        # Implement rolling average to avoid overflow
+        # Running average, over the windows selected with 'averaging_mode'
         if enable_avg:
-            avg_iters += 1
-            avg = (avg_iters - 1) / avg_iters * avg + np.array(counts) / avg_iters
-            counts = np.round(avg, 1)
+            average.update(inttime, **dict(zip(average.fields, counts)))
+            snapshot = average.snapshot()
+            counts = np.round([snapshot[field][0] for field in average.fields], 1)
 
         # Print the header line after every 10 lines
         if i == 0:
@@ -643,12 +1658,15 @@ def monitor_singles(params):
         i -= 1
 
         # Print statistics
+        now = dt.datetime.now()
         print_fixedwidth(
-            style(dt.datetime.now().strftime("%H%M%S"), style="dim"),
+            style(now.strftime("%H%M%S"), style="dim"),
             *list(map(int, counts)),
             style(int(sum(counts)), style="bright"),
             out=logfile,
         )
+        if binlog:
+            binlog.append(now, *list(map(int, counts)), int(sum(counts)))
 
 
 @_collect_as_script("lcvr")
@@ -661,17 +1679,36 @@ def scan_lcvr_singles(params):
     )
     lcvr.all_channels_on()
 
-    voltages = np.round(np.linspace(0.9, 5.5, 9), 3)
+    voltages = np.round(np.linspace(0.9, 5.5, params.get("lcvr_steps") or 9), 3)
     combinations = product(voltages, repeat=4)
+    settle_time = params.get("settle_time", 0.1)
 
-    pbar = tqdm.tqdm(combinations)
-    for combination in pbar:
-        # Set LCVR values
+    def apply(combination):
         lcvr.V1, lcvr.V2, lcvr.V3, lcvr.V4 = combination
-        time.sleep(0.1)
 
-        # Invoke timestamp data recording
-        counts = timestamp.get_counts()
+    # Pipelined scan within one acquisition, with short windows that are
+    # attributed to the settings by the marks on the card timestamps
+    pbar = tqdm.tqdm(combinations)
+    if params.get("gapless", False):
+        stream = stream_singles(params, LCVR_SCAN_WINDOW)
+        next(stream)
+        results = scan_settings(
+            stream,
+            pbar,
+            apply,
+            settle_time,
+            params["integration_time"],
+            LCVR_SCAN_WINDOW,
+        )
+    else:
+        results = ((c, None, None) for c in pbar)
+
+    for combination, counts, _ in results:
+        # Set LCVR values and invoke timestamp data recording
+        if counts is None:
+            apply(combination)
+            time.sleep(settle_time)
+            counts = timestamp.get_counts()
         counts = (
             counts[0],
             counts[1],
@@ -707,11 +1744,10 @@ def read_2pairs(params):
         "window_right_offset": 1,
     }
 
-    _params = dict(params)
-    _params.update(override1_params)
-    _, _, p1, a1, s11, s12, *_ = read_pairs(_params)
-    _params.update(override2_params)
-    _, _, p2, a2, s21, s22, *_ = read_pairs(_params, use_cache=True)
+    # Both pairs extracted from the same acquisition
+    results = read_multipairs(params, [override1_params, override2_params])
+    _, _, p1, a1, s11, s12, *_ = results[0]
+    _, _, p2, a2, s21, s22, *_ = results[1]
     return p1, a1, s11, s12, p2, a2, s21, s22
 
 
@@ -735,6 +1771,16 @@ def print_2pairs(params):
 def monitor_2pairs(params):
     """Prints out pair source statistics, between ch1 and ch4."""
     logfile = params.get("logfile", None)
+    binlog = _open_binary_log(
+        params,
+        [("TIME", "time")]
+        + [
+            (name, float if name[0] == "A" else int)
+            for name in ("P1", "A1", "S11", "S12", "P2", "A2", "S21", "S22")
+        ],
+    )
+    if binlog:
+        logfile = None  # records go into the binary logfile instead
     is_header_logged = False
     i = 0
     while True:
@@ -759,8 +1805,9 @@ def monitor_2pairs(params):
         i -= 1
 
         # Print statistics
+        now = dt.datetime.now()
         print_fixedwidth(
-            style(dt.datetime.now().strftime("%H%M%S"), style="dim"),
+            style(now.strftime("%H%M%S"), style="dim"),
             style(int(p1), fg="yellow", style="bright"),
             style(round(a1, 1), style="bright"),
             int(s11),
@@ -771,6 +1818,8 @@ def monitor_2pairs(params):
             int(s22),
             out=logfile,
         )
+        if binlog:
+            binlog.append(now, p1, a1, s11, s12, p2, a2, s21, s22)
 
 
 ##########################
@@ -786,12 +1835,15 @@ ARGUMENTS = [
     "window_right_offset",
     "integration_time",
     "averaging_time",
+    "averaging_mode",
     "darkcount_ch1",
     "darkcount_ch2",
     "darkcount_ch3",
     "darkcount_ch4",
     "channel_start",
     "channel_stop",
+    "settle_time",
+    "lcvr_steps",
 ]
 
 
@@ -821,12 +1873,20 @@ def main():
     parser.add_argument(
         "--histogram", "-H", action="store_true",
         help="Enable histogram in pairs mode")
+    parser.add_argument(
+        "--gapless", action="store_true",
+        help="Contiguous integration windows on card timestamps, "
+        "in pairs, singles and lcvr modes")
     parser.add_argument(
         "--no-histogram", action="store_true",
         help="Disable histogram in pairs mode. Overrides other histogram options.")
     parser.add_argument(
         "--logging", "-l", nargs="?", action="store", const="unspecified",
         help="Log stuff")
+    parser.add_argument(
+        "--log_format", choices=("text", "binary"), default="text",
+        help="Format of the logfile, 'binary' for fixed-width records that "
+        "'read_log' maps without parsing")
     parser.add_argument(
         "--verbose", "-v", action="count", default=0,
         help="Specify debug verbosity")
@@ -840,7 +1900,7 @@ def main():
     # Device-level argument
     parser.add_argument(
         "--device_path", "-U", default="/dev/ioboards/usbtmst0",
-        help="Path to timestamp device")
+        help="Path to timestamp device, or 'sim:...' for a simulated device")
     parser.add_argument(
         "--readevents_path", "-S",
         default="/usr/bin/readevents7",
@@ -848,6 +1908,10 @@ def main():
     parser.add_argument(
         "--outfile_path", "-O", default="/tmp/quick_timestamp",
         help="Path to temporary file for timestamp storage")
+    parser.add_argument(
+        "--control_socket",
+        help="Control socket of a persistent 'readevents7 -C' acquisition, "
+        "instead of starting readevents7 for every integration window")
     parser.add_argument(
         "--threshvolt", "-t", type=float, default="-0.4",
         help="Pulse trigger level for each detector channel, comma-delimited")
@@ -876,7 +1940,11 @@ def main():
         help="Integration time for timestamp, in seconds")
     parser.add_argument(
         "--averaging_time", "--atime", type=float, default=0.0,
-        help="Auxiliary long-term integration time, in seconds")
+        help="Auxiliary long-term integration time, in seconds. Block length for "
+        "'cumulative' averaging, ring length for 'window', half-life for 'ewma'")
+    parser.add_argument(
+        "--averaging_mode", choices=RunningStatistics.MODES, default="cumulative",
+        help="Which windows the long-term statistics and singles averaging use")
     parser.add_argument(
         "--darkcount_ch1", "--ch1", "-1", type=float, default=0.0,
         help="Dark count level for detector channel 1, in counts/second")
@@ -895,6 +1963,12 @@ def main():
     parser.add_argument(
         "--channel_stop", "--stop", type=int, default=4,
         help="Target timestamp channel for calculating time delay offset")
+    parser.add_argument(
+        "--settle_time", type=float, default=0.1,
+        help="Time dropped after every setting change in lcvr mode, in seconds")
+    parser.add_argument(
+        "--lcvr_steps", type=int, default=9,
+        help="Number of voltages per LCVR channel in lcvr mode")
     parser.add_argument(
         "--color", action="store_true",
         help="Add preset color highlighting to text in stdout")
@@ -922,14 +1996,15 @@ def main():
 
         # Request for comments
         path_logfile = None
+        suffix = ".bin" if args.log_format == "binary" else ".log"
         if args.logging:
             # No arguments supplied, to query user manually
             if args.logging == "unspecified":
-                path_logfile = _request_filecomment()
+                path_logfile = _request_filecomment(suffix=suffix)
 
             # Comment for logfile supplied, use that
             else:
-                path_logfile = _append_datetime_logfile(args.logging)
+                path_logfile = _append_datetime_logfile(args.logging, suffix)
 
         # Silence all errors/tracebacks
         if args.quiet:
@@ -951,10 +2026,18 @@ def main():
         # Collect required arguments
         params = dict([(k, getattr(args, k, None)) for k in ARGUMENTS])
         params["logfile"] = path_logfile
+        params["log_format"] = args.log_format
         params["histogram"] = args.histogram
         params["no_histogram"] = args.no_histogram
         params["averaging"] = args.averaging
         params["timestamp"] = timestamp
+        params["outfile_path"] = args.outfile_path
+        params["control_socket"] = args.control_socket
+        params["gapless"] = args.gapless
+        params["device_path"] = args.device_path
+        params["readevents_path"] = args.readevents_path
+        params["threshvolt"] = args.threshvolt
+        params["fast"] = args.fast
 
         # Call script
         PROGRAMS[args.script](params)
@@ -0,0 +1,304 @@
+/* benchmark.c: Throughput test for the event processing of readevents7,
+   without a timestamp card. A synthetic (or recorded) DMA ring buffer is fed
+   through process_data() in the same segments as in the acquisition loop,
+   for all combinations of outmode, fast/normal input format, shortmode and
+   legacy word swap. For each combination, the processing speed is reported,
+   and a digest of the produced output is compared with a golden file.
+
+   usage: benchmark [-n repetitions] [-i ringfile [-f]] [-G goldenfile] [-g]
+                    [-s]
+
+   options:
+   -n repetitions :   How often the ring buffer is processed for the timing
+                      measurement. Default is 5.
+   -i ringfile :      Use the content of a recorded ring buffer instead of
+                      synthetic data. No golden file check is made in this
+		      case. Only the combinations for the 64 bit input
+		      format are run, unless -f is given.
+   -f :               The recorded ring buffer contains 32 bit events.
+   -G goldenfile :    File with the expected output digests. Default is
+                      benchmark_golden.txt
+   -g :               Write the digests into the golden file instead of
+                      checking them.
+   -s :               Don't use the SIMD kernel for the fastmode expansion.
+
+   Output is one line per combination with the name, the number of events,
+   events per second, nsec per event and the check result. The exit value is
+   the number of failed checks.
+
+*/
+
+#define READEVENTS7_NO_MAIN
+#include "readevents7.c"
+
+#define RINGSIZE (1<<22)   /* bytes in the synthetic ring buffer */
+#define SEGMENTSIZE (1<<16) /* bytes per processing round */
+#define DEFAULT_REPETITIONS 5
+#define DEFAULT_GOLDENFILE "benchmark_golden.txt"
+#define MAX_CASES 64
+#define SINGLESWINDOW (256LL*1000000) /* 1 msec windows for outmode 4 */
+
+/* a test case */
+struct benchcase {
+    char name[32];
+    int outmode, fastmode, shortmode, swap;
+    unsigned long long digest;
+    int events;
+    double nsperevent;
+};
+
+/* simple reproducible random generator, independent of libc */
+static uint64_t lcgstate = 0x2545f4914f6cdd1dULL;
+static uint32_t lcgrand(void) {
+    lcgstate = lcgstate*6364136223846793005ULL + 1442695040888963407ULL;
+    return lcgstate>>33;
+}
+
+/* fill the ring with events on the four detector channels, with a few
+   void entries as left by short urbs. Returns number of events. */
+static int make_ring(uint32_t *ring, int words, int fast) {
+    uint64_t t = 0; /* in 1/256 nsec */
+    int i, n=0;
+    for (i=0; i<words; ) {
+	if ((lcgrand() & 0x3ff) == 0) { /* void entries */
+	    ring[i++]=0; if (!fast && (i<words)) ring[i++]=0;
+	    continue;
+	}
+	t += lcgrand() % 50000; /* about 100 nsec per event at average */
+	if (fast) {
+	    ring[i++] = ((t & 0x3ffffff)<<6) | (1<<(lcgrand()&3));
+	} else {
+	    if (i+1 >= words) break;
+	    ring[i++] = (t<<10) | 0x300 | (1<<(lcgrand()&3));
+	    ring[i++] = (t<<10)>>32;
+	}
+	n++;
+    }
+    for (; i<words; i++) ring[i]=0;
+    return n;
+}
+
+/* FNV-1a digest of a memory block */
+static unsigned long long digest(char *data, size_t len) {
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    size_t i;
+    for (i=0; i<len; i++) {
+	h ^= (unsigned char)data[i]; h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* reset all processing state of readevents7 to the start of a run */
+static void reset_state(struct benchcase *bc) {
+    int i;
+    outmode = bc->outmode; fastmode = bc->fastmode;
+    shortmode = bc->shortmode; legacyswapoption = bc->swap;
+    rolloveroffset=0; oldevent=0; processedevents=0; numberofsamples=0;
+    skipnumber=0; running=1;
+    for (i=0; i<16; i++) offsettime[i] = (patt2det[i]<0) ? 0 : 1000*i;
+    /* outmode 4 counts in windows and has no histograms */
+    numberofhistograms = (outmode == 4) ? 0 : 1;
+    gaplesslength = (outmode == 4) ? SINGLESWINDOW : 0;
+    gaplessstart = -1;
+    histogram_reset();
+}
+
+/* feed the ring through process_data in segments like the main loop */
+static int feed_ring(uint32_t *ring, int words, FILE *outfile) {
+    int i, n, retval;
+    for (i=0; i<words; i+=n) {
+	n = SEGMENTSIZE/sizeof(uint32_t);
+	if (i+n > words) n=words-i;
+	retval = process_data(ring, i, i+n, outfile);
+	if (retval<0) return retval;
+    }
+    if (outmode == 3) histogram_emit(outfile);
+    if (outmode == 4) gapless_finish(outfile);
+    return 0;
+}
+
+/* run one case: a digest run into memory, then timed runs */
+static int run_case(struct benchcase *bc, uint32_t *ring, int words,
+		    int repetitions) {
+    char *mem; size_t memlen;
+    FILE *outfile;
+    struct timespec t0, t1;
+    int r;
+    double dt;
+
+    reset_state(bc);
+    outfile = open_memstream(&mem, &memlen);
+    if (!outfile) return -1;
+    if (feed_ring(ring, words, outfile)) return -1;
+    fclose(outfile);
+    bc->digest = digest(mem, memlen);
+    free(mem);
+
+    outfile = fopen("/dev/null", "w");
+    if (!outfile) return -1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (r=0; r<repetitions; r++) {
+	reset_state(bc);
+	if (feed_ring(ring, words, outfile)) return -1;
+    }
+    fflush(outfile);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    fclose(outfile);
+    dt = (t1.tv_sec-t0.tv_sec)*1E9 + (t1.tv_nsec-t0.tv_nsec);
+    bc->nsperevent = dt/((double)bc->events*repetitions);
+    return 0;
+}
+
+/* look up a digest in the golden file. Returns 0 on a match, 1 on a
+   mismatch and 2 if there is no entry */
+static int check_golden(char *goldenfile, struct benchcase *bc) {
+    FILE *g;
+    char name[32];
+    unsigned long long d;
+    int retval=2;
+    g = fopen(goldenfile, "r");
+    if (!g) return 2;
+    while (2==fscanf(g, "%31s %llx", name, &d)) {
+	if (!strcmp(name, bc->name)) {
+	    retval = (d==bc->digest) ? 0 : 1;
+	    break;
+	}
+    }
+    fclose(g);
+    return retval;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    int repetitions = DEFAULT_REPETITIONS;
+    char ringfilename[FILENAMLEN] = "";
+    char goldenfile[FILENAMLEN] = DEFAULT_GOLDENFILE;
+    int writegolden=0, noSIMD=0, recordedfast=0;
+    uint32_t *ring[2]; /* 64 bit and 32 bit input format */
+    int words[2], events[2];
+    struct benchcase cases[MAX_CASES], *bc;
+    int ncases=0, om, fm, sm, sw, i, failures=0, result;
+    FILE *f=NULL;
+    const char *resulttext[] = {"ok", "FAILED", "no golden entry"};
+
+    while ((opt=getopt(argc, argv, "n:i:fG:gs")) != EOF) {
+	switch(opt) {
+	case 'n':
+	    if (1!=sscanf(optarg, "%d", &repetitions) || (repetitions<1)) {
+		fprintf(stderr, "wrong repetition number\n"); return -1;
+	    }
+	    break;
+	case 'i':
+	    if (1!=sscanf(optarg, "%199s", ringfilename)) {
+		fprintf(stderr, "wrong ring file name\n"); return -1;
+	    }
+	    break;
+	case 'f':
+	    recordedfast=1;
+	    break;
+	case 'G':
+	    if (1!=sscanf(optarg, "%199s", goldenfile)) {
+		fprintf(stderr, "wrong golden file name\n"); return -1;
+	    }
+	    break;
+	case 'g':
+	    writegolden=1;
+	    break;
+	case 's':
+	    noSIMD=1;
+	    break;
+	default:
+	    fprintf(stderr, "usage: benchmark [-n repetitions] [-i ringfile "
+		    "[-f]] [-G goldenfile] [-g] [-s]\n");
+	    return -1;
+	}
+    }
+
+    /* input data */
+    for (fm=0; fm<2; fm++) {
+	ring[fm] = (uint32_t *)calloc(RINGSIZE, 1);
+	if (!ring[fm]) return -emsg(54);
+	words[fm]=0; events[fm]=0;
+    }
+    if (ringfilename[0]) { /* recorded data */
+	f = fopen(ringfilename, "r");
+	if (!f) {
+	    fprintf(stderr, "cannot open ring file\n"); return -1;
+	}
+	fm = recordedfast;
+	words[fm] = fread(ring[fm], sizeof(uint32_t), RINGSIZE/4, f) & ~1;
+	fclose(f);
+	for (i=0; i<words[fm]; i+=(fm?1:2))
+	    if (ring[fm][i] || (!fm && ring[fm][i+1])) events[fm]++;
+    } else {
+	for (fm=0; fm<2; fm++) {
+	    words[fm] = RINGSIZE/4;
+	    events[fm] = make_ring(ring[fm], words[fm], fm);
+	}
+    }
+    outbuf = (uint64_t *)malloc(RINGSIZE/4*sizeof(uint64_t));
+    if (!outbuf) return -emsg(54);
+
+    /* processing setup as in readevents7 */
+    init_hextable();
+    init_fastexpand();
+    if (noSIMD) fastexpand=NULL;
+    histdef[0] = (struct histogram_def){.start=0, .stop=1,
+	.binwidth=256*2, .bins=1024, .lo=-256*2*512};
+    histdef[0].hi = histdef[0].lo + histdef[0].bins*histdef[0].binwidth;
+    histdef[0].hist = calloc(histdef[0].bins, sizeof(unsigned long long));
+    if (!histdef[0].hist) return -emsg(48);
+    numberofhistograms=1;
+
+    /* list of test cases */
+    for (fm=0; fm<2; fm++) {
+	if (!words[fm]) continue;
+	for (om=-1; om<=5; om++) {
+	    for (sm=0; sm<2; sm++) {
+		if ((om<1) && sm) continue; /* no effect on raw data */
+		for (sw=0; sw<2; sw++) {
+		    if ((om!=1) && sw) continue; /* only in binary mode */
+		    bc = &cases[ncases++];
+		    bc->outmode=om; bc->fastmode=fm;
+		    bc->shortmode=sm; bc->swap=sw;
+		    bc->events=events[fm];
+		    snprintf(bc->name, sizeof(bc->name), "a%d%s%s%s", om,
+			     fm?"_f":"", sm?"_s":"", sw?"_X":"");
+		}
+	    }
+	}
+    }
+
+    /* run them */
+    if (writegolden) {
+	f = fopen(goldenfile, "w");
+	if (!f) {
+	    fprintf(stderr, "cannot open golden file\n"); return -1;
+	}
+    }
+    printf("%-12s %10s %12s %10s  %s\n",
+	   "case", "events", "events/s", "ns/event", "check");
+    for (i=0; i<ncases; i++) {
+	bc = &cases[i];
+	if (run_case(bc, ring[bc->fastmode], words[bc->fastmode],
+		     repetitions)) {
+	    fprintf(stderr, "processing error in case %s\n", bc->name);
+	    return -1;
+	}
+	if (writegolden) {
+	    fprintf(f, "%s %016llx\n", bc->name, bc->digest);
+	    result=0;
+	} else if (ringfilename[0]) {
+	    result=2;
+	} else {
+	    result=check_golden(goldenfile, bc);
+	    if (result) failures++;
+	}
+	printf("%-12s %10d %12.4g %10.3f  %s\n", bc->name, bc->events,
+	       1E9/bc->nsperevent, bc->nsperevent,
+	       writegolden?"written":resulttext[result]);
+    }
+    if (writegolden) fclose(f);
+
+    return failures;
+}
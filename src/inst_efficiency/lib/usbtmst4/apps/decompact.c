@@ -0,0 +1,101 @@
+/* decompact.c: Converts the compact block format of readevents7 -a5 back
+   into the event stream of outmode 1 or 2. The format is described in
+   tmstcompact.h.
+
+   usage: decompact [-a outmode] [-X] [-i infile]
+
+   options:
+   -a outmode :       1: binary 64 bit events as in readevents7 -a1. This
+                      is default. 2: the same as hex text.
+   -X :               Swap the 32 bit halves of the binary output, as with
+                      the legacy swap option of readevents7.
+   -i infile :        Read from infile instead of stdin.
+
+   Output goes to stdout. A corrupted or incomplete block at the end ends
+   the conversion with an error message on stderr.
+
+*/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "tmstcompact.h"
+
+#define FILENAMLEN 200
+#define DEFAULT_OUTMODE 1
+#define INBUFSIZE (4*TMSTCOMPACT_MAXBLOCK)
+
+/* error handling */
+char *errormessage[] = {
+    "No error.",
+    "Error parsing outmode", /* 1 */
+    "outmode out of range (1..2)",
+    "Error parsing input file name",
+    "Cannot open input file",
+    "Corrupted block in input", /* 5 */
+    "Incomplete block at end of input",
+};
+int emsg(int code) {
+  fprintf(stderr,"%s\n",errormessage[code]);
+  return code;
+};
+
+uint8_t inbuf[INBUFSIZE];
+uint64_t events[TMSTCOMPACT_MAXEVENTS];
+
+int main(int argc, char *argv[]) {
+    int opt;
+    int outmode = DEFAULT_OUTMODE;
+    int legacyswapoption = 0;
+    char infilename[FILENAMLEN] = "";
+    FILE *infile = stdin;
+    long fill=0, pos, size;
+    size_t r;
+    int n, i;
+
+    while ((opt=getopt(argc, argv, "a:Xi:")) != EOF) {
+	switch(opt) {
+	case 'a':
+	    if (1!=sscanf(optarg, "%d", &outmode)) return -emsg(1);
+	    if ((outmode<1) || (outmode>2)) return -emsg(2);
+	    break;
+	case 'X':
+	    legacyswapoption=1;
+	    break;
+	case 'i':
+	    if (1!=sscanf(optarg, "%199s", infilename)) return -emsg(3);
+	    break;
+	}
+    }
+    if (infilename[0]) {
+	infile = fopen(infilename, "r");
+	if (!infile) return -emsg(4);
+    }
+
+    do {
+	r = fread(&inbuf[fill], 1, INBUFSIZE-fill, infile);
+	fill += r;
+	/* all complete blocks in the buffer */
+	for (pos=0; ; pos+=size) {
+	    size = tmstcompact_decode(&inbuf[pos], fill-pos, events, &n);
+	    if (size<0) return -emsg(5);
+	    if (!size) break;
+	    if (outmode == 2) {
+		for (i=0; i<n; i++)
+		    printf("%016llx\n", (unsigned long long)events[i]);
+		continue;
+	    }
+	    if (legacyswapoption)
+		for (i=0; i<n; i++)
+		    events[i] = (events[i]<<32) | (events[i]>>32);
+	    fwrite(events, sizeof(uint64_t), n, stdout);
+	}
+	memmove(inbuf, &inbuf[pos], fill-pos);
+	fill -= pos;
+    } while (r);
+
+    if (fill) return -emsg(6);
+    return 0;
+}
@@ -15,7 +15,7 @@
 
    usage:  readevents7 [-q maxevents] [-r | -R ] [-v verbosity]
                        [-a outmode] [-A] 
-		       [-U devicenode]
+		       [-U devicenode]... [-k o1[,o2,o3,o4] ]
 		       [-X ]
 		       [-Q ]
 		       [-c  coincvalue ]
@@ -24,15 +24,31 @@
 		       [-s ] [-d t1,t2,t3,t4 | -D t1,t2,t3,t4]
 		       [-b blindmode,levela,levelb]
 		       [-t [t1[,t2,t3,t4]]]
+		       [-H start,stop,binwidth,bins,minrange ]...
+		       [-F start,stop,binwidth,bins,minrange ]
+		       [-p lowwater[,timeout] ]
+		       [-B buffersize ] [-u urbs ] [-l latency ] [-o policy ]
+		       [-z ]
+		       [-C socketpath ] [-w window ]
+		       [-M name[,capacity] ] [-J acq[,decode[,output]] ]
+		       [-I fd[,interval] ]
+		       [-m d1[,d2..] ] [-g window ] [-n N ]
+		       [-x indexfile[,interval] ]
 		       
    -q maxevents :     quit after a number of maxevents detected events.
-                      Default is 0, indicating eternal operation.
+                      Default is 0, indicating eternal operation. Events
+		      skipped with -S do not count. In the raw outmodes,
+		      the events in the raw data are counted the same way,
+		      without void entries, and output stops after the
+		      last one.
    -r :               starts immediate acquisition after card setup.
                       This is default.
    -R :               Initializes card, but does not start acquisition
                       until  a SIGUSR1 is received.
    -a outmode :       Defines output mode. Defaults currently to 0. Currently
                       implemented output modes are:
+		      -1: raw event code patterns as they come from the
+		         card, in binary form (64 bit, or 32 bit with -f).
 		      0: raw event code patterns are delivered as 64 bit
 		         hexadecimal patterns (i.e., 16 characters) 
 		         separated by newlines. Exact structure of
@@ -44,6 +60,33 @@
 			 4 bits contain the detector pattern.
 		      2: output consolidated timing info as 64 bit patterns
 		         as in option 1, but as hext text.
+		      3: coincidence histogram mode. No events are given out;
+		         instead, a start/stop time difference histogram
+			 (see -H option) is accumulated on the fly, and a
+			 single text line is emitted when acquisition
+			 ends. Format of that line:
+			   elapsed s1 s2 s3 s4 h0 h1 ... h(bins-1) ...
+			 where elapsed is the time between the first and
+			 last event in nsec, s1..s4 are the event counts
+			 on the four detector channels, and h0... are the
+			 histogram bins. For several -H options, the
+			 histograms follow each other in the same order.
+		      4: singles counter mode. No events are given out;
+		         events are counted per detector channel in
+			 contiguous windows (see -w option, default is
+			 100 msec), and a text line
+			   elapsed c1 c2 c3 c4
+			 is emitted for every window, with the same
+			 meaning as in outmode 3. Events with more than
+			 one detector in the pattern are not counted.
+		      5: compact binary format for archiving. The events of
+		         outmode 1 are stored losslessly in blocks with
+			 varint-encoded time differences and packed
+			 detector patterns, which takes about 2.5 to 3.5
+			 bytes per event. Every block header contains the
+			 event count and the full first event. Format: see
+			 tmstcompact.h; decompact turns it back into
+			 outmode 1 or 2.
    -v verbosity :     selects how much noise is generated on nonstandard
                       events. All comments go to stderr. A value of 0
 		      means no comments. Default is 0.
@@ -54,9 +97,25 @@
 		      significant 54 bit in multiples of 1/256 nsec.
    -U devicename:     allows to draw the raw data from the named device node.
                       If not specified, the default is /dev/ioboards/timestamp0
+		      With sim:r1,r2,r3,r4[:a,b,rate,delay[,ea,eb[,jitter]]]...
+		      [@seed], a simulated device is used instead. r1..r4
+		      are the background rates in counts per second on the
+		      four channels. Each :... group adds a source of
+		      correlated pairs with the given rate, detected on
+		      channels a and b (1..4) with efficiencies ea and eb
+		      (default 1), where b arrives delay nsec after a with an
+		      rms jitter in nsec (default 0). Up to 8 pair sources
+		      are possible; seed selects the random sequence.
+		      Up to 4 -U options acquire from several cards at the
+		      same time (see below).
+   -k o1[,o2,o3,o4]   Time offsets of the cards in the order of the -U
+                      options, in units of 1/256 nsec, added to the events
+		      of that card on top of the detector skew.
    -L lookuptabname:  define a file that contains a lookup table (plus ADC
                       preprocess info) instead of using the linear fill and
-		      lores routing.
+		      lores routing. With a driver that supports it, the
+		      table is sent in one go, and not at all if the card
+		      still holds the same table from an earlier run.
    -X                 Legacy swap option for high word / low word
    -Q                 Power off after termination
    -c coincvalue:     Set the coincidence time window in internal FPGA delay
@@ -78,8 +137,184 @@
 		      corresponding to -448mV NIM status. The polarity is set
 		      negative for values below 1365, and positive for values
 		      values above.
-   -f                 Fast option. Uses 32bit intermediate format.
+   -f                 Fast option. Uses 32bit intermediate format. The
+                      expansion to 64 bit events uses AVX2 or NEON
+		      instructions if the processor has them.
    -Z                 Force power cycle of SET_POWER_STATE
+   -H start,stop,binwidth,bins,minrange
+                      Histogram definition for outmode 3. start and stop are
+		      detector channels (1..4), binwidth is the bin width in
+		      nsec (can be fractional, is rounded to 1/256 nsec), bins
+		      is the number of bins (1..65536), and minrange is the
+		      time difference of the first bin in units of the bin
+		      width (can be negative). Bin i counts stop events that
+		      arrive between (minrange+i) and (minrange+i+1) bin
+		      widths after a start event. Can be given up to 16
+		      times; all histograms are filled in the same pass.
+   -F start,stop,binwidth,bins,minrange
+                      Adaptive peak search in outmode 3, which this option
+		      implies. The histogram with the same definition as -H
+		      is the search range; it starts with 64 coarse bins
+		      over that range, the last one cut at its end, and
+		      zooms in by a factor of 4 around the highest bin
+		      whenever that stands out of the background by 6
+		      standard deviations, until the bins have the given
+		      width. Every stage stays within the search range.
+		      Each zoom step emits a line
+		        #peak binwidth center counts background
+		      with the coarse bin width and the bin center in nsec.
+		      Once the peak is significant in the final bins, and
+		      its bin has more than 16 counts, a line
+		        #locked peak left right minrange
+		      gives the peak bin in units of binwidth (as minrange of
+		      -H), the window of bins above twice the background
+		      and 1/16 of the peak relative to it, and the first of
+		      the final 64 bins. The acquisition then ends with the
+		      record of these bins. Does not work with -H, -w or -C.
+   -p lowwater[,timeout]
+                      Wait for data with poll() on the device instead of
+		      polling the byte counter every 10 msec. The wait ends
+		      as soon as lowwater bytes (default 1) have arrived since
+		      the last round, or after timeout msec (default 1000).
+		      Falls back to the polling timer if the driver does not
+		      support poll().
+   -B buffersize      Size of the DMA ring buffer in bytes. Needs to be a
+                      power of 2 between 64kB and 1GB. Default is the size
+		      suggested by the driver, or 4MB. In small rings, the
+		      driver keeps its transfers below ringsize/urbs.
+   -u urbs            Number of USB transfers in flight (1..64). Default is
+                      what the driver was loaded with, usually 4.
+   -l latency         Delivery latency target of the driver in usec. The
+                      driver then sizes its USB transfers such that each
+		      one fills within the target, and hands over the data
+		      of a transfer that takes longer, so live feedback sees
+		      events within about the target even at low rates
+		      (down to the 512 byte packets of the card). 0 selects
+		      the old controller, which goes for the largest
+		      transfers and an irq rate below 100 Hz, best for
+		      archiving. Default is what the driver was loaded with.
+   -z                 Zero-copy output for outmode -1. Segments of the DMA
+                      buffer are handed to stdout with vmsplice() if stdout
+		      is a pipe, or with write() otherwise, bypassing stdio.
+		      In the pipe case, the DMA buffer is released to the
+		      driver only after the pipe could have drained.
+   -C socketpath      Persistent acquisition. The card is set up once and
+                      keeps streaming; integration windows are requested
+		      over a unix stream socket at socketpath. A client
+		      connects and sends one line
+		        duration [-H start,stop,binwidth,bins,minrange]...
+		      with the window length in msec and histograms as for
+		      the -H option; it receives the outmode 3 record of a
+		      window of that length in event time, starting with the
+		      data after the request, and the connection is closed.
+		      Errors are returned as a line starting with #error.
+		      The line "quit" terminates the acquisition. Implies
+		      outmode 3; -H options on the command line are ignored.
+   -w window          Gapless windows for outmode 3 and 4. The event stream is cut
+                      into contiguous windows of the given length in msec
+		      on the timestamps of the card, starting with the first
+		      event, and the outmode 3 record of every window is
+		      emitted once the window is complete. The elapsed time
+		      in the record is the exact window length, except for
+		      the last, incomplete window at the end of acquisition.
+		      Every event is in exactly one window. SIGHUP cuts
+		      a window short, see below.
+   -o policy          What happens if the reader falls behind the DMA ring
+                      buffer. 0: data is overwritten silently (old
+		      behaviour), 1: the driver holds back USB transfers
+		      until the reader has caught up, so data accumulates in
+		      the FIFO of the device, 2: data is overwritten, but the
+		      driver counts the lost bytes. Default is 1 if the
+		      driver supports it. In any case, the reader detects if
+		      it was lapped by the DMA engine, skips the corrupted
+		      data and reports the lost bytes on stderr. At the end,
+		      a status line of the form
+		      #status lost_bytes=n driver_lost_bytes=n overruns=n
+		      is sent to stderr if data was lost or verbosity>0.
+   -M name[,capacity]
+                      Publish the postprocessed events also into a ring in
+		      the POSIX shared memory object /dev/shm/name, from
+		      which any number of programs can read them at the same
+		      time, in the format of outmode 1. capacity is the ring
+		      size in events, a power of 2 up to 2^27; default is
+		      2^22 (32 MB). Readers do not slow down the acquisition,
+		      but detect if they fell behind by more than the ring.
+		      The object is removed at the end. Layout and protocol
+		      are described in tmstshm.h. Needs outmode 1..5.
+   -J acq[,decode[,output]]
+                      Threaded pipeline. The main thread only keeps track
+		      of the DMA ring and hands segments of it on; a decoder
+		      thread turns them into events with the skew correction,
+		      and a writer thread formats and outputs them, so a
+		      blocked output does not hold up the decoding. The
+		      threads are pinned to the given cores, or not pinned
+		      for a value of -1 or if not given. In the raw outmodes,
+		      the writer takes data straight from the DMA ring. Use
+		      with overrun policy 1 (-o), as segments in flight are
+		      not checked for overruns. Does not work with -z or -C.
+   -I fd[,interval]   Periodic statistics on the already open file
+                      descriptor fd (e.g. 3 with 3>stats.txt in the shell),
+		      every interval seconds (default 1), as lines
+		        #stats t=.. events=.. rate=.. bytes=.. rounds=..
+		        bytes_per_round=.. process_us=.. output=.. fill=..
+		        fillmax=..
+		      on a single line each. t is the time since the start
+		      of acquisition in seconds; events, rate, bytes and
+		      rounds count what was processed since the previous
+		      line; process_us is the mean time of a processing
+		      round in usec, output stage included; output is the
+		      fraction of time spent in the output stage, where a
+		      blocking consumer shows up; fill and fillmax are the
+		      last and highest fill level of the DMA ring as
+		      fraction of its size. A ring that fills up while
+		      processing takes long points to the host, a low fill
+		      with few bytes per round to the USB side. The driver
+		      keeps its own counters in debugfs, under tmst4/. With
+		      -J, process_us only covers the hand-over of segments.
+   -m d1[,d2..]       Only pass events of the listed detectors 1..4 on to
+                      the output. Events with several detector bits pass
+		      if one of them is listed; with several cards, the
+		      mask applies to the detectors of all cards.
+   -g window          Coincidence filter. Only events that have a partner
+                      within window nsec on another detector (or another
+		      card) are passed on; events with several detector
+		      bits count as coincidences by themselves. The window
+		      is applied after the skew correction. Events are held
+		      back until the stream has advanced by the window and
+		      the skew spread, and the rest is sent out at the end.
+   -n N               Decimation. Only every Nth event that made it through
+                      -m and -g is passed on, e.g. to keep a visualization
+		      stream light. The count runs on over the whole
+		      acquisition, so the selection is deterministic.
+		      The filters work in outmodes 1..5 and apply to all
+		      output including -M; -q counts the events before
+		      the filters.
+   -x indexfile[,interval]
+                      Write a time index of the output stream of outmode 1
+		      or 5 into indexfile: the byte offset of the first
+		      event (or compact block) at or after every multiple of
+		      interval msec of event time, default 100. A reader
+		      finds the part of a long capture around a given time
+		      with a binary search in the index instead of a scan,
+		      also with -A for the absolute time. Layout in
+		      tmstindex.h. Offsets count from the start of the
+		      output, so stdout should go to a fresh file.
+
+   Several cards:
+   With more than one -U option, all cards are set up in the same way and
+   started back to back, and their events are merged into one time-ordered
+   stream. Bits 4 and 5 of every event carry the number of the card
+   (0..3, in the order of the -U options) instead of the lower card flags.
+   The time base of each card is its own counter, reset when acquisition
+   starts, so the clocks of the cards differ by the start latency (tens of
+   usec) and drift apart with the accuracy of their oscillators unless they
+   share a reference clock; constant offsets are corrected with -k. Events
+   of a card are held back until all other cards have delivered events up
+   to the same time; a card that had no events for 0.5 sec does not hold up
+   the others, so its events may come late if it starts again. Needs
+   outmode 1, 2 or 5, and works with -M but not with -J or -C. Skew, skip
+   number and -q apply as for one card; -q counts the merged events, and
+   the #status line sums over all cards.
 
 		      
    Signals:
@@ -93,6 +328,15 @@
               messages on stderr.
    SIGINT:    terminates the accquisition gracefully without further
               messages on stderr.
+   SIGHUP:    with gapless windows (-w), cuts the current window at the
+              first event processed after the signal: its record goes out
+	      with the shorter elapsed time, followed by a line
+	        #mark time
+	      with the card time of the cut in nsec, and the next windows
+	      start at the cut. Marks setting changes of an experiment in
+	      the card time base. The cut is late by the data still in the
+	      DMA ring, up to the delivery latency (see -l). Ignored
+	      otherwise.
 
 
     Status of code:
@@ -110,6 +354,7 @@
 
 */
 
+#define _GNU_SOURCE /* for vmsplice */
 #include <stdio.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
@@ -122,17 +367,41 @@
 #include <string.h>
 #include <errno.h>
 #include <stdint.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2_KERNEL
+#endif
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNEL
+#endif
 
 
 #include "timestampcontrol.h"
 #include "configtmst.h"
+#include "tmstshm.h"
+#include "tmstcompact.h"
+#include "tmstindex.h"
 
 
 #define FILENAMLEN 200
 #define DEFAULTDEVICENAME "/dev/ioboards/usbtmst0"
+#define MAX_CARDS 4 /* number of -U options */
 
 #define DEFAULT_SKIPNUM 0   /* forget no entries at beginning */
 #define DEFAULT_POLLING_INTERVAL 10 /* in milliseconds */
+#define DEFAULT_LOWWATER 1 /* in bytes, for -p option */
+#define DEFAULT_POLL_TIMEOUT 1000 /* in milliseconds, for -p option */
 #define DEFAULT_OUTMODE 0
 #define DEFAULT_VERBOSITY 0
 #define DEFAULT_MAXEVENTS 0
@@ -140,6 +409,10 @@
 #define DEFAULT_COINC 0  /* for -c option */
 #define MAX_COINC_VALUE 31
 #define DEFAULT_INPUTTRHESHOLD 768 /* for -t option, corresponds to -448mV */
+#define DEFAULT_SINGLESWINDOW 100 /* in msec, for outmode 4 */
+#define MAX_HISTBINS 65536 /* for -H option */
+#define MAX_HISTOGRAMS 16 /* number of -H options */
+#define HISTRING_SIZE 4096 /* power of 2, history of events per channel */
 #define POWER_ON 1
 #define POWER_OFF 0
 #define POWER_SLEEP_SECONDS 1.5 /* POWER OFF time to reset HW before
@@ -152,9 +425,11 @@
 #define LUT_LOADED 0x01
 
 /* readback buffer stuff. These numbers are in bytes */
-#define Readback_buffersize (1<<22)
+#define DEFAULT_READBACK_BUFFERSIZE (1<<22) /* if driver cannot suggest any */
+#define MIN_READBACK_BUFFERSIZE (1<<16)
+#define MAX_READBACK_BUFFERSIZE (1<<30)
 #define INITIAL_TRANSFERLENGTH (1<<16)
-#define dmasize_in_uint64 (Readback_buffersize / sizeof(uint64_t))
+#define MAX_URBS_NUMBER 64
 
 /* some global variables */
 int outmode = DEFAULT_OUTMODE;
@@ -165,6 +440,7 @@ int fastmode=0;  /* if 1, usb timestamps are 32 bit wide */
 
 int skipnumber = DEFAULT_SKIPNUM; /* entries at beginning to be skiped */
 uint32_t *rbbuffer; /* pointer to readback buffer */
+unsigned long readback_buffersize = 0; /* size of mmaped buffer in bytes */
 
 /* things needed for the USB device  */
 #define default_usbtimetag_devicename "/dev/ioboards/timestamp0"
@@ -186,7 +462,7 @@ char *errormessage[] = {
     "Lookuptable does not contain enough rows", /* 10 */
     "Lookuptable contains illegal entry",
     "Error parsing outmode",
-    "outmode out of range (0..2)",
+    "outmode out of range (-1..5)",
     "Can not parse maxevents",
     "Maxevents out of range", /* 15 */
     "Error reading LUT from flash",
@@ -218,256 +494,2224 @@ char *errormessage[] = {
     "Threshold parameter out of range",
     "Error writing to threshold DAC",
     "Outmode 0 doesn't support short timestamps",
+    "wrong histogram format. needs -H start,stop,binwidth,bins,minrange", /* 45 */
+    "Histogram parameter out of range, or more than 16 histograms",
+    "Outmode 3 needs a histogram definition (-H option)",
+    "Cannot allocate histogram memory",
+    "wrong poll format. needs -p lowwater[,timeout]",
+    "Error setting low-water mark", /* 50 */
+    "Buffer size needs a power of 2 between 64kB and 1GB",
+    "Number of urbs out of range (1..64)",
+    "Error setting number of urbs",
+    "Cannot allocate output buffer",
+    "Overrun policy out of range (0..2)", /* 55 */
+    "Error setting overrun policy",
+    "Zero-copy output (-z) needs outmode -1",
+    "wrong simulated device format. needs -U sim:r1,r2,r3,r4[:pair]...",
+    "Simulated device parameter out of range, or more than 8 pairs",
+    "Error parsing control socket path", /* 60 */
+    "Cannot open control socket",
+    "Window length out of range, needs -w msec",
+    "Gapless windows (-w) need outmode 3 or 4 and no control socket (-C)",
+    "wrong shared memory format. needs -M name[,capacity]",
+    "Shared memory capacity needs a power of 2 between 2^10 and 2^27", /* 65 */
+    "Cannot create shared memory ring",
+    "Shared memory export (-M) needs outmode 1..5",
+    "wrong thread format. needs -J acq[,decode[,output]] with core numbers",
+    "Threaded pipeline (-J) does not work with -z or -C",
+    "Cannot start pipeline threads or pin them to cores", /* 70 */
+    "Too many devices, at most 4 -U options",
+    "wrong card offset format. needs -k o1[,o2,o3,o4]",
+    "Several cards (-U) need outmode 1, 2 or 5 and no -J or -C",
+    "wrong peak search format. needs -F start,stop,binwidth,bins,minrange",
+    "Peak search (-F) does not work with -H, -w or -C", /* 75 */
+    "wrong statistics format. needs -I fd[,interval] with interval>0",
+    "Latency target out of range, needs -l usec with 0..1000000",
+    "Error setting latency target",
+    "wrong detector mask format. needs -m d1[,d2..] with detectors 1..4",
+    "Coincidence filter window out of range, needs -g nsec with nsec>0", /* 80 */
+    "Decimation out of range, needs -n N with N>=1",
+    "Filters (-m, -g, -n) need outmode 1..5",
+    "No memory for the coincidence filter",
+    "wrong index format. needs -x indexfile[,interval] with interval>0",
+    "Cannot open index file", /* 85 */
+    "Time index (-x) needs outmode 1 or 5",
 };
 int emsg(int code) {
   fprintf(stderr,"%s\n",errormessage[code]);
   return code;
 };
 
-/* ----------------------------------------------------------------------*/
-/* signal handler */
-/* structures for timer interrupts */
-const struct itimerval polltime = {{0,DEFAULT_POLLING_INTERVAL*1000},
-				   {0,DEFAULT_POLLING_INTERVAL*1000}};
-const struct itimerval stoptime = {{0,0},{0,0}}; 
-void timer_handler(int sig) {
-    /* nothing to do, we just return */
+/* ----------------------------------------------------------------------*/
+/* signal handler */
+/* structures for timer interrupts */
+const struct itimerval polltime = {{0,DEFAULT_POLLING_INTERVAL*1000},
+				   {0,DEFAULT_POLLING_INTERVAL*1000}};
+const struct itimerval stoptime = {{0,0},{0,0}}; 
+void timer_handler(int sig) {
+    /* nothing to do, we just return */
+}
+/* declare handler */
+struct sigaction timeraction = {.sa_handler = &timer_handler,
+				.sa_flags = SA_RESTART,};
+
+/* SIGUSR machinery */
+int sigusrnote=0; /* to notify main loop about a signal, avoid complicated
+		   stuff at this point, as sigusr are not very time-critical */
+void sigusr_handler(int sig) {
+    if (sig==SIGUSR1) sigusrnote=1;
+    if (sig==SIGUSR2) sigusrnote=2;
+}
+/* declare handler */
+struct sigaction sigusr_action = {.sa_handler = &sigusr_handler,
+				  .sa_flags = SA_RESTART,};
+/* SIGHUP marks a cut of the gapless windows */
+int gaplessmark=0;
+void sighup_handler(int sig) {
+    gaplessmark=1;
+}
+struct sigaction sighup_action = {.sa_handler = &sighup_handler,
+				  .sa_flags = SA_RESTART,};
+/* termination signal handler */
+int running=0; /* global process variables for running status */
+void sigterm_handler(int sig) {
+    switch (sig) {
+    case SIGTERM:
+	//fprintf(stderr,"SIGTERM received\n");
+	running=0;
+	break;
+    case SIGPIPE:
+	//fprintf(stderr,"SIGPIPE received\n");
+	running=0;
+	break;
+    case SIGINT:
+	//fprintf(stderr,"SIGINT received\n");
+	running=0;
+	break;
+    }
+}
+/* declare handler */
+struct sigaction sigterm_action = {.sa_handler = &sigterm_handler,
+				   .sa_flags = SA_RESTART,};
+
+
+/* variables and code for processing events */
+int numberofsamples = DEFAULT_MAXEVENTS; /* sampled events. 0 means unlimited,
+					int is ok for small limited lengths */
+int processedevents = 0; /* only relevant if numberofsamples !=0 */
+uint64_t offsettime[16]; /* time differences for different detector states */
+int legacyswapoption=0;  /* if set, swap to old version of binary output */
+char patt2det[16] = {-1, 0, 1, -1, 2, -1, -1, -1, 3, -1, -1, -1, -1, -1, -1, -1}; /* translation table patt->det */
+
+/* intermediate buffer for processed events */
+uint64_t *outbuf; /* holds postprocessed data, one entry per input word  */
+uint32_t rolloveroffset=0;          /* used for 32bit patterns, upper32bit */
+uint32_t newevent, oldevent=0;      /* rollover detection */
+
+/* block kernels for the 32 bit fastmode expansion. They do the same as the
+   scalar loop of the decoding kernels on 8 words at a time: drop void
+   words, count rollovers of bit 31, expand to 64 bit events, apply the
+   shortmode mask and add the per-pattern offset. Return the number of
+   events written into dst. */
+#define FASTBLOCK 8 /* words per kernel step */
+int (*fastexpand)(uint32_t *src, int nwords, uint64_t *dst) = NULL;
+uint32_t compact_lut[256][8]; /* lane indices of nonzero words in a step */
+uint8_t prefix_lut[256][8];   /* running count of set bits up to a lane */
+
+#ifdef HAVE_AVX2_KERNEL
+__attribute__((target("avx2")))
+static int fastexpand_avx2(uint32_t *src, int nwords, uint64_t *dst) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i lowbits = _mm256_set1_epi64x(0x3f);
+    const __m256i highbits = _mm256_set1_epi64x(0xffffffc0LL);
+    const __m256i fixbits = _mm256_set1_epi64x(0x300);
+    const __m256i pattbits = _mm256_set1_epi64x(0xf);
+    const __m256i smask = _mm256_set1_epi64x((shortmode==1) ?
+					     0xffffffffffff83ffLL : -1LL);
+    __m256i v, c, w, r, ev;
+    int i, j=0, n, nzm, hc, rm;
+    for (i=0; i+FASTBLOCK<=nwords; i+=FASTBLOCK) {
+	v = _mm256_loadu_si256((__m256i *)&src[i]);
+	nzm = ~_mm256_movemask_ps(_mm256_castsi256_ps(
+	    _mm256_cmpeq_epi32(v, zero))) & 0xff;
+	if (!nzm) continue; /* all void */
+	n = __builtin_popcount(nzm);
+	/* compact nonzero words to the bottom */
+	c = _mm256_permutevar8x32_epi32(
+	    v, _mm256_loadu_si256((__m256i *)compact_lut[nzm]));
+	/* rollover where bit 31 goes from 1 to 0 between subsequent words */
+	hc = _mm256_movemask_ps(_mm256_castsi256_ps(c)) & ((1<<n)-1);
+	rm = ((hc<<1) | (oldevent>>31)) & ~hc & ((1<<n)-1);
+	r = _mm256_set1_epi64x(rolloveroffset);
+	/* lower four events */
+	w = _mm256_cvtepu32_epi64(_mm256_castsi256_si128(c));
+	ev = _mm256_or_si256(
+	    _mm256_or_si256(_mm256_and_si256(w, lowbits), fixbits),
+	    _mm256_slli_epi64(_mm256_and_si256(w, highbits), 4));
+	ev = _mm256_or_si256(ev, _mm256_slli_epi64(_mm256_add_epi64(r,
+	    _mm256_cvtepu8_epi64(_mm_loadl_epi64(
+				     (__m128i *)prefix_lut[rm]))), 36));
+	ev = _mm256_and_si256(ev, smask);
+	ev = _mm256_add_epi64(ev, _mm256_i64gather_epi64(
+	    (long long *)offsettime, _mm256_and_si256(ev, pattbits), 8));
+	_mm256_storeu_si256((__m256i *)&dst[j], ev);
+	if (n>4) { /* upper four events */
+	    w = _mm256_cvtepu32_epi64(_mm256_extracti128_si256(c, 1));
+	    ev = _mm256_or_si256(
+		_mm256_or_si256(_mm256_and_si256(w, lowbits), fixbits),
+		_mm256_slli_epi64(_mm256_and_si256(w, highbits), 4));
+	    ev = _mm256_or_si256(ev, _mm256_slli_epi64(_mm256_add_epi64(r,
+		_mm256_cvtepu8_epi64(_mm_loadl_epi64(
+					 (__m128i *)&prefix_lut[rm][4]))), 36));
+	    ev = _mm256_and_si256(ev, smask);
+	    ev = _mm256_add_epi64(ev, _mm256_i64gather_epi64(
+		(long long *)offsettime, _mm256_and_si256(ev, pattbits), 8));
+	    _mm256_storeu_si256((__m256i *)&dst[j+4], ev);
+	}
+	j += n;
+	rolloveroffset += __builtin_popcount(rm);
+	oldevent = src[i+31-__builtin_clz(nzm)]; /* last nonzero word */
+    }
+    return j;
+}
+#endif
+
+#ifdef HAVE_NEON_KERNEL
+uint8_t compact4_lut[16][16]; /* byte shuffle for nonzero words in 4 lanes */
+
+static int fastexpand_neon(uint32_t *src, int nwords, uint64_t *dst) {
+    const uint32_t lanebit_init[4] = {1, 2, 4, 8};
+    const int32_t laneshift_init[4] = {0, 1, 2, 3};
+    const uint32x4_t lanebit = vld1q_u32(lanebit_init);
+    const int32x4_t laneshift = vld1q_s32(laneshift_init);
+    const uint64x2_t lowbits = vdupq_n_u64(0x3f);
+    const uint64x2_t highbits = vdupq_n_u64(0xffffffc0LL);
+    const uint64x2_t fixbits = vdupq_n_u64(0x300);
+    const uint64x2_t smask = vdupq_n_u64((shortmode==1) ?
+					 0xffffffffffff83ffLL : ~0LL);
+    uint32x4_t v, c;
+    uint64x2_t w, ev;
+    uint64_t roll[4];
+    int i, j=0, k, n, nzm, hc, rm;
+    for (i=0; i+4<=nwords; i+=4) {
+	v = vld1q_u32(&src[i]);
+	nzm = vaddvq_u32(vandq_u32(vtstq_u32(v, v), lanebit));
+	if (!nzm) continue; /* all void */
+	n = __builtin_popcount(nzm);
+	/* compact nonzero words to the bottom */
+	c = vreinterpretq_u32_u8(vqtbl1q_u8(vreinterpretq_u8_u32(v),
+					    vld1q_u8(compact4_lut[nzm])));
+	/* rollover where bit 31 goes from 1 to 0 between subsequent words */
+	hc = vaddvq_u32(vshlq_u32(vshrq_n_u32(c, 31), laneshift))
+	    & ((1<<n)-1);
+	rm = ((hc<<1) | (oldevent>>31)) & ~hc & ((1<<n)-1);
+	for (k=0; k<4; k++)
+	    roll[k] = (uint64_t)(rolloveroffset + prefix_lut[rm][k]) << 36;
+	w = vmovl_u32(vget_low_u32(c));
+	ev = vorrq_u64(vorrq_u64(vandq_u64(w, lowbits), fixbits),
+		       vshlq_n_u64(vandq_u64(w, highbits), 4));
+	ev = vandq_u64(vorrq_u64(ev, vld1q_u64(&roll[0])), smask);
+	vst1q_u64(&dst[j], ev);
+	w = vmovl_high_u32(c);
+	ev = vorrq_u64(vorrq_u64(vandq_u64(w, lowbits), fixbits),
+		       vshlq_n_u64(vandq_u64(w, highbits), 4));
+	ev = vandq_u64(vorrq_u64(ev, vld1q_u64(&roll[2])), smask);
+	vst1q_u64(&dst[j+2], ev);
+	/* no gather instruction here */
+	for (k=0; k<n; k++) dst[j+k] += offsettime[dst[j+k]&0xf];
+	j += n;
+	rolloveroffset += __builtin_popcount(rm);
+	oldevent = src[i+31-__builtin_clz(nzm)]; /* last nonzero word */
+    }
+    return j;
+}
+#endif
+
+/* fill lookup tables and choose the best kernel this cpu can run */
+static void init_fastexpand(void) {
+    int m, b, k;
+    for (m=0; m<256; m++) {
+	for (b=0, k=0; b<8; b++) {
+	    if (m & (1<<b)) compact_lut[m][k++]=b;
+	    prefix_lut[m][b]=k;
+	}
+	for (; k<8; k++) compact_lut[m][k]=0;
+    }
+#ifdef HAVE_AVX2_KERNEL
+    if (__builtin_cpu_supports("avx2")) fastexpand = fastexpand_avx2;
+#endif
+#ifdef HAVE_NEON_KERNEL
+    for (m=0; m<16; m++) {
+	memset(compact4_lut[m], 0xff, 16); /* out of range gives zero */
+	for (b=0, k=0; b<4; b++) {
+	    if (m & (1<<b)) {
+		compact4_lut[m][4*k]=4*b; compact4_lut[m][4*k+1]=4*b+1;
+		compact4_lut[m][4*k+2]=4*b+2; compact4_lut[m][4*k+3]=4*b+3;
+		k++;
+	    }
+	}
+    }
+    fastexpand = fastexpand_neon;
+#endif
+}
+
+/* coincidence histogram engine for outmode 3. All events are kept in short
+   history rings per detector channel, with timing info in units of 1/256
+   nsec. Every histogram definition holds two cursors into these rings, which
+   only move forward: one marks the oldest start event a new stop event can
+   still match, the other the oldest stop event a new start event can match
+   (for negative time differences). Therefore, all histograms are filled in
+   a single pass over the event stream, with no search per event. */
+struct histogram_def {
+    int start, stop;        /* detector channels, 0..3 */
+    long long binwidth;     /* in 1/256 nsec */
+    int bins;
+    long long lo, hi;       /* accepted time difference range [lo,hi) */
+    unsigned int startcursor, stopcursor; /* oldest matching ring entries */
+    unsigned long long *hist;
+} histdef[MAX_HISTOGRAMS];
+int numberofhistograms = 0;
+long long histring[4][HISTRING_SIZE]; /* event times per detector channel */
+unsigned int histring_head[4];  /* in events since start */
+unsigned int histring_overflows=0; /* matches lost on a lapped ring */
+unsigned long long singles[4];   /* event counts per detector channel */
+long long firsteventtime=-1, lasteventtime=0; /* for the elapsed time */
+
+/* get a cursor back into the valid part of a ring after an overflow */
+static inline unsigned int histring_clamp(int c, unsigned int cursor) {
+    if (histring_head[c] - cursor > HISTRING_SIZE) {
+	histring_overflows++;
+	return histring_head[c] - HISTRING_SIZE;
+    }
+    return cursor;
+}
+
+/* feed one postprocessed event into all histograms */
+static void histogram_event(uint64_t event) {
+    long long t = (long long)(event >> 10); /* 54 bit timing info */
+    struct histogram_def *hd;
+    long long *ring;
+    long long d;
+    unsigned int k, head;
+    int c, n;
+
+    if (firsteventtime<0) firsteventtime=t;
+    lasteventtime=t;
+
+    for (n=0; n<numberofhistograms; n++) {
+	hd = &histdef[n];
+	if ((event >> hd->stop) & 1) { /* match against earlier starts */
+	    ring = histring[hd->start]; head = histring_head[hd->start];
+	    k = histring_clamp(hd->start, hd->startcursor);
+	    /* forget start events too old for any future stop event */
+	    while ((k != head) && (t - ring[k % HISTRING_SIZE] >= hd->hi)) k++;
+	    hd->startcursor = k;
+	    for (; k!=head; k++) {
+		d = t - ring[k % HISTRING_SIZE];
+		if (d < hd->lo) break; /* later entries are even closer */
+		hd->hist[(d-hd->lo)/hd->binwidth]++;
+	    }
+	}
+	if ((event >> hd->start) & 1) { /* match against earlier stops */
+	    ring = histring[hd->stop]; head = histring_head[hd->stop];
+	    k = histring_clamp(hd->stop, hd->stopcursor);
+	    while ((k != head) && (ring[k % HISTRING_SIZE] < t + hd->lo)) k++;
+	    hd->stopcursor = k;
+	    for (; k!=head; k++) {
+		d = ring[k % HISTRING_SIZE] - t;
+		if (d >= hd->hi) break;
+		hd->hist[(d-hd->lo)/hd->binwidth]++;
+	    }
+	    /* start and stop in the same event */
+	    if (((event >> hd->stop) & 1) && (hd->lo <= 0) && (hd->hi > 0))
+		hd->hist[(-hd->lo)/hd->binwidth]++;
+	}
+    }
+
+    /* keep event for future matches */
+    for (c=0; c<4; c++) {
+	if ((event >> c) & 1) {
+	    singles[c]++;
+	    histring[c][histring_head[c]++ % HISTRING_SIZE] = t;
+	}
+    }
+}
+
+/* emit the histogram record for a given elapsed time in 1/256 nsec */
+static void histogram_record(FILE *outfile, long long elapsed) {
+    int i, n;
+    fprintf(outfile, "%lld %llu %llu %llu %llu", elapsed/256,
+	    singles[0], singles[1], singles[2], singles[3]);
+    for (n=0; n<numberofhistograms; n++)
+	for (i=0; i<histdef[n].bins; i++)
+	    fprintf(outfile, " %llu", histdef[n].hist[i]);
+    fprintf(outfile, "\n");
+    fflush(outfile);
+    if ((verbosity>0) && histring_overflows)
+	fprintf(stderr, "histogram history overflows: %u\n",
+		histring_overflows);
+}
+
+/* emit the histogram record, see outmode 3 */
+static void histogram_emit(FILE *outfile) {
+    histogram_record(outfile,
+		     (firsteventtime<0) ? 0 : lasteventtime-firsteventtime);
+}
+
+/* zero all counts, but keep the event history for matches across a window
+   boundary */
+static void histogram_clear(void) {
+    int i;
+    for (i=0; i<4; i++) singles[i]=0;
+    for (i=0; i<numberofhistograms; i++)
+	memset(histdef[i].hist, 0, histdef[i].bins*sizeof(unsigned long long));
+}
+
+/* add a histogram from a start,stop,binwidth,bins,minrange definition.
+   Returns 0 or an error number */
+static int histogram_parse(char *spec) {
+    struct histogram_def *hd;
+    double binwidth; long long minrange;
+    if (numberofhistograms >= MAX_HISTOGRAMS) return 46;
+    hd = &histdef[numberofhistograms];
+    if (5 != sscanf(spec, "%d,%d,%lf,%d,%lld", &hd->start,
+		    &hd->stop, &binwidth, &hd->bins, &minrange))
+	return 45;
+    if ((hd->start<1) || (hd->start>4) ||
+	(hd->stop<1) || (hd->stop>4) ||
+	(hd->bins<1) || (hd->bins>MAX_HISTBINS) ||
+	(binwidth*256. < 1.) || (binwidth > 1E9))
+	return 46;
+    hd->start--; hd->stop--; /* internally 0..3 */
+    hd->binwidth = (long long)(binwidth*256. + 0.5);
+    hd->lo = minrange * hd->binwidth;
+    hd->hi = hd->lo + hd->bins * hd->binwidth;
+    hd->hist = NULL;
+    numberofhistograms++;
+    return 0;
+}
+
+/* get memory for all histograms. Returns 0 or an error number */
+static int histogram_alloc(void) {
+    int i;
+    for (i=0; i<numberofhistograms; i++) {
+	histdef[i].hist = (unsigned long long *)
+	    calloc(histdef[i].bins, sizeof(unsigned long long));
+	if (!histdef[i].hist) return 48;
+    }
+    return 0;
+}
+
+static void histogram_free(void) {
+    int i;
+    for (i=0; i<numberofhistograms; i++) {
+	free(histdef[i].hist); histdef[i].hist=NULL;
+    }
+    numberofhistograms=0;
+}
+
+/* start all histograms and counters from scratch */
+static void histogram_reset(void) {
+    int i;
+    for (i=0; i<4; i++) { histring_head[i]=0; singles[i]=0; }
+    histring_overflows=0; firsteventtime=-1; lasteventtime=0;
+    for (i=0; i<numberofhistograms; i++) {
+	histdef[i].startcursor=0; histdef[i].stopcursor=0;
+	memset(histdef[i].hist, 0, histdef[i].bins*sizeof(unsigned long long));
+    }
+}
+
+/* adaptive peak search (-F option) on the only histogram. It starts with
+   FINDPEAK_BINS coarse bins over the whole search range, and as soon as a
+   bin stands out of the background, it zooms in around that bin with
+   narrower bins, down to the requested bin width. Events keep streaming
+   into the same single-pass engine; only the bins change. Bins of every
+   stage are aligned to the grid of the requested bin width, so that the
+   final position is exact in these units. Each stage stays within the
+   range of the one before, which the history cursors of the engine rely
+   on, as they have already moved past events outside of it. */
+#define FINDPEAK_BINS 64
+#define FINDPEAK_ZOOM 4     /* bin width reduction per stage */
+#define FINDPEAK_SIGMA 6.   /* peak significance over background */
+#define FINDPEAK_MINCOUNTS 16 /* min counts of a peak bin, to lock: more */
+#define FINDPEAK_WINDOWFRACTION 16 /* window bins exceed peak/this */
+int findpeak=0;
+long long findpeak_width; /* requested bin width in 1/256 nsec */
+
+/* floor division for the grid alignment */
+static inline long long findpeak_floordiv(long long a, long long b) {
+    return (a>=0) ? a/b : -((-a+b-1)/b);
+}
+
+/* coarse bins over the range of the parsed definition. The bin width is
+   rounded up, so hi stays where it was and the last bin may be short */
+static void findpeak_init(void) {
+    struct histogram_def *hd = &histdef[0];
+    long long range = hd->hi - hd->lo;
+    findpeak_width = hd->binwidth;
+    if (hd->bins <= FINDPEAK_BINS) return; /* fine enough from the start */
+    hd->bins = FINDPEAK_BINS;
+    hd->binwidth = (range + FINDPEAK_BINS-1)/FINDPEAK_BINS;
+}
+
+/* check for a peak after a block of events. Zooms in, or reports the
+   position and stops the acquisition once the final bin width is reached */
+static void findpeak_check(FILE *outfile) {
+    struct histogram_def *hd = &histdef[0];
+    unsigned long long *h = hd->hist, peak=0, sum=0;
+    long long center, width;
+    long long lo, hi, threshold;
+    double bg;
+    int i, m=0, n=0, left, right;
+
+    for (i=0; i<hd->bins; i++) {
+	sum += h[i];
+	if (h[i]>peak) { peak=h[i]; m=i; }
+    }
+    /* background from all bins away from the peak */
+    for (i=m-2; i<=m+2; i++)
+	if ((i>=0) && (i<hd->bins)) { sum -= h[i]; n++; }
+    bg = (hd->bins>n) ? (double)sum/(hd->bins-n) : 0.;
+    if ((peak < FINDPEAK_MINCOUNTS) ||
+	(peak-bg < FINDPEAK_SIGMA*sqrt(bg+1.))) return;
+
+    if (hd->binwidth > findpeak_width) { /* next stage around the peak */
+	center = hd->lo + m*hd->binwidth + hd->binwidth/2;
+	fprintf(outfile, "#peak %g %g %llu %.1f\n", hd->binwidth/256.,
+		center/256., peak, bg);
+	fflush(outfile);
+	width = hd->binwidth/FINDPEAK_ZOOM;
+	if (width < findpeak_width) width = findpeak_width;
+	width = (width/findpeak_width)*findpeak_width;
+	lo = findpeak_width * findpeak_floordiv(
+	    center - FINDPEAK_BINS/2*width, findpeak_width);
+	/* clamp into the current range, whose lo is on the grid */
+	hi = findpeak_width * findpeak_floordiv(
+	    hd->hi - FINDPEAK_BINS*width, findpeak_width);
+	if (lo > hi) lo = hi;
+	if (lo < hd->lo) lo = hd->lo;
+	hd->binwidth = width;
+	hd->lo = lo;
+	hd->hi = hd->lo + hd->bins*width;
+	memset(h, 0, hd->bins*sizeof(unsigned long long));
+	return;
+    }
+
+    if (peak <= FINDPEAK_MINCOUNTS) return;
+    /* locked: coincidence window where bins exceed twice the background,
+       and a fraction of the peak so that single accidentals don't count */
+    threshold = peak/FINDPEAK_WINDOWFRACTION;
+    if (threshold < 2*bg) threshold = 2*bg;
+    for (left=0; (m+left>0) && (h[m+left-1] > threshold); left--);
+    for (right=0; (m+right+1<hd->bins) && (h[m+right+1] > threshold);
+	 right++);
+    fprintf(outfile, "#locked %lld %d %d %lld\n", hd->lo/findpeak_width + m,
+	    left, right, hd->lo/findpeak_width);
+    findpeak=0; running=0;
+}
+
+/* gapless windows (-w option): the event stream is cut into contiguous
+   windows of a fixed length on the card timestamps, starting with the first
+   event. Every event ends up in exactly one window, and at the end of each
+   window its record goes out, with the window length as elapsed time. A
+   pair spanning a boundary counts in the window of its later event. In
+   outmode 4, events are only counted per detector. After a SIGHUP, the
+   window is cut at the first event of the next call, and the windows
+   start again from there. */
+long long gaplesslength=0; /* in 1/256 nsec, 0: no gapless windows */
+long long gaplessstart=-1; /* start of current window */
+
+static void gapless_events(uint64_t *events, int n, FILE *outfile) {
+    int i, d, mark=0;
+    long long t;
+    if (n && gaplessmark) {
+	gaplessmark=0; mark=1;
+    }
+    for (i=0; i<n; i++) {
+	t = (long long)(events[i] >> 10);
+	if (gaplessstart<0) gaplessstart=t;
+	while (t - gaplessstart >= gaplesslength) { /* also empty windows */
+	    histogram_record(outfile, gaplesslength);
+	    histogram_clear();
+	    gaplessstart += gaplesslength;
+	}
+	if (mark) { /* cut here */
+	    histogram_record(outfile, t - gaplessstart);
+	    histogram_clear();
+	    fprintf(outfile, "#mark %lld\n", t/256);
+	    fflush(outfile);
+	    gaplessstart=t; mark=0;
+	}
+	if (outmode == 4) {
+	    d = patt2det[events[i] & 0xf];
+	    if (d>=0) singles[d]++;
+	    lasteventtime=t;
+	} else {
+	    histogram_event(events[i]);
+	}
+    }
+}
+
+/* the last window is incomplete; its record carries the covered time */
+static void gapless_finish(FILE *outfile) {
+    if (gaplessstart<0) return; /* never saw an event */
+    histogram_record(outfile, lasteventtime - gaplessstart);
+}
+
+/* control socket for a persistent acquisition (-C option). The card is
+   configured once and keeps streaming; a client connects, sends a single
+   line "duration [-H start,stop,binwidth,bins,minrange]..." with the window
+   length in msec, and receives the outmode 3 record of a window of that
+   length in event time, taken from the data following the request. The
+   line "quit" terminates readevents7. Events outside windows are dropped. */
+#define CONTROL_REQUESTLEN 4096
+#define CONTROL_READTIMEOUT 200 /* msec for a client to send the request */
+#define CONTROL_EXTRATIME 2 /* sec beyond the window length before giving up */
+int controlfd=-1;  /* listening socket */
+int clientfd=-1;   /* client waiting for a window result */
+int windowactive=0;
+long long windowlength, windowstart; /* in 1/256 nsec */
+time_t windowdeadline;
+
+static int control_open(char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, path);
+    controlfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (controlfd<0) return -1;
+    unlink(path); /* stale socket from an earlier run */
+    if (bind(controlfd, (struct sockaddr *)&addr, sizeof(addr))) return -1;
+    if (listen(controlfd, 4)) return -1;
+    return 0;
+}
+
+/* send text to the client and hang up */
+static void control_reply(char *text, size_t len) {
+    if (clientfd<0) return;
+    send(clientfd, text, len, MSG_NOSIGNAL); /* client may be gone */
+    close(clientfd); clientfd=-1;
+}
+
+static void window_finish(void) {
+    char *text; size_t len;
+    FILE *f;
+    windowactive=0;
+    f = open_memstream(&text, &len);
+    if (!f) { control_reply("#error no memory\n", 17); return; }
+    histogram_emit(f);
+    fclose(f);
+    control_reply(text, len);
+    free(text);
+}
+
+/* feed events into the histograms as long as a window is open */
+static void window_events(uint64_t *events, int n) {
+    int i;
+    long long t;
+    for (i=0; (i<n) && windowactive; i++) {
+	t = (long long)(events[i] >> 10);
+	if (windowstart<0) windowstart=t;
+	if (t-windowstart >= windowlength) {
+	    window_finish(); break;
+	}
+	histogram_event(events[i]);
+    }
+}
+
+/* read a request line from the client. Returns its length or -1 */
+static int control_readline(char *line) {
+    struct pollfd cp = {.fd = clientfd, .events = POLLIN};
+    int len=0, r;
+    while (len < CONTROL_REQUESTLEN-1) {
+	if (poll(&cp, 1, CONTROL_READTIMEOUT) <= 0) return -1;
+	r = read(clientfd, &line[len], CONTROL_REQUESTLEN-1-len);
+	if (r<=0) return -1;
+	len += r; line[len]=0;
+	if (strchr(line, '\n')) return len;
+    }
+    return -1;
+}
+
+/* check for client requests and stale windows; called once per round */
+static void control_service(void) {
+    char line[CONTROL_REQUESTLEN], msg[200];
+    char *tok, *saveptr;
+    double duration;
+    int err=0;
+    if (clientfd>=0) { /* window in progress */
+	if (time(NULL) > windowdeadline) window_finish(); /* no events */
+	return;
+    }
+    clientfd = accept(controlfd, NULL, NULL);
+    if (clientfd<0) return;
+    if (control_readline(line)<0) {
+	close(clientfd); clientfd=-1; return;
+    }
+    tok = strtok_r(line, " \t\r\n", &saveptr);
+    if (tok && !strcmp(tok, "quit")) {
+	running=0; control_reply("#ok\n", 4); return;
+    }
+    if (!tok || (1!=sscanf(tok, "%lf", &duration)) || (duration<=0)) {
+	control_reply("#error needs duration in msec\n", 30); return;
+    }
+    histogram_free();
+    while (!err && (tok = strtok_r(NULL, " \t\r\n", &saveptr))) {
+	if (strcmp(tok, "-H")) { err=45; break; }
+	tok = strtok_r(NULL, " \t\r\n", &saveptr);
+	err = tok ? histogram_parse(tok) : 45;
+    }
+    if (!err) err = histogram_alloc();
+    if (err) {
+	histogram_free();
+	snprintf(msg, sizeof(msg), "#error %s\n", errormessage[err]);
+	control_reply(msg, strlen(msg)); return;
+    }
+    histogram_reset();
+    windowlength = (long long)(duration*256E6);
+    windowstart = -1;
+    windowdeadline = time(NULL) + (time_t)(duration/1000.) + CONTROL_EXTRATIME;
+    windowactive=1;
+}
+
+static void control_close(char *path) {
+    if (windowactive) window_finish();
+    close(controlfd);
+    unlink(path);
+}
+
+/* shared memory export (-M). The postprocessed events are published into
+   a ring in a POSIX shared memory object, in addition to the normal output,
+   so other programs can read them while readevents7 runs. The layout and
+   the lock-free protocol are described in tmstshm.h; readers never hold up
+   the acquisition, they detect themselves if they were overrun. */
+#define SHM_MIN_CAPACITY (1<<10) /* in events */
+#define SHM_MAX_CAPACITY (1<<27)
+#define SHM_BLOCKFRACTION 4 /* largest block written at once, in 1/ring */
+struct tmstshm_header *shmring=NULL;
+uint64_t *shmevents; /* the event ring */
+size_t shmsize;
+
+static int shm_export_open(char *name, long long capacity) {
+    int fd;
+    void *p;
+    /* readers of an earlier run keep their object, and notice it is done */
+    shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd<0) return -1;
+    shmsize = TMSTSHM_HEADERSIZE + capacity*sizeof(uint64_t);
+    if (ftruncate(fd, shmsize)) {
+	close(fd); shm_unlink(name);
+	return -1;
+    }
+    p = mmap(NULL, shmsize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p==MAP_FAILED) {
+	shm_unlink(name);
+	return -1;
+    }
+    /* a new object is zeroed, so are the counters and reader slots */
+    shmring = (struct tmstshm_header *)p;
+    shmring->version = TMSTSHM_VERSION;
+    shmring->ringoffset = TMSTSHM_HEADERSIZE;
+    shmring->capacity = capacity;
+    shmring->producer = getpid();
+    shmring->readers = TMSTSHM_MAX_READERS;
+    shmevents = tmstshm_ring(shmring);
+    __atomic_store_n(&shmring->magic, TMSTSHM_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* append n events to the ring, in blocks of at most a quarter ring so
+   that a reader can only lose what the producer is actually writing */
+static void shm_publish(uint64_t *events, int n) {
+    uint64_t capacity = shmring->capacity, mask = capacity-1;
+    uint64_t head = shmring->commit;
+    uint64_t k, first;
+    if (n > capacity) { /* the beginning would be overwritten right away */
+	head += n-capacity; events += n-capacity; n = capacity;
+    }
+    while (n>0) {
+	k = n;
+	if (k > capacity/SHM_BLOCKFRACTION) k = capacity/SHM_BLOCKFRACTION;
+	__atomic_store_n(&shmring->reserve, head+k, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST); /* reserve before the data */
+	first = capacity - (head & mask);
+	if (first > k) first = k;
+	memcpy(&shmevents[head & mask], events, first*sizeof(uint64_t));
+	memcpy(shmevents, events+first, (k-first)*sizeof(uint64_t));
+	head += k; events += k; n -= k;
+	__atomic_store_n(&shmring->commit, head, __ATOMIC_RELEASE);
+    }
+}
+
+static void shm_export_close(char *name) {
+    int i;
+    struct tmstshm_reader *r;
+    if (verbosity>0) {
+	for (i=0; i<TMSTSHM_MAX_READERS; i++) {
+	    r = &shmring->reader[i];
+	    if (r->pid)
+		fprintf(stderr, "#shm reader pid=%llu behind=%lld\n",
+			(unsigned long long)r->pid,
+			(long long)(shmring->commit - r->cursor));
+	}
+    }
+    __atomic_store_n(&shmring->producer, 0, __ATOMIC_RELEASE);
+    munmap(shmring, shmsize);
+    shm_unlink(name);
+}
+
+/* runtime statistics for -I. The main loop reports the bytes and the
+   processing time of each round and the fill level of the ring, the output
+   stage counts events and the time spent in it; every interval, one line
+   with the numbers since the previous line goes to statsfd. The counters
+   of the output stage may be updated by the writer thread of -J. */
+int statsfd=-1;
+double stats_interval=1.0; /* seconds */
+struct {
+    long long start, last; /* nsec, start of acquisition and last report */
+    long long bytes, rounds, processns;
+    long long fill, fillmax; /* bytes pending in the ring */
+    long long events, outputns; /* atomic */
+} stats;
+
+static inline long long stats_clock(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1000000000LL + t.tv_nsec;
+}
+/* start time of something to be measured, if statistics are on */
+static inline long long stats_begin(void) {
+    return (statsfd<0) ? 0 : stats_clock();
+}
+static inline void stats_output(long long events, long long t0) {
+    if (statsfd<0) return;
+    __atomic_add_fetch(&stats.events, events, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.outputns, stats_clock()-t0, __ATOMIC_RELAXED);
+}
+static inline void stats_fill(long long bytes) {
+    stats.fill = bytes;
+    if (bytes > stats.fillmax) stats.fillmax = bytes;
+}
+
+/* end of a round that started at t0; sends a line if the interval is over */
+static void stats_round(long long bytes, long long t0) {
+    long long now, events, outputns;
+    double dt;
+    if (statsfd<0) return;
+    now = stats_clock();
+    stats.bytes += bytes; stats.rounds++; stats.processns += now-t0;
+    if (now-stats.last < stats_interval*1E9) return;
+    dt = (now-stats.last)*1E-9;
+    events = __atomic_exchange_n(&stats.events, 0, __ATOMIC_RELAXED);
+    outputns = __atomic_exchange_n(&stats.outputns, 0, __ATOMIC_RELAXED);
+    dprintf(statsfd, "#stats t=%.3f events=%lld rate=%.1f bytes=%lld "
+	    "rounds=%lld bytes_per_round=%lld process_us=%.1f output=%.4f "
+	    "fill=%.4f fillmax=%.4f\n", (now-stats.start)*1E-9, events,
+	    events/dt, stats.bytes, stats.rounds, stats.bytes/stats.rounds,
+	    stats.processns*1E-3/stats.rounds, outputns*1E-9/dt,
+	    (double)stats.fill/readback_buffersize,
+	    (double)stats.fillmax/readback_buffersize);
+    stats.last = now;
+    stats.bytes = 0; stats.rounds = 0; stats.processns = 0;
+    stats.fillmax = stats.fill;
+}
+
+/* zero-copy output for outmode -1. If the output is a pipe, the pages of
+   the DMA buffer are spliced into it by reference, so the driver may only
+   overwrite them once the pipe has drained; zerocopy_lag keeps track of
+   how many bytes the consumer pointer has to stay behind. Anything else
+   gets a plain write() on the file descriptor, which avoids the stdio
+   buffer. */
+#define ZEROCOPY_OFF 0
+#define ZEROCOPY_WRITE 1
+#define ZEROCOPY_SPLICE 2
+int zerocopy=ZEROCOPY_OFF;
+int zerocopy_lag=0; /* bytes possibly still referenced by the pipe */
+
+static void zerocopy_init(int fd) {
+    struct stat st;
+    int ps;
+    zerocopy=ZEROCOPY_WRITE;
+    if (fstat(fd, &st)) return;
+    if (!S_ISFIFO(st.st_mode)) return;
+    ps=fcntl(fd, F_GETPIPE_SZ);
+    zerocopy_lag = (ps>0)?ps:(1<<16); /* 64k is the historic pipe size */
+    zerocopy=ZEROCOPY_SPLICE;
+}
+
+/* send out nbytes starting at data; stops acquisition if the reader of
+   the output is gone */
+static void zerocopy_output(void *data, size_t nbytes, int fd) {
+    struct iovec iov;
+    ssize_t r;
+    iov.iov_base=data; iov.iov_len=nbytes;
+    while (iov.iov_len) {
+	if (zerocopy==ZEROCOPY_SPLICE) {
+	    r=vmsplice(fd, &iov, 1, 0);
+	    if ((r<0) && (errno!=EINTR) && (errno!=EAGAIN) && (errno!=EPIPE)) {
+		/* this memory can't be spliced; copy once in the kernel */
+		if (verbosity>0) 
+		    fprintf(stderr, "vmsplice failed, using write()\n");
+		zerocopy=ZEROCOPY_WRITE; zerocopy_lag=0;
+		continue;
+	    }
+	} else {
+	    r=write(fd, iov.iov_base, iov.iov_len);
+	}
+	if (r<0) {
+	    if ((errno==EINTR) || (errno==EAGAIN)) continue;
+	    running=0; /* reader is gone */
+	    return;
+	}
+	iov.iov_base=(char *)iov.iov_base+r; iov.iov_len-=r;
+    }
+}
+
+/* fast hex text output. Events are converted a block at a time with a
+   table of digit pairs into a static buffer, and sent out with a single
+   fwrite per block. Output is identical to printf with %016llx or %08x. */
+#define HEXBLOCK 4096 /* events per fwrite */
+char hexpairs[256][2]; /* two ASCII digits for each byte value */
+char hexbuf[HEXBLOCK*17]; /* up to 16 digits and a newline per event */
+
+static void init_hextable(void) {
+    const char *digits="0123456789abcdef";
+    int i;
+    for (i=0; i<256; i++) {
+	hexpairs[i][0]=digits[i>>4]; hexpairs[i][1]=digits[i&0xf];
+    }
+}
+
+/* write 8 hex digits of a 32 bit word, most significant first */
+static inline char *hex32(char *p, uint32_t w) {
+    memcpy(p,   hexpairs[w>>24], 2);
+    memcpy(p+2, hexpairs[(w>>16)&0xff], 2);
+    memcpy(p+4, hexpairs[(w>>8)&0xff], 2);
+    memcpy(p+6, hexpairs[w&0xff], 2);
+    return p+8;
+}
+
+static void hex_output64(uint64_t *data, int n, FILE *outfile) {
+    int i, k;
+    char *p;
+    for (i=0; i<n; i+=HEXBLOCK) {
+	p=hexbuf;
+	for (k=i; (k<n) && (k<i+HEXBLOCK); k++) {
+	    p=hex32(p, data[k]>>32); p=hex32(p, data[k]&0xffffffff);
+	    *p++='\n';
+	}
+	fwrite(hexbuf, 1, p-hexbuf, outfile);
+    }
+}
+
+static void hex_output32(uint32_t *data, int n, FILE *outfile) {
+    int i, k;
+    char *p;
+    for (i=0; i<n; i+=HEXBLOCK) {
+	p=hexbuf;
+	for (k=i; (k<n) && (k<i+HEXBLOCK); k++) {
+	    p=hex32(p, data[k]); *p++='\n';
+	}
+	fwrite(hexbuf, 1, p-hexbuf, outfile);
+    }
+}
+
+/* time index for outmodes 1 and 5 (-x option), see tmstindex.h. The
+   output stage counts the bytes it has written, and notes the offset of
+   the first event (or block) at or after every multiple of the interval */
+FILE *indexfile=NULL;
+long long index_interval; /* in 1/256 nsec */
+long long index_next=0; /* time of the next entry */
+unsigned long long index_offset=0; /* bytes in the output stream so far */
+
+static int index_open(char *name, double intervalms) {
+    struct tmstindex_header h;
+    indexfile = fopen(name, "w");
+    if (!indexfile) return 85;
+    index_interval = (long long)(intervalms*256E6 + 0.5);
+    memset(&h, 0, sizeof(h));
+    h.magic = TMSTINDEX_MAGIC; h.version = TMSTINDEX_VERSION;
+    h.outmode = outmode; h.interval = index_interval;
+    fwrite(&h, sizeof(h), 1, indexfile);
+    fflush(indexfile);
+    return 0;
+}
+
+static void index_entry(long long t, unsigned long long offset) {
+    struct tmstindex_entry e = {.time=t, .offset=offset};
+    fwrite(&e, sizeof(e), 1, indexfile);
+    fflush(indexfile);
+    index_next = (t/index_interval + 1)*index_interval;
+}
+
+/* entries for n events of outmode 1 that go out next */
+static void index_events(uint64_t *events, int n) {
+    int i;
+    for (i=0; i<n; i++)
+	if ((long long)(events[i]>>10) >= index_next)
+	    index_entry(events[i]>>10, index_offset + i*sizeof(uint64_t));
+    index_offset += n*sizeof(uint64_t);
+}
+
+/* compact output for outmode 5, see tmstcompact.h. Each call makes at
+   least one block, so the blocks follow the processing rounds */
+uint8_t compactbuf[TMSTCOMPACT_MAXBLOCK];
+
+static void compact_output(uint64_t *data, int n, FILE *outfile) {
+    int i, k;
+    long size;
+    for (i=0; i<n; i+=k) {
+	k = n-i;
+	if (k > TMSTCOMPACT_MAXEVENTS) k = TMSTCOMPACT_MAXEVENTS;
+	size = tmstcompact_encode(&data[i], k, compactbuf);
+	if (indexfile) {
+	    if ((long long)(data[i]>>10) >= index_next)
+		index_entry(data[i]>>10, index_offset);
+	    index_offset += size;
+	}
+	fwrite(compactbuf, 1, size, outfile);
+    }
+}
+
+/* event filters for the postprocessed outmodes, applied in this order
+   before anything else sees the events: a detector mask (-m), a
+   coincidence filter (-g) that only keeps events with a partner on
+   another channel within the window, and a decimation (-n) to every Nth
+   event. Events with more than one detector bit are coincidences by
+   themselves. Partners may sit on both sides of an event, so the
+   coincidence filter holds back events until the stream has advanced by
+   the window plus the detector skew spread, and keeps that much of the
+   past as context; filter_finish() sends out the rest at the end. */
+char filter_keep[16]; /* which patterns pass the mask */
+int filter_mask=0; /* mask active */
+double filterwindow=0; /* coincidence window in nsec, 0 for off */
+int decimation=1; /* keep every decimation-th event */
+int decimation_count=0;
+long long filter_window, filter_reach; /* window, window+skew in 1/256 ns */
+uint64_t filter_cardbits; /* bits that tell cards apart */
+uint64_t *filter_work=NULL, *filter_out=NULL; /* held and passed events */
+long filter_worksize=0, filter_outsize=0;
+long filter_n=0, filter_ctx=0; /* held events, of which already decided */
+long long filter_tmax=0; /* latest time in the held events */
+int filter_final=0; /* decide everything */
+char filter_multiple[16] = {0, 0, 0, 1, 0, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1};
+
+/* parse a list of detectors 1..4 into the keep table */
+static int filter_parsemask(char *s) {
+    int bits=0, d, i;
+    char *e;
+    for (;;) {
+	d = strtol(s, &e, 10);
+	if ((e==s) || (d<1) || (d>4)) return 79;
+	bits |= 1<<(d-1);
+	if (!*e) break;
+	if (*e != ',') return 79;
+	s = e+1;
+    }
+    for (i=0; i<16; i++) {
+	d = patt2det[i];
+	filter_keep[i] = (d<0) ? ((i & bits)!=0) : ((bits>>d) & 1);
+    }
+    filter_mask=1;
+    return 0;
+}
+
+/* slack is the largest time by which events can come out of order, in
+   1/256 nsec */
+static void filter_init(long long slack, uint64_t cardbits) {
+    filter_window = (long long)(filterwindow*256.0+0.5);
+    filter_reach = filter_window + slack;
+    filter_cardbits = cardbits;
+}
+
+static int filter_grow(uint64_t **buf, long *size, long need) {
+    uint64_t *p;
+    if (need <= *size) return 0;
+    p = realloc(*buf, 2*need*sizeof(uint64_t));
+    if (!p) return 1;
+    *buf = p; *size = 2*need;
+    return 0;
+}
+
+/* is b a partner of a within the window? */
+static inline int filter_match(uint64_t a, uint64_t b) {
+    long long dt = (long long)(b>>10) - (long long)(a>>10);
+    if ((dt > filter_window) || (dt < -filter_window)) return 0;
+    return ((a^b) & filter_cardbits) || (b & ~a & 0xf);
+}
+
+/* look around held event i for a partner. Events before or after one that
+   is further away than the reach cannot be within the window */
+static int filter_partner(long i) {
+    long long t = filter_work[i]>>10;
+    long k;
+    for (k=i-1; (k>=0) && ((long long)(filter_work[k]>>10) >=
+			   t-filter_reach); k--)
+	if (filter_match(filter_work[i], filter_work[k])) return 1;
+    for (k=i+1; (k<filter_n) && ((long long)(filter_work[k]>>10) <=
+				 t+filter_reach); k++)
+	if (filter_match(filter_work[i], filter_work[k])) return 1;
+    return 0;
+}
+
+/* coincidence stage: takes n new events, and leaves those that passed in
+   filter_out. Returns their number */
+static long filter_coinc(uint64_t *events, long n) {
+    long i, k, m=0;
+    long long limit;
+    if (filter_grow(&filter_work, &filter_worksize, filter_n+n) ||
+	filter_grow(&filter_out, &filter_outsize, filter_n+n)) {
+	emsg(83); running=0;
+	return 0;
+    }
+    for (i=0; i<n; i++) {
+	filter_work[filter_n++] = events[i];
+	if ((long long)(events[i]>>10) > filter_tmax)
+	    filter_tmax = events[i]>>10;
+    }
+    /* all partners of events before limit are in */
+    limit = filter_tmax - filter_reach;
+    for (i=filter_ctx; i<filter_n; i++) {
+	if (!filter_final && ((long long)(filter_work[i]>>10) >= limit)) break;
+	if (filter_multiple[filter_work[i] & 0xf] || filter_partner(i))
+	    filter_out[m++] = filter_work[i];
+    }
+    /* undecided events are no earlier than limit-slack, so their partners
+       are no earlier than limit-reach */
+    for (k=0; (k<i) && ((long long)(filter_work[k]>>10) < limit-filter_reach);
+	 k++);
+    if (filter_final) k=filter_n;
+    memmove(filter_work, &filter_work[k], (filter_n-k)*sizeof(uint64_t));
+    filter_n -= k; filter_ctx = i-k;
+    return m;
+}
+
+/* apply all filters to n events. Returns where the passed events are,
+   which is events itself or the buffer of the coincidence stage, and
+   updates n */
+static uint64_t *filter_events(uint64_t *events, int *n) {
+    int i, m;
+    if (filter_mask) {
+	for (i=0, m=0; i<*n; i++)
+	    if (filter_keep[events[i] & 0xf]) events[m++] = events[i];
+	*n = m;
+    }
+    if (filterwindow>0) {
+	*n = filter_coinc(events, *n);
+	events = filter_out;
+    }
+    if (decimation>1) {
+	for (i=0, m=0; i<*n; i++)
+	    if (++decimation_count >= decimation) {
+		decimation_count=0; events[m++] = events[i];
+	    }
+	*n = m;
+    }
+    return events;
+}
+
+/* output stage for postprocessed events in outbuf, common to the 32bit and
+   64bit input format. Without outfile, the events are left in outbuf for
+   the caller (see tmstreader.c) */
+static void output_events(uint64_t *outbuf, int j, FILE *outfile) {
+    int j2;
+    uint32_t highword, lowword;
+    long long t0;
+    if (!outfile) return;
+    t0 = stats_begin();
+    if (filter_mask || (filterwindow>0) || (decimation>1))
+	outbuf = filter_events(outbuf, &j);
+    if (shmring) shm_publish(outbuf, j);
+    switch (outmode) {
+    case 1: /* this is plain binary output */
+	if (indexfile) index_events(outbuf, j);
+	if (legacyswapoption) { /* swap first and second 32bit words */
+	    for (j2=0; j2<j; j2++) {
+		highword = outbuf[j2]>>32LL; lowword=outbuf[j2]&0xffffffff;
+		outbuf[j2]= (uint64_t)lowword<<32 | highword;
+	    }
+	}
+	fwrite(outbuf, sizeof(uint64_t), j, outfile);
+	break;
+    case 2: /* this is the hex text version */
+	hex_output64(outbuf, j, outfile);
+	break;
+    case 3: /* histogram mode */
+	if (controlfd>=0) { /* only during requested windows */
+	    window_events(outbuf, j);
+	    break;
+	}
+	if (gaplesslength) {
+	    gapless_events(outbuf, j, outfile);
+	    break;
+	}
+	for (j2=0; j2<j; j2++) histogram_event(outbuf[j2]);
+	if (findpeak) findpeak_check(outfile);
+	break;
+    case 4: /* singles counter mode, always in windows */
+	gapless_events(outbuf, j, outfile);
+	break;
+    case 5: /* compact blocks */
+	compact_output(outbuf, j, outfile);
+	break;
+    }
+    stats_output(j, t0);
+}
+
+/* send out the events the coincidence filter still holds */
+static void filter_finish(FILE *outfile) {
+    if (filterwindow<=0) return;
+    filter_final=1;
+    output_events(filter_work, 0, outfile);
+}
+
+/* decoding kernels for the postprocessed outmodes, one for each input
+   format and shortmode, all from the same source. The flags are constants
+   in each kernel, so the loops have no mode branches left. A kernel turns
+   nwords 32bit words of card data into events with the skew correction,
+   dropping void words; the 32 bit format uses the block kernel for the
+   bulk. Skipping and counting of events happen afterwards on the whole
+   block, in process_data(). Return the number of events written into dst.
+   The rollover state is kept in locals, as dst may alias the globals. */
+#define DECODE_KERNEL(name, FAST, SHORT)				\
+static int name(uint32_t *src, int nwords, uint64_t *dst) {		\
+    uint32_t w, old, roll;						\
+    uint64_t e;								\
+    int i=0, j=0;							\
+    if (FAST && fastexpand) {						\
+	i = nwords & ~(FASTBLOCK-1);					\
+	j = fastexpand(src, i, dst);					\
+    }									\
+    old = oldevent; roll = rolloveroffset;				\
+    for (; i+1-FAST < nwords; i += 2-FAST) {				\
+	if (FAST) {							\
+	    w = src[i];							\
+	    if (!w) continue; /* we have a void urb return */		\
+	    if ((~w & old) & 0x80000000) roll++; /* rollover */		\
+	    old = w;							\
+	    e = (w & 0x3f) | 0x300 |					\
+		((w & ~0x3f) | (((uint64_t)roll)<<32))<<4;		\
+	} else {							\
+	    e = src[i] | (((uint64_t)src[i+1])<<32);			\
+	    if (!e) continue; /* we have a void urb return */		\
+	}								\
+	if (SHORT) e &= 0xffffffffffff83ffLL;				\
+	dst[j++] = e + offsettime[e & 0xf];				\
+    }									\
+    oldevent = old; rolloveroffset = roll;				\
+    return j;								\
+}
+DECODE_KERNEL(decode_normal, 0, 0)
+DECODE_KERNEL(decode_normal_short, 0, 1)
+DECODE_KERNEL(decode_fast, 1, 0)
+DECODE_KERNEL(decode_fast_short, 1, 1)
+
+/* the kernel family, indexed by fastmode and shortmode. The benchmark and
+   tmstreader.c switch modes between calls, so the kernel is looked up once
+   per block rather than bound once at startup */
+int (*const decode_kernel[2][2])(uint32_t *src, int nwords, uint64_t *dst) =
+{{decode_normal, decode_normal_short}, {decode_fast, decode_fast_short}};
+
+/* for -q in the raw outmodes: returns how many of nwords words of raw data
+   hold the events still missing, counted like in the postprocessed
+   outmodes, i.e. without void words, and stops acquisition when done */
+static int raw_limit(uint32_t *src, int nwords) {
+    int i, step = fastmode ? 1 : 2;
+    for (i=0; i+step <= nwords; i+=step) {
+	if (processedevents >= numberofsamples) {
+	    running=0; break;
+	}
+	if (src[i] || (!fastmode && src[i+1])) processedevents++;
+    }
+    if (processedevents >= numberofsamples) running=0;
+    return i;
+}
+
+/* decode a segment of the DMA ring into dst, and apply the event skip and
+   the -q limit on the result. Returns the number of events left in dst */
+static int decode_events(uint32_t *rbbuffer, int startindex, int endindex,
+			 uint64_t *dst) {
+    int j, k;
+    j = decode_kernel[fastmode!=0][shortmode==1](&rbbuffer[startindex],
+						  endindex-startindex, dst);
+    if (skipnumber) { /* drop stale events at the beginning */
+	k = (skipnumber < j) ? skipnumber : j;
+	memmove(dst, &dst[k], (j-k)*sizeof(uint64_t));
+	skipnumber -= k; j -= k;
+    }
+    if (numberofsamples) { /* do event number test */
+	if (j >= numberofsamples-processedevents) {
+	    j = numberofsamples-processedevents;
+	    running=0;
+	}
+	processedevents += j;
+    }
+    return j;
+}
+
+/* code to process timestamp data into an output stream. Returns number of
+   processed 32bit words, or a negative number on error or exception. In
+   the postprocessed outmodes, this is the number of events (32 bit format)
+   or twice that (64 bit format), and the events are left in outbuf */
+int process_data(uint32_t *rbbuffer, int startindex, int endindex, 
+		 FILE *outfile) {
+    int j, n;
+    long long t0;
+
+    if (outmode<1) { /* raw data: -1 binary, 0 hex text in 32bit chunks */
+	n = endindex-startindex;
+	if (numberofsamples) n = raw_limit(&rbbuffer[startindex], n);
+	t0 = stats_begin();
+	if (outmode) { /* send out raw binary data */
+	    if (zerocopy) {
+		zerocopy_output(&rbbuffer[startindex], sizeof(int32_t)*n,
+				fileno(outfile));
+	    } else {
+		fwrite(&rbbuffer[startindex], sizeof(int32_t), n, outfile);
+	    }
+	} else {      /* print raw data in hex format as 32bit chunks */
+	    hex_output32(&rbbuffer[startindex], n, outfile);
+	}
+	stats_output(fastmode ? n : n/2, t0);
+	return n;
+    }
+    if (outmode>5) return -31; /* something silly happened */
+
+    /* postprocessed outmodes 1..5 */
+    j = decode_events(rbbuffer, startindex, endindex, outbuf);
+
+    /* now we need to output this */
+    output_events(outbuf, j, outfile);
+    return fastmode ? j : 2*j;
+}
+
+/* ----------------------------------------------------------------------*/
+/* threaded pipeline (-J). The main thread keeps track of the DMA ring and
+   hands segments of it to a decoder thread, which runs decode_events()
+   into one of a set of output buffers and passes that on to a writer
+   thread for output_events(). Stages talk through single producer, single
+   consumer rings with atomic indices; a semaphore per ring lets the
+   consumer sleep when there is nothing to do. Used buffers go back to the
+   decoder through a third ring. In the raw outmodes, there is nothing to
+   decode, and the writer outputs directly from the DMA ring. */
+#define PIPE_QUEUELEN 64 /* power of 2 */
+#define PIPE_BUFFERS 16
+#define PIPE_SEGMENTWORDS (1<<16) /* max 32 bit words per segment */
+#define PIPE_STAGES 3 /* acquisition, decoder, writer */
+
+struct pipe_item {
+    int start, end;    /* segment of the DMA ring in words; start<0: end */
+    long long position; /* ring bytes completely used after this segment */
+    int buffer;        /* output buffer, -1 for data in the DMA ring */
+    int events;        /* events in the output buffer */
+};
+struct pipe_queue {
+    struct pipe_item item[PIPE_QUEUELEN];
+    unsigned int head, tail; /* written only by producer and consumer */
+    sem_t avail;
+};
+int pipeline=0;
+int pipe_cpu[PIPE_STAGES] = {-1, -1, -1}; /* cores to pin to, -1: any */
+struct pipe_queue pipe_segments, pipe_output, pipe_free;
+uint64_t *pipe_buffer[PIPE_BUFFERS];
+pthread_t pipe_thread[PIPE_STAGES];
+long long pipe_released=0; /* ring bytes no stage needs anymore */
+int pipe_error=0;
+
+static int pipe_push(struct pipe_queue *q, struct pipe_item *it) {
+    unsigned int h = q->head;
+    if (h - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) >= PIPE_QUEUELEN)
+	return -1; /* full */
+    q->item[h % PIPE_QUEUELEN] = *it;
+    __atomic_store_n(&q->head, h+1, __ATOMIC_RELEASE);
+    sem_post(&q->avail);
+    return 0;
+}
+
+/* for the stages that may wait on the next one */
+static void pipe_push_wait(struct pipe_queue *q, struct pipe_item *it) {
+    while (pipe_push(q, it)) usleep(100);
+}
+
+static void pipe_pop(struct pipe_queue *q, struct pipe_item *it) {
+    unsigned int t = q->tail;
+    while (sem_wait(&q->avail)) ; /* only EINTR */
+    *it = q->item[t % PIPE_QUEUELEN];
+    __atomic_store_n(&q->tail, t+1, __ATOMIC_RELEASE);
+}
+
+static int pipe_pin(int cpu) {
+    cpu_set_t set;
+    if (cpu<0) return 0;
+    CPU_ZERO(&set); CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void *pipe_decoder(void *arg) {
+    struct pipe_item it, f;
+    if (pipe_pin(pipe_cpu[1]))
+	fprintf(stderr, "cannot pin decoder to core %d\n", pipe_cpu[1]);
+    for (pipe_pop(&pipe_segments, &it); it.start>=0;
+	 pipe_pop(&pipe_segments, &it)) {
+	if (outmode<1) { /* raw data, the writer takes it from the ring */
+	    it.buffer=-1;
+	    pipe_push_wait(&pipe_output, &it);
+	    continue;
+	}
+	/* nothing more after maxevents */
+	if (numberofsamples && (processedevents >= numberofsamples)) {
+	    __atomic_store_n(&pipe_released, it.position, __ATOMIC_RELEASE);
+	    continue;
+	}
+	pipe_pop(&pipe_free, &f);
+	it.buffer = f.buffer;
+	it.events = decode_events(rbbuffer, it.start, it.end,
+				  pipe_buffer[f.buffer]);
+	__atomic_store_n(&pipe_released, it.position, __ATOMIC_RELEASE);
+	pipe_push_wait(&pipe_output, &it);
+    }
+    pipe_push_wait(&pipe_output, &it); /* end marker */
+    return NULL;
+}
+
+static void *pipe_writer(void *arg) {
+    struct pipe_item it;
+    int r;
+    if (pipe_pin(pipe_cpu[2]))
+	fprintf(stderr, "cannot pin writer to core %d\n", pipe_cpu[2]);
+    for (pipe_pop(&pipe_output, &it); it.start>=0;
+	 pipe_pop(&pipe_output, &it)) {
+	if (it.buffer<0) {
+	    r = process_data(rbbuffer, it.start, it.end, stdout);
+	    if (r<0) pipe_error=-r;
+	    __atomic_store_n(&pipe_released, it.position, __ATOMIC_RELEASE);
+	} else {
+	    output_events(pipe_buffer[it.buffer], it.events, stdout);
+	    pipe_push_wait(&pipe_free, &it);
+	}
+	if (ferror(stdout)) running=0; /* SIGPIPE is blocked here */
+    }
+    fflush(stdout);
+    return NULL;
+}
+
+/* set up buffers and start the decoder and writer with all signals
+   blocked, so the signals still reach the main thread */
+static int pipe_start(void) {
+    struct pipe_item it = {.start=0};
+    sigset_t all, old;
+    int i;
+    sem_init(&pipe_segments.avail, 0, 0);
+    sem_init(&pipe_output.avail, 0, 0);
+    sem_init(&pipe_free.avail, 0, 0);
+    for (i=0; i<PIPE_BUFFERS; i++) {
+	pipe_buffer[i] = malloc(PIPE_SEGMENTWORDS*sizeof(uint64_t));
+	if (!pipe_buffer[i]) return -1;
+	it.buffer=i;
+	pipe_push(&pipe_free, &it);
+    }
+    if (pipe_pin(pipe_cpu[0])) return -1;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    i = pthread_create(&pipe_thread[1], NULL, pipe_decoder, NULL) ||
+	pthread_create(&pipe_thread[2], NULL, pipe_writer, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return i ? -1 : 0;
+}
+
+/* hand over the ring from byte position from to to in segments. Returns
+   the position up to which the segments could be queued. */
+static long long pipe_submit(long long from, long long to) {
+    struct pipe_item it;
+    long long n;
+    int words;
+    while (from < to) {
+	n = to-from;
+	if (n > PIPE_SEGMENTWORDS*sizeof(uint32_t))
+	    n = PIPE_SEGMENTWORDS*sizeof(uint32_t);
+	words = n/sizeof(uint32_t);
+	it.start = (from % readback_buffersize)/sizeof(uint32_t);
+	it.end = it.start + words;
+	it.position = from+n;
+	if (pipe_push(&pipe_segments, &it)) break; /* try next round */
+	from += n;
+    }
+    return from;
+}
+
+/* let the stages finish what they have, and wait for them */
+static void pipe_finish(void) {
+    struct pipe_item it = {.start=-1};
+    pipe_push_wait(&pipe_segments, &it);
+    pthread_join(pipe_thread[1], NULL);
+    pthread_join(pipe_thread[2], NULL);
+}
+
+
+/* ----------------------------------------------------------------------*/
+/* simulated timestamp device. With -U sim:..., readevents7 talks to this
+   code instead of the driver. It fills a userspace ring buffer with events
+   in the card format, with Poissonian background on the four channels and
+   correlated pairs between two channels that are detected with given
+   efficiencies. Time advances with the system clock, the ring honors the
+   consumer pointer and overrun policy like the driver does. In the 32 bit
+   format, dummy events with pattern 0 go in between like on the card, so
+   the decoder sees every rollover of the 26 bit time. Simulated devices
+   have handles -1, -2, ... instead of file descriptors, so there can be
+   one per card. */
+#define SIM_MAX_PAIRS 8
+#define SIM_DUMMY (4+SIM_MAX_PAIRS) /* source of the dummy events */
+#define SIM_DUMMYINTERVAL (1LL<<25) /* half a rollover period */
+#define SIM_HEAPSIZE 4096 /* pending events */
+#define SIM_UNITS_PER_SEC 256E9 /* event time unit is 1/256 nsec */
+#define SIM_DEFAULT_SEED 1
+struct simpair {
+    int a, b;          /* detector channels, 0..3 */
+    double rate;       /* pair rate in 1/sec */
+    double delay;      /* arrival time of b after a, in 1/256 nsec */
+    double eff_a, eff_b; /* detection efficiencies */
+    double jitter;     /* rms timing jitter of b, in 1/256 nsec */
+};
+struct simentry {
+    long long t;       /* in 1/256 nsec */
+    int source;        /* 0..3: background, 4.. pair source, SIM_DUMMY:
+			  dummy events, -1: event */
+    int pattern;       /* for source -1 */
+};
+struct simdev {
+    double rate[4];
+    struct simpair pair[SIM_MAX_PAIRS];
+    int pairs;
+    uint64_t rng;
+    struct simentry heap[SIM_HEAPSIZE];
+    int heapsize;
+    uint32_t *ring;
+    long long size, produced, consumed;
+    int policy, cpldvalue, streaming;
+    unsigned long long lost, luttag;
+    struct timespec t0;
+} simdevs[MAX_CARDS];
+struct simdev *sim = simdevs; /* the one currently talked to */
+
+/* xorshift64* generator; returns a double in (0,1) */
+static double sim_uniform(void) {
+    sim->rng ^= sim->rng >> 12; sim->rng ^= sim->rng << 25; sim->rng ^= sim->rng >> 27;
+    return ((sim->rng * 2685821657736338717ULL) >> 11) * (1.0/9007199254740992.0)
+	+ (0.5/9007199254740992.0);
+}
+/* waiting time for a Poisson process in 1/256 nsec */
+static long long sim_interval(double rate) {
+    return (long long)(-log(sim_uniform()) * SIM_UNITS_PER_SEC / rate) + 1;
+}
+
+static void sim_push(long long t, int source, int pattern) {
+    int i = sim->heapsize, p;
+    if (i >= SIM_HEAPSIZE) return; /* should not happen at sane rates */
+    sim->heapsize++;
+    for (; i>0; i=p) { /* sift up */
+	p = (i-1)/2;
+	if (sim->heap[p].t <= t) break;
+	sim->heap[i] = sim->heap[p];
+    }
+    sim->heap[i] = (struct simentry){t, source, pattern};
+}
+static struct simentry sim_pop(void) {
+    struct simentry top = sim->heap[0], last = sim->heap[--sim->heapsize];
+    int i=0, c;
+    for (; (c=2*i+1) < sim->heapsize; i=c) { /* sift down */
+	if ((c+1 < sim->heapsize) && (sim->heap[c+1].t < sim->heap[c].t)) c++;
+	if (last.t <= sim->heap[c].t) break;
+	sim->heap[i] = sim->heap[c];
+    }
+    sim->heap[i] = last;
+    return top;
+}
+
+/* parse sim:r1,r2,r3,r4[:a,b,rate,delay[,eff_a,eff_b[,jitter]]]...[@seed]
+   with rates in 1/sec, channels 1..4, delay and jitter in nsec. Returns 0
+   or an error number */
+static int sim_parse(int handle, char *spec) {
+    char *s = spec, *at;
+    struct simpair *sp;
+    double d[7];
+    unsigned long long seed = SIM_DEFAULT_SEED;
+    int n, i;
+    sim = &simdevs[-1-handle];
+    memset(sim, 0, sizeof(*sim));
+    at = strchr(s, '@');
+    if (at) {
+	if (1!=sscanf(at+1, "%llu", &seed)) return 58;
+	*at = 0;
+    }
+    if (4!=sscanf(s, "%lf,%lf,%lf,%lf", &sim->rate[0], &sim->rate[1],
+		  &sim->rate[2], &sim->rate[3])) return 58;
+    for (i=0; i<4; i++) if (sim->rate[i] < 0) return 59;
+    while ((s = strchr(s, ':'))) {
+	s++;
+	d[4]=1.; d[5]=1.; d[6]=0.; /* defaults for optional values */
+	n = sscanf(s, "%lf,%lf,%lf,%lf,%lf,%lf,%lf",
+		   &d[0], &d[1], &d[2], &d[3], &d[4], &d[5], &d[6]);
+	if ((n!=4) && (n!=6) && (n!=7)) return 58;
+	if (sim->pairs >= SIM_MAX_PAIRS) return 59;
+	sp = &sim->pair[sim->pairs++];
+	sp->a = d[0]-1; sp->b = d[1]-1; sp->rate = d[2];
+	sp->delay = d[3]*256.; sp->eff_a = d[4]; sp->eff_b = d[5];
+	sp->jitter = d[6]*256.;
+	if ((sp->a<0) || (sp->a>3) || (sp->b<0) || (sp->b>3) ||
+	    (sp->rate<0) || (sp->eff_a<0) || (sp->eff_a>1) ||
+	    (sp->eff_b<0) || (sp->eff_b>1) || (sp->jitter<0)) return 59;
+    }
+    sim->rng = seed ? seed : SIM_DEFAULT_SEED;
+    sim->policy = OVERRUN_IGNORE;
+    return 0;
+}
+
+/* first event of every source */
+static void sim_start(void) {
+    int i;
+    clock_gettime(CLOCK_MONOTONIC, &sim->t0);
+    sim->heapsize=0;
+    for (i=0; i<4; i++)
+	if (sim->rate[i]>0) sim_push(sim_interval(sim->rate[i]), i, 0);
+    for (i=0; i<sim->pairs; i++)
+	if (sim->pair[i].rate>0) sim_push(sim_interval(sim->pair[i].rate), 4+i, 0);
+    /* off the multiples of the interval, a dummy is never a void word */
+    if (fastmode) sim_push(SIM_DUMMYINTERVAL/2, SIM_DUMMY, 0);
+    sim->streaming=1;
+}
+
+/* store one event in the ring in the card format. Returns 0, or 1 if there
+   is no space under the backpressure policy */
+static int sim_store(long long t, int pattern) {
+    int evsize = fastmode ? 4 : 8;
+    uint64_t ev;
+    uint32_t *p;
+    if (sim->produced - sim->consumed + evsize > sim->size) {
+	if (sim->policy == OVERRUN_BACKPRESSURE) return 1;
+	if (sim->policy == OVERRUN_COUNT) sim->lost += evsize;
+	sim->consumed += evsize;
+    }
+    p = &sim->ring[(sim->produced % sim->size)/4];
+    if (fastmode) {
+	p[0] = ((t & 0x3ffffff)<<6) | pattern;
+    } else {
+	ev = ((uint64_t)t<<10) | pattern;
+	p[0] = ev & 0xffffffff; p[1] = ev>>32;
+    }
+    sim->produced += evsize;
+    return 0;
+}
+
+/* produce all events up to the current time */
+static void sim_generate(void) {
+    struct timespec now;
+    long long until, t, tb;
+    struct simentry e;
+    struct simpair *sp;
+    double s;
+    int collect = sim->cpldvalue & CollectEN;
+    if (!sim->streaming) return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    until = ((now.tv_sec - sim->t0.tv_sec)*1000000000LL
+	     + (now.tv_nsec - sim->t0.tv_nsec)) * 256;
+    while (sim->heapsize && (sim->heap[0].t < until)) {
+	if ((sim->heap[0].source<0) && collect) {
+	    if (sim_store(sim->heap[0].t, sim->heap[0].pattern)) break;
+	}
+	e = sim_pop();
+	t = e.t;
+	if (e.source < 0) continue; /* event was stored or dropped */
+	if (e.source == SIM_DUMMY) {
+	    if (sim->cpldvalue & DummyInject) sim_push(t, -1, 0);
+	    sim_push(t + SIM_DUMMYINTERVAL, SIM_DUMMY, 0);
+	    continue;
+	}
+	if (e.source < 4) { /* background */
+	    sim_push(t, -1, 1<<e.source);
+	    sim_push(t + sim_interval(sim->rate[e.source]), e.source, 0);
+	    continue;
+	}
+	sp = &sim->pair[e.source-4];
+	sim_push(t + sim_interval(sp->rate), e.source, 0);
+	tb = t + (long long)sp->delay;
+	if (sp->jitter > 0) { /* gaussian with Box-Muller */
+	    s = sqrt(-2.*log(sim_uniform())) * cos(2.*M_PI*sim_uniform());
+	    tb += (long long)(s * sp->jitter);
+	}
+	/* keep events in time order; a negative delay moves a instead */
+	if (tb < t) { t += t-tb; tb = e.t; }
+	if (sim_uniform() < sp->eff_a) sim_push(t, -1, 1<<sp->a);
+	if (sim_uniform() < sp->eff_b) sim_push(tb, -1, 1<<sp->b);
+    }
+}
+
+/* replacement of the driver ioctls */
+static int sim_ioctl(int handle, unsigned long cmd, ...) {
+    va_list ap;
+    unsigned long arg;
+    int value;
+    va_start(ap, cmd); arg = va_arg(ap, unsigned long); va_end(ap);
+    sim = &simdevs[-1-handle];
+    switch (cmd) {
+    case GET_POWER_STATE:
+	*(int *)arg = FPGA_booted | Powerline | LUT_LOADED;
+	break;
+    case READ_RAM: /* scratch RAM contains a valid flash entry */
+	value = (*(int *)arg - 4096)/2;
+	*(int *)arg = ((value==0) ? 0x0001 : (value==1) ? 0x0011 :
+		       (value==2) ? 0xffee : 0)<<16;
+	break;
+    case WRITE_CPLD:
+	sim->cpldvalue = arg;
+	break;
+    case START_STREAM:
+	if (!sim->streaming) sim_start();
+	break;
+    case Get_transferredbytes:
+	sim_generate();
+	return sim->produced & 0x7fffffff;
+    case Get_drivercaps: /* no poll(), we rely on the timer */
+	return DRIVERCAP_URBNUMBER | DRIVERCAP_CONSUMER | DRIVERCAP_RAMBULK |
+	    DRIVERCAP_STATUS;
+    case Get_status:
+	sim_generate();
+	memset((void *)arg, 0, sizeof(struct ringstatus));
+	((struct ringstatus *)arg)->received = sim->produced;
+	((struct ringstatus *)arg)->lost = sim->lost;
+	break;
+    case Write_rambulk:
+	sim->luttag = 0;
+	break;
+    case Set_luttag:
+	sim->luttag = *(unsigned long long *)arg;
+	break;
+    case Get_luttag:
+	*(unsigned long long *)arg = sim->luttag;
+	break;
+    case Get_ringsize:
+	return DEFAULT_READBACK_BUFFERSIZE;
+    case Set_consumerpointer: /* same logic as in the driver */
+	value = ((int)arg - (int)(sim->consumed & 0x7fffffff)) & 0x7fffffff;
+	if (value <= sim->produced - sim->consumed) sim->consumed += value;
+	break;
+    case Set_overrunpolicy:
+	if (arg > OVERRUN_COUNT) return -1;
+	sim->policy = arg;
+	break;
+    case Get_lostbytes:
+	*(unsigned long long *)arg = sim->lost;
+	break;
+    }
+    return 0; /* everything else just works */
+}
+
+/* ring buffer instead of the DMA buffer mmap */
+static void *sim_mmap(int handle, size_t size) {
+    void *p;
+    sim = &simdevs[-1-handle];
+    if (posix_memalign(&p, 4096, size)) return MAP_FAILED;
+    memset(p, 0, size);
+    sim->size = size;
+    sim->ring = (uint32_t *)p;
+    return p;
+}
+
+/* device access goes either to the driver or the simulation */
+#define devioctl(handle, ...) ((handle)<0 ? sim_ioctl(handle, __VA_ARGS__, 0) \
+			       : ioctl(handle, __VA_ARGS__))
+
+
+/* the benchmark includes this file for process_data() and friends */
+#ifndef READEVENTS7_NO_MAIN
+/* ----------------------------------------------------------------------*/
+/* card setup, and acquisition from several cards. Every card has its own
+   DMA ring, decoder state and time offset (-k). With more than one card,
+   the events of each card are decoded into a buffer of that card and
+   tagged with the card number, and a merge stage picks them from all
+   buffers in time order, up to the newest time that all active cards have
+   reached. A card without events for MERGE_HOLDOFF seconds does not count
+   as active. */
+#define CARD_IDSHIFT 4 /* card number in bits 4 and 5 of the events */
+#define CARD_IDMASK (3ULL<<CARD_IDSHIFT)
+#define MERGE_HOLDOFF 0.5 /* in seconds */
+struct card {
+    char devicename[FILENAMLEN];
+    int handle;
+    uint32_t *rbbuffer;  /* DMA ring */
+    int drivercaps;
+    int vold;            /* number of bytes acquired so far, mod 2^31 */
+    long long v2gb;      /* extension for >2GByte processed data, only
+			    without Get_status */
+    long long processed; /* bytes taken from the DMA ring */
+    long long skew;      /* -k offset, in 1/256 nsec */
+    uint32_t rolloveroffset, oldevent; /* decoder state, see process_data */
+    int skipnumber;
+    uint64_t offsettime[16];
+    uint64_t *events;    /* decoded, but not yet merged events */
+    long head, n, size;
+    uint64_t lasttime;   /* newest decoded event */
+    double lastactive;   /* time of the last round with events, in sec */
+    long long lost_bytes;
+    int overruns;
+} card[MAX_CARDS];
+int ncards=0;
+
+/* hardware settings from the command line, the same for all cards */
+int configword = 0;   /* holds the default config register in FPGA of
+			 the timestamp card */
+int lookuptable[2048];
+int calibrationenable=0;
+int coinc_value = DEFAULT_COINC;
+int selftestmode=0; /* if mode=0, selftest is off. Explanation to come */
+int selftestlevela=0; int selftestlevelb=0;
+int input_threshold[4]={0,0,0,0}; /* input threshold in DAC units */
+int thresholdset=0; /* indicates if there is a threshold setting */
+int powercycle=0;
+int urbnumber=0; /* 0: leave driver default */
+int overrunpolicy=-1; /* -1: best the driver can do */
+int latency=-1; /* delivery latency target in usec, -1: driver default */
+
+/* FNV-1a hash of the lookup table, as tag of the RAM content in the driver */
+static unsigned long long lookuptable_tag(void) {
+    unsigned long long h = 14695981039346656037ULL;
+    int i;
+    for (i=0; i<2048; i++) {
+	h ^= lookuptable[i] & 0xffff;
+	h *= 1099511628211ULL;
+    }
+    return h ? h : 1; /* 0 means unknown */
+}
+
+/* load the lookup table into the FX2 RAM of card c. If the driver can, the
+   table goes down in one ioctl (the firmware still answers each word), and
+   not at all if the driver still holds the tag of the same table from an
+   earlier run. Returns 0 or an error
+   number */
+static int card_lutupload(struct card *c) {
+    static struct ramblock block;
+    unsigned long long tag, cardtag=0;
+    int i, sendvalue;
+
+    if (!(c->drivercaps & DRIVERCAP_RAMBULK)) { /* word by word */
+	for (i=0; i<2048; i++) {
+	    sendvalue=((lookuptable[i]&0xffff)<<16) | (i<<1);
+	    if (devioctl(c->handle, WRITE_RAM, &sendvalue)) return 19;
+	}
+	return 0;
+    }
+    tag = lookuptable_tag();
+    if (!devioctl(c->handle, Get_luttag, &cardtag) && (cardtag == tag)) {
+	if (verbosity>2) fprintf(stderr, "LUT already in RAM\n");
+	return 0;
+    }
+    block.address = 0; block.count = 2048;
+    for (i=0; i<2048; i++) block.words[i] = lookuptable[i] & 0xffff;
+    if (devioctl(c->handle, Write_rambulk, &block)) return 19;
+    if (devioctl(c->handle, Set_luttag, &tag)) return 19;
+    return 0;
+}
+
+/* initialize the hardware of one card up to the point where acquisition
+   can be switched on, and map its DMA ring. Returns 0 or an error number */
+static int card_init(struct card *c) {
+    int handle = c->handle;
+    int retval=0;
+    int powerstat; /* variable holding general power status */
+    int i;
+    uint16_t checksum, scratchram[128]; /* scratch ram mirror */
+    int sendvalue;
+    int policy = overrunpolicy;
+
+    /* Hard reset of power state */
+    if (powercycle) {
+      if (devioctl(handle, SET_POWER_STATE, POWER_OFF)) return 6;
+      if (verbosity>2)
+          fprintf(stderr, "Set power to 0\n");
+      sleep(POWER_SLEEP_SECONDS);
+      if (devioctl(handle, SET_POWER_STATE, POWER_ON)) return 6;
+      if (verbosity>2)
+          fprintf(stderr, "Set power to 1\n");
+    }
+
+    /* eventually stop running acquisition */
+    if (verbosity>2)
+	fprintf(stderr, "Stopping previous acquisition (FX2 part)....");
+    if (devioctl(handle, RESET_TRANSFER)) return 6;
+    if (verbosity>2) fprintf(stderr, "OK\n");
+
+    /* turn device on, boot FPGA, initialize clock and ADC */
+    if (devioctl(handle, CONFIG_TMSTDEVICE, 2)) return 5;
+
+    /* eventually stop running acquisition */
+    if (verbosity>2)
+	fprintf(stderr, "Stopping previous acquisition (device driver)....");
+    if (devioctl(handle, STOP_STREAM)) return 6;
+    if (verbosity>2) fprintf(stderr, "OK\n");
+
+    /* find out what the driver can do; old drivers know no caps */
+    c->drivercaps = devioctl(handle, Get_drivercaps);
+    if (c->drivercaps<0) c->drivercaps=0;
+
+    /* size of the DMA buffer: either from commandline, or driver default.
+       With several cards, the first one decides */
+    if (!readback_buffersize) {
+	retval = devioctl(handle, Get_ringsize);
+	if ((retval < MIN_READBACK_BUFFERSIZE) || (retval & (retval-1)))
+	    retval = DEFAULT_READBACK_BUFFERSIZE; /* no useful suggestion */
+	readback_buffersize = retval;
+    }
+    if (urbnumber) {
+	if (devioctl(handle, Set_urbnumber, urbnumber)) return 53;
+    }
+    if (latency>=0) {
+	if (c->drivercaps & DRIVERCAP_LATENCY) {
+	    if (devioctl(handle, Set_latency, latency)) return 78;
+	} else if (verbosity>0) {
+	    fprintf(stderr, "driver has no latency target, ignoring -l\n");
+	}
+    }
+
+    /* allocate and map I/O memory */
+    if (handle<0) {
+	c->rbbuffer = (uint32_t *) sim_mmap(handle, readback_buffersize);
+    } else {
+	c->rbbuffer =  (uint32_t *) mmap(NULL, readback_buffersize,
+					 PROT_READ|PROT_WRITE,
+					 MAP_SHARED, handle, 0);
+    }
+    if (c->rbbuffer == MAP_FAILED) return 5;
+    /* the driver only knows after mmap if it could map the whole ring */
+    retval = devioctl(handle, Get_drivercaps);
+    if (retval>=0) c->drivercaps = retval;
+    /* pre-populate page tables by visiting each of them, unless the
+       driver has mapped the whole ring already */
+    if (!(c->drivercaps & DRIVERCAP_PREMAP))
+	for (i=0; i< (readback_buffersize/4); i+=1024)
+	    retval=retval+c->rbbuffer[i];
+    if (verbosity>2) fprintf(stderr, "Memory buffer prepared\n");
+    
+    /* Check if LUT is loaded in timestamp FX2 RAM */
+    if (devioctl(handle, GET_POWER_STATE, &powerstat)) return 4;
+    if (!(powerstat & LUT_LOADED)) {
+	/* try to reload LUT */
+    	if(devioctl(handle, RETREIVE_EEPROM)) return 16;
+    	if (devioctl(handle, GET_POWER_STATE, &powerstat)) return 4;
+    	if (!(powerstat & LUT_LOADED)) return 17;
+    }
+    /* do consistency check if flash data is ok. This means that
+       1. number of data words (ex count and chksum) in the first 2 bytes
+       2. an offset/routing in the second word
+       3. Scratch ram contains a valid checksum (all add up to 0).
+       A valid sequence is 0x0001 0x0011 0xffee  */
+    for (checksum=0,i=0; i<128; i++) {
+    	retval=4096+2*i;
+    	if (devioctl(handle, READ_RAM, &retval)) return 18;
+    	scratchram[i]=retval>>16;
+    	if (verbosity>3) fprintf(stderr,"i: %02x: %04x\n",i,scratchram[i]);
+    	checksum += scratchram[i];
+    	if (i>scratchram[0]) break;
+    	}
+    if (verbosity>3) fprintf(stderr,"checksum: %d\n",checksum);
+
+    /* if checksum==0 here, we have a valid flash entry */
+    if (checksum != 0) { /* invalid chksum, fill FX RAM with LUT data*/
+	retval = card_lutupload(c);
+	if (retval) return retval;
+	sendvalue = 0; /* no adc offset, lores routing 2us periode for NIM */
+    } else { /* we have a valid checksum, compose a config that honors
+		both simple and NIM config info */
+	sendvalue = scratchram[1] | ((scratchram[0]==2?scratchram[2]:0)<<16);
+    }
+    if (verbosity>2) fprintf(stderr, "LUT checked in eeprom\n");
+
+    /* send parameters to external DACs if needed */
+    if (selftestmode) {
+	if (devioctl(handle, WRITE_EXTRA_DAC,
+		  0x4000 | (selftestlevela & 0xfff))) return 41;
+	if (devioctl(handle, WRITE_EXTRA_DAC,
+		  0x5000 | (selftestlevelb & 0xfff))) return 41;
+    }
+
+    /* eventually set input threshold parameters */
+    if (thresholdset) {/* we have to set the input DAC */
+	for (i=0; i<4; i++) {
+	    /* write thresold value */
+	    if (devioctl(handle, WRITE_INPUT_DAC,
+		      ((3-i)<<12) | (input_threshold[i]&0xfff) )
+		) return 43;
+	    /* set polarity selector voltage; this is somewhat dirty */
+	    if (devioctl(handle, WRITE_INPUT_DAC,
+		      ((i+4)<<12) |
+		      /* this is a dirty logical xor for the ECL levels */
+		      ((!(input_threshold[i]>1365) != !(i&1))?0xb0e:0x72d))
+		) return 43;
+	}
+    }
+
+    /* send configuration */
+    configword = (coinc_value<<10) |
+       (fastmode?(ShortFormat | DummyInject):(LongFormat | NoDummyInject)) |
+       (calibrationenable?NIMOUTenable:0) ;
+    if (devioctl(handle, WRITE_CPLD, configword | ParameterSelect | CounterReset))
+      return 21;
+    /* send ADC and NIM parameters */
+    if (devioctl(handle, WRITE_CPLD_LONG, sendvalue)) return 22;
+    /* send selftest mode parameter */
+    if (devioctl(handle, WRITE_CPLD_LONG, selftestmode)) return 40;
+    if (verbosity>2) fprintf(stderr,"OK\n");
+    
+    /* send LUT from FX2 RAM to FPGA */
+    if (devioctl(handle, WRITE_CPLD, configword | LookuptabSelect| CounterReset))
+       return 21;
+    if (verbosity>2) fprintf(stderr,"Pushing LUT to FPGA.....");
+    if (devioctl(handle, PUSH_LOOKUP)) return 20;
+    if (verbosity>2) fprintf(stderr, "OK\n");
+
+    /* Reset counters and FIFos on card */
+    sendvalue = FIFOreset | CounterReset | configword; /* acquisition on */
+    if (devioctl(handle, WRITE_CPLD, sendvalue)) return 21;
+
+    if (c->drivercaps & DRIVERCAP_CONSUMER) {
+	if (policy<0) policy=OVERRUN_BACKPRESSURE;
+	if (devioctl(handle, Set_overrunpolicy, policy)) return 56;
+    } else if ((policy>OVERRUN_IGNORE) && (verbosity>0)) {
+	fprintf(stderr, "driver has no overrun policy, only detecting loss\n");
+    }
+
+    /* start host side USB engine */
+    if (devioctl(handle, Start_USB_machine)) return 23;
+    return 0;
 }
-/* declare handler */
-struct sigaction timeraction = {.sa_handler = &timer_handler,
-				.sa_flags = SA_RESTART,};
 
-/* SIGUSR machinery */
-int sigusrnote=0; /* to notify main loop about a signal, avoid complicated
-		   stuff at this point, as sigusr are not very time-critical */
-void sigusr_handler(int sig) {
-    if (sig==SIGUSR1) sigusrnote=1;
-    if (sig==SIGUSR2) sigusrnote=2;
+static double card_clock(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1E-9*t.tv_nsec;
 }
-/* declare handler */
-struct sigaction sigusr_action = {.sa_handler = &sigusr_handler,
-				  .sa_flags = SA_RESTART,};
-/* termination signal handler */
-int running=0; /* global process variables for running status */
-void sigterm_handler(int sig) {
-    switch (sig) {
-    case SIGTERM:
-	//fprintf(stderr,"SIGTERM received\n");
-	running=0;
-	break;
-    case SIGPIPE:
-	//fprintf(stderr,"SIGPIPE received\n");
-	running=0;
-	break;
-    case SIGINT:
-	//fprintf(stderr,"SIGINT received\n");
-	running=0;
-	break;
+
+/* decode the words start..end of the DMA ring of card c into its event
+   buffer, with the decoder state of that card. The global decoder state
+   is only borrowed. Returns 0 or an error number */
+static int card_decode(struct card *c, int start, int end) {
+    uint64_t *savedbuf = outbuf, *p;
+    uint64_t id = (uint64_t)(c-card)<<CARD_IDSHIFT;
+    int savedsamples = numberofsamples;
+    long i, n;
+    int retval;
+
+    if (c->n + end-start > c->size) { /* one event per word at worst */
+	if (c->head) {
+	    memmove(c->events, &c->events[c->head],
+		    (c->n-c->head)*sizeof(uint64_t));
+	    c->n -= c->head; c->head=0;
+	}
+	if (c->n + end-start > c->size) {
+	    p = realloc(c->events, 2*(c->n+end-start)*sizeof(uint64_t));
+	    if (!p) return 54;
+	    c->events = p; c->size = 2*(c->n+end-start);
+	}
     }
+    memcpy(offsettime, c->offsettime, sizeof(offsettime));
+    rolloveroffset = c->rolloveroffset; oldevent = c->oldevent;
+    skipnumber = c->skipnumber;
+    outbuf = &c->events[c->n];
+    numberofsamples = 0; /* the merge stage counts events */
+    retval = process_data(c->rbbuffer, start, end, NULL);
+    outbuf = savedbuf; numberofsamples = savedsamples;
+    c->rolloveroffset = rolloveroffset; c->oldevent = oldevent;
+    c->skipnumber = skipnumber;
+    if (retval<0) return -retval;
+
+    n = fastmode ? retval : retval/2;
+    for (i=c->n; i<c->n+n; i++)
+	c->events[i] = (c->events[i] & ~CARD_IDMASK) | id;
+    c->n += n;
+    if (n) c->lasttime = c->events[c->n-1];
+    return 0;
 }
-/* declare handler */
-struct sigaction sigterm_action = {.sa_handler = &sigterm_handler,
-				   .sa_flags = SA_RESTART,};
 
+/* number of bytes card c has delivered into its DMA ring so far, or -1 on
+   a transfer error. Older drivers only give this mod 2^31; it is extended
+   here assuming that less than 2GB arrive between two calls */
+static long long card_transferred(struct card *c) {
+    struct ringstatus st;
+    int v;
+    if (c->drivercaps & DRIVERCAP_STATUS) {
+	if (devioctl(c->handle, Get_status, &st) || st.errstat) return -1;
+	return st.received;
+    }
+    v = devioctl(c->handle, Get_transferredbytes);
+    if (v<0) return -1;
+    if (v<c->vold) c->v2gb += 0x80000000L;
+    c->vold = v;
+    return v + c->v2gb;
+}
 
-/* variables and code for processing events */
-int numberofsamples = DEFAULT_MAXEVENTS; /* sampled events. 0 means unlimited,
-					int is ok for small limited lengths */
-int processedevents = 0; /* only relevant if numberofsamples !=0 */
-uint64_t offsettime[16]; /* time differences for different detector states */
-int legacyswapoption=0;  /* if set, swap to old version of binary output */
-char patt2det[16] = {-1, 0, 1, -1, 2, -1, -1, -1, 3, -1, -1, -1, -1, -1, -1, -1}; /* translation table patt->det */
+/* take all new data out of the DMA ring of card c, and release the ring.
+   Returns 0 or an error number */
+static int card_drain(struct card *c, double now) {
+    long long vll, skipto, start, len;
+    long pending = c->n - c->head;
+    int retval;
 
-/* intermediate buffer for processed events */
-uint64_t outbuf[dmasize_in_uint64]; /* holds postprocessed data  */
-uint32_t rolloveroffset=0;          /* used for 32bit patterns, upper32bit */
-uint32_t newevent, oldevent=0;      /* rollover detection */
+    vll = card_transferred(c);
+    if (vll<0) return 30;
+    vll &= ~7LL;
+    /* lapped by the DMA engine: skip as with a single card */
+    if (vll - c->processed > (long long)readback_buffersize) {
+	skipto = (vll - readback_buffersize/2) & ~7LL;
+	c->lost_bytes += skipto - c->processed; c->overruns++;
+	fprintf(stderr, "overrun on card %d: %lld bytes lost\n",
+		(int)(c-card), skipto - c->processed);
+	c->processed = skipto;
+    }
+    stats_fill(vll - c->processed);
+    /* at most two segments, up to the end of the ring and from its start */
+    while (c->processed < vll) {
+	start = c->processed % readback_buffersize;
+	len = vll - c->processed;
+	if (len > (long long)readback_buffersize - start)
+	    len = readback_buffersize - start;
+	retval = card_decode(c, start/4, (start+len)/4);
+	if (retval) return retval;
+	c->processed += len;
+    }
+    if (c->n - c->head > pending) c->lastactive = now;
+    if (c->drivercaps & DRIVERCAP_CONSUMER)
+	devioctl(c->handle, Set_consumerpointer,
+		 (int)(c->processed & 0x7fffffff));
+    return 0;
+}
 
-/* code to process timestamp data into an output stream. Returns number of
-   processed 32bit words, or a negative number on error or exception */
-int process_data(uint32_t *rbbuffer, int startindex, int endindex, 
-		 FILE *outfile) {
-    int i,j, j2, endindex2;
-    uint64_t rawevent;
-    uint32_t highword, lowword;
+/* events up to this one are complete from all active cards */
+static uint64_t cards_watermark(double now) {
+    uint64_t w = UINT64_MAX;
+    int k;
+    for (k=0; k<ncards; k++)
+	if ((now - card[k].lastactive < MERGE_HOLDOFF) &&
+	    (card[k].lasttime < w)) w = card[k].lasttime;
+    return w;
+}
 
-    if (fastmode){ /* we have 32bit events from the card and need to expand */
-	switch (outmode) {
-	case -1: /* raw binary output */
-	case 0:  /* direct data, conversion to hex in 32bit chunks - legacy mode */
-	    endindex2=endindex;
-	    if (numberofsamples) { /* calculate how many words we can process */
-		if ((endindex-startindex) > (numberofsamples-processedevents)) {
-		    endindex2=startindex+(numberofsamples-processedevents);
-		    running=0; /* eventually stop acquisition */
-		}
-	    }
-	    if (outmode) { /* send out raw binary data */
-		fwrite(&rbbuffer[startindex], sizeof(int32_t),
-		       endindex2-startindex, outfile);
-	    } else {      /* print raw data in hex format as 32bit chunks */
-		for (i=startindex; i<endindex2; i++) 
-		    fprintf(outfile, "%08x\n",rbbuffer[i]);
-	    }
-	    return endindex2-startindex;
-	    
-	case 1: /* postprocessed output, eventually with a word swap for legacy
-		   software compatibility - binary version  */
-	case 2: /* same as mode 1, but hex version */
-	    /* todo : honor maxevents */
-	    j=0;
-	    for (i=startindex; i<endindex; i+=1) {//CHECK:is i+1 correct here?
-		newevent = rbbuffer[i];
-		/* do any consistency checks etc here */
-		if (newevent==0) continue; /* we have a void urb return */
-		if ((~newevent & oldevent)&0x80000000) {/* we have a rollover */
-		    rolloveroffset++;
-		}
-		oldevent = newevent;
-		rawevent = (newevent & 0x3f) | 0x300 |
-		    ((newevent & ~0x3f)| (((uint64_t)rolloveroffset)<<32))<<4;
-		/* do any time corrections here */
-		if (shortmode==1) 
-		    rawevent = (rawevent & 0xffffffffffff83ffLL);
-		if (skipnumber) {
-		    skipnumber--;
-		} else {
-		    outbuf[j] = rawevent + offsettime[rawevent&0xf]; j++;	
-		    /* do event number test */
-		    if (numberofsamples) {
-			processedevents++;
-			if (processedevents >= numberofsamples) {
-			    running=0;break;
-			}
-		    }
-		}
-	    }
+/* merge the decoded events of all cards up to watermark in time order,
+   and send them to the output stage. Runs of events from one card are
+   copied in one go up to the next event of another card */
+static void cards_merge(uint64_t watermark, FILE *outfile) {
+    long j=0, maxj = readback_buffersize/4; /* size of outbuf */
+    uint64_t bound;
+    struct card *c;
+    int k, m;
 
-	    /* do 32bit word swap for legacy output if needed */
-	    
-	    /* now we need to output this */
-	    if (outmode==1) { /* this is plain binary output */
-		if (legacyswapoption) { /* swap first and second 32bit words */
-		    for (j2=0; j2<j; j2++) {
-			highword = outbuf[j2]>>32LL; lowword=outbuf[j2]&0xffffffff;
-			outbuf[j2]= (uint64_t)lowword<<32 | highword;
-		    }
-		}
-		fwrite(outbuf, sizeof(uint64_t), j, outfile);
-	    } else { /* this is the hex text version */
-		for (j2=0; j2<j; j2++) {
-		    fprintf(outfile, "%016llx\n",
-			    (long long unsigned int) outbuf[j2]);
-		}
-	    }
-	    return j; /* number of processed uint32 entries */
-	    
-	}
-	
-    } else { /* we have 64 bit timing events */
-	switch (outmode) {
-	case -1: /* raw binary output */
-	case 0:  /* direct data, conversion to hex in 32bit chunks - legacy mode */
-	    endindex2=endindex;
-	    if (numberofsamples) { /* calculate how many words we can process */
-		if ((2*(endindex-startindex)) > (numberofsamples-processedevents)) {
-		    endindex2=startindex+(numberofsamples-processedevents)*2;
-		    running=0; /* eventually stop acquisition */
-		}
+    while (!numberofsamples || (processedevents < numberofsamples)) {
+	for (m=-1, k=0; k<ncards; k++) /* earliest pending event */
+	    if ((card[k].head < card[k].n) && ((m<0) ||
+		(card[k].events[card[k].head] < card[m].events[card[m].head])))
+		m=k;
+	if ((m<0) || (card[m].events[card[m].head] > watermark)) break;
+	for (bound=watermark, k=0; k<ncards; k++) /* next one of the others */
+	    if ((k!=m) && (card[k].head < card[k].n) &&
+		(card[k].events[card[k].head] < bound))
+		bound = card[k].events[card[k].head];
+	c = &card[m];
+	while ((c->head < c->n) && (c->events[c->head] <= bound)) {
+	    outbuf[j++] = c->events[c->head++];
+	    if (j == maxj) {
+		output_events(outbuf, j, outfile); j=0;
 	    }
-	    if (outmode) { /* send out raw binary data */
-		fwrite(&rbbuffer[startindex], sizeof(int32_t),
-		       endindex2-startindex, outfile);
-	    } else {      /* print raw data in hex format as 32bit chunks */
-		for (i=startindex; i<endindex2; i++) 
-		    fprintf(outfile, "%08x\n",rbbuffer[i]);
+	    if (numberofsamples && (++processedevents >= numberofsamples)) {
+		running=0; break;
 	    }
-	    return endindex2-startindex;
-	    
-	case 1: /* postprocessed output, eventually with a word swap for legacy
-		   software compatibility - binary version  */
-	case 2: /* same as mode 1, but hex version */
-	    /* todo : honor maxevents */
-	    j=0;
-	    for (i=startindex; i+1<endindex; i+=2) {
-		rawevent = rbbuffer[i] | (((uint64_t)rbbuffer[i+1])<<32);
-		/* do any consistency checks etc here */
-		if (rawevent==0) continue; /* we have a void urb return */
-		/* do any time corrections here */
-		if (shortmode==1) 
-		    rawevent = (rawevent & 0xffffffffffff83ffLL);
-		if (skipnumber) {
-		    skipnumber--;
-		} else {
-		    outbuf[j] = rawevent + offsettime[rawevent&0xf]; j++;	
-		    /* do event number test */
-		    if (numberofsamples) {
-			processedevents++;
-			if (processedevents >= numberofsamples) {
-			    running=0;break;
-			}
-		    }
-		}
-	    }
-
-	    /* do 32bit word swap for legacy output if needed */
-	    
-	    /* now we need to output this */
-	    if (outmode==1) { /* this is plain binary output */
-		if (legacyswapoption) { /* swap first and second 32bit words */
-		    for (j2=0; j2<j; j2++) {
-			highword = outbuf[j2]>>32LL; lowword=outbuf[j2]&0xffffffff;
-			outbuf[j2]= (uint64_t)lowword<<32 | highword;
-		    }
-		}
-		fwrite(outbuf, sizeof(uint64_t), j, outfile);
-	    } else { /* this is the hex text version */
-		for (j2=0; j2<j; j2++) {
-		    fprintf(outfile, "%016llx\n",
-			    (long long unsigned int) outbuf[j2]);
-		}
-	    }
-	    return 2*j; /* number of processed uint32 entries */
-	    
 	}
     }
-    /* this should never be reached */
-    return -31; /* something silly happened */
+    if (j) output_events(outbuf, j, outfile);
 }
 
+/* main loop for several cards. Returns 0 or an error number */
+static int cards_acquire(int pollmode, int polltimeout) {
+    struct pollfd pfd[MAX_CARDS];
+    double now = card_clock();
+    int k, retval, sendvalue;
+    long long t0, before;
+
+    for (k=0; k<ncards; k++) {
+	card[k].lastactive = now;
+	pfd[k].fd = card[k].handle; pfd[k].events = POLLIN;
+    }
+    do {
+	if (pollmode) {
+	    poll(pfd, ncards, polltimeout); /* any card with data */
+	} else {
+	    pause(); /* see polltime structure for typical duration */
+	}
+
+	/* check if we need to update the acquisition status */
+	if (sigusrnote) {
+	    sendvalue = configword;
+	    collectionmode=(sigusrnote==1)?1:0; sigusrnote=0;
+	    if (collectionmode) sendvalue |= CollectEN|CollectLED; /* acq on */
+	    for (k=0; k<ncards; k++)
+		if (devioctl(card[k].handle, STOP_STREAM)) return 25;
+	    for (k=0; k<ncards; k++)
+		if (devioctl(card[k].handle, WRITE_CPLD, sendvalue)) return 21;
+	    for (k=0; k<ncards; k++)
+		if (devioctl(card[k].handle, START_STREAM)) return 24;
+	}
+
+	now = card_clock();
+	t0 = stats_begin();
+	for (k=0, before=0; k<ncards; k++) before += card[k].processed;
+	for (k=0; k<ncards; k++) {
+	    retval = card_drain(&card[k], now);
+	    if (retval) return retval;
+	}
+	cards_merge(cards_watermark(now), stdout);
+	for (k=0; k<ncards; k++) before -= card[k].processed;
+	stats_round(-before, t0);
+    } while (running);
+
+    cards_merge(UINT64_MAX, stdout); /* what is left over */
+    return 0;
+}
 
 int main(int argc, char *argv[]) {
     int opt; /* for parsing command line options */
     int handle; /* file handle for usb device */
-    int configword = 0;   /* holds the default config register in FPGA of
-			     the timestamp card */
-    char devicefilename[FILENAMLEN] = DEFAULTDEVICENAME;
     char lookupfilename[FILENAMLEN] = "";
     int retval;
-    int powerstat; /* variable holding general power status */
-    int lookuptable[2048];
     FILE *lookupfile;
-    int i, j;
-    uint16_t checksum, scratchram[128]; /* scratch ram mirror */
+    int i, j, k;
     int sendvalue;
-    int v, vold;  /* number of bytes acquired so far, mod 2^31 */
-    long long vll, v2gb; /* extension for >2GByte processed data */
+    long long vll; /* number of bytes acquired so far */
+    long long t0; /* start of processing, for -I */
+    long long tskew; /* skew spread, for -g */
     int looperror; /* for read in loop */
     unsigned long long prev_processed_bytes, tmp, tmp2;
     int startindex, bytesforthisround;
     int absolutetimemode=0;
-    int calibrationenable=0;
     struct timeval systemtimestamp; /*  structure to hold abs time request */
     uint64_t absolutetime; /* holds absolute time */
     int poweroffmode=0;
-    int coinc_value = DEFAULT_COINC;
     int dskew[8];          /* for detector skew correction, indexed by detector number */
     int dskew_mode= -1;      /* 0: in units of 1/256 nsecs. 1: in units of 1/8 nsecs. */
-    int selftestmode=0; /* if mode=0, selftest is off. Explanation to come */
-    int selftestlevela=0; int selftestlevelb=0;
-    int input_threshold[4]={0,0,0,0}; /* input threshold in DAC units */
-    int thresholdset=0; /* indicates if there is a threshold setting */
-    int powercycle=0;
+    char controlpath[FILENAMLEN] = "";
+    char shmname[FILENAMLEN] = ""; /* for -M option */
+    long long shmcapacity = TMSTSHM_DEFAULT_CAPACITY;
+    char indexname[FILENAMLEN] = ""; /* for -x option */
+    double indexinterval; /* in msec */
+    double windowms; /* gapless window length */
+    int pollmode=0; /* 0: timer and pause(), 1: poll() on device */
+    int lowwater=DEFAULT_LOWWATER, polltimeout=DEFAULT_POLL_TIMEOUT;
+    int drivercaps;
+    int pending; /* data left over from last round */
+    struct pollfd pfd[2]; /* device and control socket */
+    long long lost_bytes=0, skipto; /* reader side overrun detection */
+    int overruns=0;
+    int zerocopyopt=0;
+    long long consumed;
+    unsigned long long driver_lost_bytes=0;
 
 
     /* set skew to zero by default */
@@ -478,14 +2722,21 @@ int main(int argc, char *argv[]) {
     /* --------parsing arguments ---------------------------------- */
     
     opterr=0; /* be quiet when there are no options */
-    while ((opt=getopt(argc, argv, "U:v:q:a:rRAXQc:d:D:sjS:b:t:fL:Z")) != EOF) {
+    while ((opt=getopt(argc, argv, "U:v:q:a:rRAXQc:d:D:sjS:b:t:fL:ZH:p:B:u:o:zC:w:M:J:k:F:I:l:m:g:n:x:")) != EOF) {
 	switch(opt) {
 	case 'q': /* set number of samples to be read in */
 	    if (sscanf(optarg,"%d", &numberofsamples)!=1 ) return -emsg(7);
 	    break;
-	case 'U': /* enter device file name */
-	    if (sscanf(optarg,"%99s",devicefilename)!=1 ) return -emsg(2);
-	    devicefilename[FILENAMLEN-1]=0; /* close string */
+	case 'U': /* enter device file name, once per card */
+	    if (ncards >= MAX_CARDS) return -emsg(71);
+	    if (sscanf(optarg,"%99s",card[ncards].devicename)!=1 )
+		return -emsg(2);
+	    ncards++;
+	    break;
+	case 'k': /* time offsets of the cards */
+	    if (1>sscanf(optarg, "%lld,%lld,%lld,%lld", &card[0].skew,
+			 &card[1].skew, &card[2].skew, &card[3].skew))
+		return -emsg(72);
 	    break;
 	case 'v': /* set verbosity level */
 	    if (1!=sscanf(optarg,"%d",&verbosity)) return -emsg(3);
@@ -496,7 +2747,7 @@ int main(int argc, char *argv[]) {
 	    break;
 	case 'a': /* choose outmode */
 	    if (sscanf(optarg, "%d", &outmode)!=1) return -emsg(12);
-	    if ((outmode<0) || (outmode>2)) return -emsg(13);
+	    if ((outmode<-1) || (outmode>5)) return -emsg(13);
 	    break;
 	case 'r': /* begin immediately with acquisition */
 	    collectionmode=1;
@@ -583,59 +2834,167 @@ int main(int argc, char *argv[]) {
 	    thresholdset=1; /* we have a parameter setting attempt */
 	    break;
 	case 'f': /* set 32bit option */
-	    fastmode++; /* can increase */
+	    fastmode=1; /* repeated -f must not overrun decode_kernel */
 	    break;
         case 'Z': /* Force power cycle */
             powercycle=1;
 	    break;
+	case 'H': /* histogram definition for outmode 3 */
+	    if ((i=histogram_parse(optarg))) return -emsg(i);
+	    break;
+	case 'F': /* adaptive peak search */
+	    if (findpeak || numberofhistograms) return -emsg(75);
+	    if ((i=histogram_parse(optarg))) return -emsg((i==45)?74:i);
+	    findpeak=1;
+	    break;
+	case 'w': /* gapless windows */
+	    if ((1!=sscanf(optarg, "%lf", &windowms)) || (windowms<=0) ||
+		(windowms>1E9)) return -emsg(62);
+	    gaplesslength = (long long)(windowms*256E6 + 0.5);
+	    break;
+	case 'M': /* export events into a shared memory ring */
+	    shmname[0]='/'; /* shm_open wants a leading slash */
+	    i=sscanf(optarg, "%198[^,],%lld", shmname+1, &shmcapacity);
+	    if (i<1) return -emsg(64);
+	    if (shmname[1]=='/') memmove(shmname, shmname+1, strlen(shmname));
+	    if (strchr(shmname+1, '/')) return -emsg(64);
+	    if ((shmcapacity<SHM_MIN_CAPACITY) ||
+		(shmcapacity>SHM_MAX_CAPACITY) ||
+		(shmcapacity & (shmcapacity-1))) return -emsg(65);
+	    break;
+	case 'l': /* latency target of the driver */
+	    if (1!=sscanf(optarg, "%d", &latency)) return -emsg(77);
+	    if ((latency<0) || (latency>1000000)) return -emsg(77);
+	    break;
+	case 'I': /* periodic statistics */
+	    if (sscanf(optarg, "%d,%lf", &statsfd, &stats_interval) < 1)
+		return -emsg(76);
+	    if ((statsfd<0) || (stats_interval<=0)) return -emsg(76);
+	    break;
+	case 'm': /* detector mask */
+	    if ((i=filter_parsemask(optarg))) return -emsg(i);
+	    break;
+	case 'g': /* coincidence filter */
+	    if ((1!=sscanf(optarg, "%lf", &filterwindow)) || (filterwindow<=0)
+		|| (filterwindow>1E9)) return -emsg(80);
+	    break;
+	case 'n': /* decimation */
+	    if ((1!=sscanf(optarg, "%d", &decimation)) || (decimation<1))
+		return -emsg(81);
+	    break;
+	case 'x': /* time index */
+	    indexinterval = TMSTINDEX_DEFAULT_INTERVAL;
+	    if ((sscanf(optarg, "%199[^,],%lf", indexname, &indexinterval) < 1)
+		|| (indexinterval<=0)) return -emsg(84);
+	    break;
+	case 'J': /* threaded pipeline */
+	    j=sscanf(optarg, "%d,%d,%d", &pipe_cpu[0], &pipe_cpu[1],
+		     &pipe_cpu[2]);
+	    if (j<1) return -emsg(68);
+	    for (i=0; i<PIPE_STAGES; i++)
+		if ((pipe_cpu[i]<-1) || (pipe_cpu[i]>=CPU_SETSIZE))
+		    return -emsg(68);
+	    pipeline=1;
+	    break;
+	case 'C': /* persistent acquisition with control socket */
+	    if (sscanf(optarg, "%199s", controlpath)!=1) return -emsg(60);
+	    controlpath[FILENAMLEN-1]=0;
+	    break;
+	case 'p': /* wait for data with poll() */
+	    i=sscanf(optarg, "%d,%d", &lowwater, &polltimeout);
+	    if ((i<1) || (lowwater<1) || (polltimeout<0)) return -emsg(49);
+	    pollmode=1;
+	    break;
+	case 'B': /* size of DMA buffer */
+	    if (1!=sscanf(optarg, "%lu", &readback_buffersize)) return -emsg(51);
+	    if ((readback_buffersize < MIN_READBACK_BUFFERSIZE) ||
+		(readback_buffersize > MAX_READBACK_BUFFERSIZE) ||
+		(readback_buffersize & (readback_buffersize-1)))
+		return -emsg(51);
+	    break;
+	case 'u': /* number of urbs in flight */
+	    if (1!=sscanf(optarg, "%d", &urbnumber)) return -emsg(52);
+	    if ((urbnumber<1) || (urbnumber>MAX_URBS_NUMBER)) return -emsg(52);
+	    break;
+	case 'z': /* zero-copy output */
+	    zerocopyopt=1;
+	    break;
+	case 'o': /* overrun policy */
+	    if (1!=sscanf(optarg, "%d", &overrunpolicy)) return -emsg(55);
+	    if ((overrunpolicy<OVERRUN_IGNORE) ||
+		(overrunpolicy>OVERRUN_COUNT)) return -emsg(55);
+	    break;
 
 	}
     }
+    if (findpeak) {
+	if ((numberofhistograms>1) || gaplesslength || controlpath[0])
+	    return -emsg(75);
+	outmode=3;
+    }
     if (outmode == 0 && shortmode) return -emsg(44);
+    if (!ncards) {
+	strcpy(card[0].devicename, DEFAULTDEVICENAME); ncards=1;
+    }
+    if ((ncards>1) && (pipeline || controlpath[0] ||
+		       ((outmode!=1) && (outmode!=2) && (outmode!=5))))
+	return -emsg(73);
+    if (pipeline && (zerocopyopt || controlpath[0])) return -emsg(69);
+    if (zerocopyopt) {
+	if (outmode != -1) return -emsg(57);
+	fflush(stdout);
+	zerocopy_init(fileno(stdout));
+    }
+    if (gaplesslength && (controlpath[0] || (outmode<3) || (outmode>4)))
+	return -emsg(63);
+    if (outmode == 4) { /* only counts, no histograms */
+	if (controlpath[0]) return -emsg(63);
+	histogram_free();
+	if (!gaplesslength) gaplesslength = DEFAULT_SINGLESWINDOW*256000000LL;
+    } else if (controlpath[0]) { /* histograms come with the requests */
+	outmode=3;
+	histogram_free();
+	if (control_open(controlpath)) return -emsg(61);
+    } else if (outmode == 3) { /* prepare histogram */
+	if (!numberofhistograms) return -emsg(47);
+	if (findpeak) findpeak_init();
+	if ((i=histogram_alloc())) return -emsg(i);
+    }
+    if ((filter_mask || (filterwindow>0) || (decimation>1)) && (outmode<1))
+	return -emsg(82);
+    if (indexname[0]) {
+	if ((outmode!=1) && (outmode!=5)) return -emsg(86);
+	if ((i=index_open(indexname, indexinterval))) return -emsg(i);
+    }
+    if (shmname[0]) {
+	if (outmode<1) return -emsg(67);
+	if (shm_export_open(shmname, shmcapacity)) return -emsg(66);
+    }
 
     /* install signal handlers: polling timer, user signals */
     if (sigaction(SIGALRM, &timeraction, NULL)) return -emsg(29);
     if (sigaction(SIGUSR1, &sigusr_action, NULL)) return -emsg(29);
     if (sigaction(SIGUSR2, &sigusr_action, NULL)) return -emsg(29);
+    if (sigaction(SIGHUP, &sighup_action, NULL)) return -emsg(29);
     if (sigaction(SIGTERM, &sigterm_action, NULL)) return -emsg(29);
     if (sigaction(SIGPIPE, &sigterm_action, NULL)) return -emsg(29);
     if (sigaction(SIGINT, &sigterm_action, NULL)) return -emsg(29);
         
-    /* open device */
-    handle=open(devicefilename,O_RDWR | O_NONBLOCK);
-    if (handle==-1) {
-      fprintf(stderr, "errno: %d; ",errno);
-      return -emsg(1);
-    }
-
-    /* ------------- initialize hardware  ---------------------*/
-    /* Hard reset of power state */
-    if (powercycle) {
-      if (ioctl(handle, SET_POWER_STATE, POWER_OFF)) return -emsg(6);
-      if (verbosity>2)
-          fprintf(stderr, "Set power to 0\n");
-      sleep(POWER_SLEEP_SECONDS);
-      if (ioctl(handle, SET_POWER_STATE, POWER_ON)) return -emsg(6);
-      if (verbosity>2)
-          fprintf(stderr, "Set power to 1\n");
+    /* open devices, or set up the simulation with handles -1, -2.. */
+    for (k=0; k<ncards; k++) {
+	if (!strncmp(card[k].devicename, "sim:", 4)) {
+	    card[k].handle = -1-k;
+	    retval = sim_parse(card[k].handle, card[k].devicename+4);
+	    if (retval) return -emsg(retval);
+	    continue;
+	}
+	card[k].handle=open(card[k].devicename,O_RDWR | O_NONBLOCK);
+	if (card[k].handle<0) {
+	    fprintf(stderr, "errno: %d; ",errno);
+	    return -emsg(1);
+	}
     }
 
-    /* eventually stop running acquisition */
-    if (verbosity>2)
-	fprintf(stderr, "Stopping previous acquisition (FX2 part)....");
-    if (ioctl(handle, RESET_TRANSFER)) return -emsg(6);
-    if (verbosity>2) fprintf(stderr, "OK\n");
-
-    /* turn device on, boot FPGA, initialize clock and ADC */
-    if (ioctl(handle, CONFIG_TMSTDEVICE, 2)) return -emsg(5);
-
-    /* eventually stop running acquisition */
-    if (verbosity>2)
-	fprintf(stderr, "Stopping previous acquisition (device driver)....");
-    if (ioctl(handle, STOP_STREAM)) return -emsg(6);
-    if (verbosity>2) fprintf(stderr, "OK\n");
-
-
     /* Check if we need to load the LUT table from a file */
     if (lookupfilename[0]) {  
       if (verbosity>2)
@@ -655,102 +3014,24 @@ int main(int argc, char *argv[]) {
         
     /* some non-time-critical variables to set */
     absolutetime=0;
+    init_hextable();
+    init_fastexpand();
 
-    /* allocate and map I/O memory */
-    rbbuffer =  (uint32_t *) mmap(NULL, Readback_buffersize,
-				  PROT_READ|PROT_WRITE,
-				  MAP_SHARED, handle, 0);
-    if (rbbuffer == MAP_FAILED) return -emsg(5);
-    /* pre-populate page tables by visiting each of them */
-    for (i=0; i< (Readback_buffersize/4); i+=1024) retval=retval+rbbuffer[i];
-    if (verbosity>2) fprintf(stderr, "Memory buffer prepared\n");
-    
-    /* Check if LUT is loaded in timestamp FX2 RAM */
-    if (ioctl(handle, GET_POWER_STATE, &powerstat)) return -emsg(4);
-    if (!(powerstat & LUT_LOADED)) {
-	/* try to reload LUT */
-    	if(ioctl(handle, RETREIVE_EEPROM)) return -emsg(16);
-    	if (ioctl(handle, GET_POWER_STATE, &powerstat)) return -emsg(4);
-    	if (!(powerstat & LUT_LOADED)) return -emsg(17);
-    }
-    /* do consistency check if flash data is ok. This means that
-       1. number of data words (ex count and chksum) in the first 2 bytes
-       2. an offset/routing in the second word
-       3. Scratch ram contains a valid checksum (all add up to 0).
-       A valid sequence is 0x0001 0x0011 0xffee  */
-    for (checksum=0,i=0; i<128; i++) {
-    	retval=4096+2*i;
-    	if (ioctl(handle, READ_RAM, &retval)) return -emsg(18);
-    	scratchram[i]=retval>>16;
-    	if (verbosity>3) fprintf(stderr,"i: %02x: %04x\n",i,scratchram[i]);
-    	checksum += scratchram[i];
-    	if (i>scratchram[0]) break;
-    	}
-    if (verbosity>3) fprintf(stderr,"checksum: %d\n",checksum);
-
-    /* if checksum==0 here, we have a valid flash entry */
-    if (checksum != 0) { /* invalid chksum, fill FX RAM with LUT data*/
-    	for (i=0; i<2048; i++) {
-    	    sendvalue=((lookuptable[i]&0xffff)<<16) | (i<<1);
-    	    if (ioctl(handle, WRITE_RAM, &sendvalue)) return -emsg(19);
-    	}
-	sendvalue = 0; /* no adc offset, lores routing 2us periode for NIM */
-    } else { /* we have a valid checksum, compose a config that honors
-		both simple and NIM config info */
-	sendvalue = scratchram[1] | ((scratchram[0]==2?scratchram[2]:0)<<16);
-    }
-    if (verbosity>2) fprintf(stderr, "LUT checked in eeprom\n");
-
-    /* send parameters to external DACs if needed */
-    if (selftestmode) {
-	if (ioctl(handle, WRITE_EXTRA_DAC,
-		  0x4000 | (selftestlevela & 0xfff))) return -emsg(41);
-	if (ioctl(handle, WRITE_EXTRA_DAC,
-		  0x5000 | (selftestlevelb & 0xfff))) return -emsg(41);
-    }
-
-    /* eventually set input threshold parameters */
-    if (thresholdset) {/* we have to set the input DAC */
-	for (i=0; i<4; i++) {
-	    /* write thresold value */
-	    if (ioctl(handle, WRITE_INPUT_DAC,
-		      ((3-i)<<12) | (input_threshold[i]&0xfff) )
-		) return -emsg(43);
-	    /* set polarity selector voltage; this is somewhat dirty */
-	    if (ioctl(handle, WRITE_INPUT_DAC,
-		      ((i+4)<<12) |
-		      /* this is a dirty logical xor for the ECL levels */
-		      ((!(input_threshold[i]>1365) != !(i&1))?0xb0e:0x72d))
-		) return -emsg(43);
-	}
+    /* ------------- initialize hardware  ---------------------*/
+    for (k=0; k<ncards; k++) {
+	retval = card_init(&card[k]);
+	if (retval) return -emsg(retval);
     }
+    handle = card[0].handle; rbbuffer = card[0].rbbuffer;
+    drivercaps = card[0].drivercaps;
 
-    /* send configuration */
-    configword = (coinc_value<<10) |
-       (fastmode?(ShortFormat | DummyInject):(LongFormat | NoDummyInject)) |
-       (calibrationenable?NIMOUTenable:0) ;
-    if (ioctl(handle, WRITE_CPLD, configword | ParameterSelect | CounterReset))
-      return -emsg(21);
-    /* send ADC and NIM parameters */
-    if (ioctl(handle, WRITE_CPLD_LONG, sendvalue)) return -emsg(22);
-    /* send selftest mode parameter */
-    if (ioctl(handle, WRITE_CPLD_LONG, selftestmode)) return -emsg(40);
-    if (verbosity>2) fprintf(stderr,"OK\n");
-    
-    /* send LUT from FX2 RAM to FPGA */
-    if (ioctl(handle, WRITE_CPLD, configword | LookuptabSelect| CounterReset))
-       return -emsg(21);
-    if (verbosity>2) fprintf(stderr,"Pushing LUT to FPGA.....");
-    if (ioctl(handle, PUSH_LOOKUP)) return -emsg(20);
-    if (verbosity>2) fprintf(stderr, "OK\n");
-
-    /* Reset counters and FIFos on card */
-    sendvalue = FIFOreset | CounterReset | configword; /* acquisition on */
-    if (ioctl(handle, WRITE_CPLD, sendvalue)) return -emsg(21);
+    /* one postprocessed event per 32bit word at worst */
+    outbuf = (uint64_t *)malloc(readback_buffersize/4*sizeof(uint64_t));
+    if (!outbuf) return -emsg(54);
+    /* a large pipe must not block the DMA buffer entirely */
+    if (zerocopy_lag > readback_buffersize/2)
+	zerocopy_lag = readback_buffersize/2;
 
-    /* start host side USB engine */
-    if (ioctl(handle, Start_USB_machine))return -emsg(23);
-    
     /* unreset counter and fifo in FPGA, switch on collection */
     sendvalue = configword;
     if (sigusrnote) {
@@ -760,11 +3041,14 @@ int main(int argc, char *argv[]) {
     if (gettimeofday(&systemtimestamp, NULL)) return -emsg(32);
     
     if (collectionmode) sendvalue |= CollectEN|CollectLED; /* acquisition on */
-    if (ioctl(handle, WRITE_CPLD, sendvalue)) return -emsg(21);
+    /* all cards back to back, so that their counters start together */
+    for (k=0; k<ncards; k++)
+	if (devioctl(card[k].handle, WRITE_CPLD, sendvalue)) return -emsg(21);
 
     /* start streaming data from the  fx2 */
     if (verbosity>2) fprintf(stderr, "Starting acquisition in FX2..." );
-    if (ioctl(handle, START_STREAM)) return -emsg(24);
+    for (k=0; k<ncards; k++)
+	if (devioctl(card[k].handle, START_STREAM)) return -emsg(24);
     if (verbosity>2) fprintf(stderr, "OK\n" );
     
     /* now sort out time offsets */
@@ -785,79 +3069,176 @@ int main(int argc, char *argv[]) {
 	    offsettime[i] = absolutetime + ((j < 0) ? 0 : ((long long int)dskew[j] << 10 )); 
 	/*fprintf(stderr, "%i \t %lu \n", i, offsettime[i]);*/
     }
-    setitimer(ITIMER_REAL, &polltime, NULL); /* initiate polling timer */
+    /* card offsets on top, and the decoder state of every card */
+    for (k=0; k<ncards; k++) {
+	for (i=0; i<16; i++)
+	    card[k].offsettime[i] = offsettime[i] + (card[k].skew << 10);
+	card[k].skipnumber = skipnumber;
+    }
+    memcpy(offsettime, card[0].offsettime, sizeof(offsettime));
+    if (filterwindow>0) { /* events come out of order by the skew spread */
+	for (tskew=0, k=0; k<ncards; k++)
+	    for (i=1; i<16; i<<=1)
+		for (j=1; j<16; j<<=1)
+		    if ((long long)(card[k].offsettime[i]-card[k].offsettime[j])
+			> tskew)
+			tskew = card[k].offsettime[i]-card[k].offsettime[j];
+	filter_init(tskew>>10, (ncards>1) ? CARD_IDMASK : 0);
+    }
+    if (pollmode) { /* check if all drivers can do poll() */
+	for (k=0; k<ncards; k++)
+	    if (!(card[k].drivercaps & DRIVERCAP_POLL)) pollmode=0;
+	if (!pollmode) {
+	    if (verbosity>0)
+		fprintf(stderr, "driver has no poll(), using polling timer\n");
+	} else {
+	    for (k=0; k<ncards; k++)
+		if (devioctl(card[k].handle, Set_lowwater, lowwater))
+		    return -emsg(50);
+	}
+    }
+    if (!pollmode)
+	setitimer(ITIMER_REAL, &polltime, NULL); /* initiate polling timer */
+    pfd[0].fd = handle; pfd[0].events = POLLIN;
+    pfd[1].fd = -1; pfd[1].events = POLLIN;
     
-    running=1; looperror=0; prev_processed_bytes=0; vold=0;
-    v2gb=0;
+    running=1; looperror=0; prev_processed_bytes=0; pending=0;
+    stats.start = stats.last = stats_begin();
+    if (pipeline && pipe_start()) return -emsg(70);
 
     /* ------------- start acquisition - main loop ---------*/
-    do {
-	pause(); /* see polltime structure for typical duration */
+    if (ncards>1) looperror = cards_acquire(pollmode, polltimeout);
+    else do {
+	if (pollmode) {
+	    /* returns early on data, errors, or signals */
+	    /* listen to new requests only between windows */
+	    pfd[1].fd = (clientfd<0) ? controlfd : -1;
+	    if (!pending) poll(pfd, 2, polltimeout);
+	} else {
+	    pause(); /* see polltime structure for typical duration */
+	}
 
 	/* check if we need to update the acquisition status */
 	if (sigusrnote) {
 	    sendvalue = configword;
 	    collectionmode=(sigusrnote==1)?1:0; sigusrnote=0;
 	    if (collectionmode) sendvalue |= CollectEN|CollectLED; /* acq on */
-	    if (ioctl(handle, STOP_STREAM)) {looperror=25; continue;}
-	    if (ioctl(handle, WRITE_CPLD, sendvalue)) {looperror=21; continue;} 
-	    if (ioctl(handle, START_STREAM)) {looperror=24;continue;}
+	    if (devioctl(handle, STOP_STREAM)) {looperror=25; continue;}
+	    if (devioctl(handle, WRITE_CPLD, sendvalue)) {looperror=21; continue;} 
+	    if (devioctl(handle, START_STREAM)) {looperror=24;continue;}
 	}
-	v=ioctl(handle, Get_transferredbytes);
+	vll=card_transferred(&card[0]);
 
-	if (verbosity>5) fprintf(stderr, "bytes: %d\n",v);
+	if (verbosity>5) fprintf(stderr, "bytes: %lld\n",vll);
 
-	if (v<0) { /* check for errors */
+	if (vll<0) { /* check for errors */
 	    looperror=30;
 	    break;
 	}
-	/* do 2GB extension, limited by readback value from transfer */
-	if (v<vold) v2gb += 0x80000000L;
-	vold=v;
-	
-	/* check how many bytes to postprocess this round; avoid rollover */
-	vll=v+v2gb;
-	tmp=vll/Readback_buffersize; 
-	tmp2=prev_processed_bytes/Readback_buffersize;
-	if (tmp > tmp2)
-	    vll=(tmp2+1)*Readback_buffersize; /* only ascending buffers */
+	/* check how many bytes to postprocess this round */
+	/* were we lapped by the DMA engine? Then skip the overwritten part
+	   and restart half a buffer behind the write position */
+	if (vll-(long long)prev_processed_bytes > (long long)readback_buffersize) {
+	    skipto = (vll - readback_buffersize/2) & ~7LL;
+	    lost_bytes += skipto-prev_processed_bytes; overruns++;
+	    fprintf(stderr, "overrun: %lld bytes lost\n",
+		    skipto-(long long)prev_processed_bytes);
+	    prev_processed_bytes = skipto;
+	}
+	stats_fill(vll-prev_processed_bytes);
+	tmp=vll/readback_buffersize; 
+	tmp2=prev_processed_bytes/readback_buffersize;
+	pending = (tmp > tmp2);
+	if (pending)
+	    vll=(tmp2+1)*readback_buffersize; /* only ascending buffers */
 	/* vll now contains the number of bytes (from start) to be 
 	   processed in this round */
 	
 	bytesforthisround = (vll-prev_processed_bytes) & ~7LL;
-	startindex = (prev_processed_bytes % Readback_buffersize)
+	startindex = (prev_processed_bytes % readback_buffersize)
 	    /sizeof(uint32_t);
 	
 	/* do actual processing of one buffer segment */
-	retval = process_data(rbbuffer,
-			      startindex, startindex + bytesforthisround/4,
-			      stdout);
-	
-	if (retval<0) looperror=-retval;
+	t0 = stats_begin();
+	if (pipeline) { /* or leave it to the other threads */
+	    bytesforthisround = pipe_submit(prev_processed_bytes,
+			prev_processed_bytes + bytesforthisround)
+		- prev_processed_bytes;
+	    if (pipe_error) looperror=pipe_error;
+	} else {
+	    retval = process_data(rbbuffer,
+				  startindex, startindex + bytesforthisround/4,
+				  stdout);
+	    if (retval<0) looperror=-retval;
+	}
 	
 	prev_processed_bytes += bytesforthisround;
+	stats_round(bytesforthisround, t0);
+	/* make space in the DMA buffer, but not what a pipe may still hold */
+	if (drivercaps & DRIVERCAP_CONSUMER) {
+	    consumed = pipeline ?
+		__atomic_load_n(&pipe_released, __ATOMIC_ACQUIRE) :
+		(long long)prev_processed_bytes - zerocopy_lag;
+	    if (consumed>0)
+		devioctl(handle, Set_consumerpointer,
+		      (int)(consumed & 0x7fffffff));
+	}
+	if (controlfd>=0) control_service();
     } while (running && !looperror);
     
     /* ----- the end ---------- */
+    if (pipeline) {
+	pipe_finish();
+	if (pipe_error && !looperror) looperror=pipe_error;
+    }
+    filter_finish(stdout);
 
-    sendvalue =  configword; /* acquisition off */
-    if (ioctl(handle, WRITE_CPLD, sendvalue)) return -emsg(21);
-    /* stop streaming */
-    if(ioctl(handle, STOP_STREAM) ) return -emsg(25);
-    sendvalue = FIFOreset | configword;
-    if (ioctl(handle, WRITE_CPLD, sendvalue) ) return -emsg(21);
-    /* stop hostside USB engine */
-    if (ioctl(handle, Stop_USB_machine)) return -emsg(26);
+    /* histogram mode: the only output happens here */
+    if (controlfd>=0) {
+	control_close(controlpath);
+    } else if (gaplesslength) {
+	gapless_finish(stdout);
+    } else if (outmode == 3) {
+	histogram_emit(stdout);
+    }
+
+    if (shmring) shm_export_close(shmname);
+    if (indexfile) fclose(indexfile);
+
+    /* report on lost data */
+    for (k=0; k<ncards; k++) {
+	if (card[k].drivercaps & DRIVERCAP_CONSUMER) {
+	    devioctl(card[k].handle, Get_lostbytes, &tmp);
+	    driver_lost_bytes += tmp;
+	}
+	lost_bytes += card[k].lost_bytes; overruns += card[k].overruns;
+    }
+    if (overruns || driver_lost_bytes || (verbosity>0))
+	fprintf(stderr, "#status lost_bytes=%lld driver_lost_bytes=%llu overruns=%d\n",
+		lost_bytes, driver_lost_bytes, overruns);
+
+    for (k=0; k<ncards; k++) {
+	handle = card[k].handle;
+	sendvalue =  configword; /* acquisition off */
+	if (devioctl(handle, WRITE_CPLD, sendvalue)) return -emsg(21);
+	/* stop streaming */
+	if(devioctl(handle, STOP_STREAM) ) return -emsg(25);
+	sendvalue = FIFOreset | configword;
+	if (devioctl(handle, WRITE_CPLD, sendvalue) ) return -emsg(21);
+	/* stop hostside USB engine */
+	if (devioctl(handle, Stop_USB_machine)) return -emsg(26);
+    }
     
     /* switch off timer */
     setitimer(ITIMER_REAL, &stoptime, NULL); 
-
     /* power off mode */
     if (poweroffmode) {
-	if (ioctl(handle, CONFIG_TMSTDEVICE, 0)) return -emsg(5);
+	for (k=0; k<ncards; k++)
+	    if (devioctl(card[k].handle, CONFIG_TMSTDEVICE, 0)) return -emsg(5);
     }
     /* error messages */
     if (looperror) return -emsg(looperror);
     
     return 0;
 }
+#endif
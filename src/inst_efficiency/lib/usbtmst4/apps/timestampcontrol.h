@@ -70,6 +70,22 @@
 				      in mmaped buffer. The returned quantity
 				      can roll over at 2**31 bytes */
 #define _Get_errstat          73   /* get error status during read */
+#define _Set_lowwater         74   /* set number of received bytes after
+				      which a poll() on the device returns
+				      readable. Bytes are counted from the
+				      last Get_transferredbytes call. */
+#define _Get_drivercaps       75   /* return a bit field of optional
+				      driver features, see DRIVERCAP_xx */
+#define _Set_urbnumber        76   /* set number of urbs in flight. Only
+				      possible while USB engine is stopped */
+#define _Get_ringsize         77   /* return the default size of the mmaped
+				      DMA buffer in bytes */
+#define _Set_consumerpointer  78   /* tell driver how many bytes the reader
+				      has processed, in the same mod 2**31
+				      units as Get_transferredbytes */
+#define _Set_overrunpolicy    79   /* what to do if the DMA buffer would
+				      overwrite unprocessed data, see
+				      OVERRUN_xx below */
 
 /* commands added later for EEPROM-based confguration of lookup table */
 #define _WRITE_RAM            80   /* writes a 16 bit word at a given address.
@@ -97,6 +113,29 @@
 				      some point can come with an argument for
 				      the index, which by default is 0. */
 
+/* more commands that only make sense in the USB driver side */
+#define _Get_lostbytes        90   /* copy number of bytes overwritten before
+				      the reader processed them into a
+				      64 bit variable */
+#define _Write_rambulk        91   /* write a block of consecutive 16 bit RAM
+				      words, passed in a struct ramblock, with
+				      back-to-back WRITE_RAM commands; still
+				      one USB round trip per word */
+#define _Set_luttag           92   /* store a 64 bit tag for the current RAM
+				      content. It is cleared by everything
+				      that changes or may lose the RAM */
+#define _Get_luttag           93   /* copy the 64 bit RAM tag, or 0 if the
+				      RAM content is not known */
+#define _Get_status           94   /* copy a consistent snapshot of the
+				      transfer engine into a struct
+				      ringstatus. Resets the poll() reference
+				      like Get_transferredbytes */
+#define _Set_latency          95   /* set the delivery latency target in
+				      usec (up to 1 sec), 0 for the legacy
+				      servo that keeps the irq rate below
+				      100 Hz. Only while the USB engine is
+				      stopped */
+
 
 
 /* Check if we have already a firmware selection */
@@ -156,5 +195,51 @@
 #define Stop_USB_machine     ( _Stop_USB_machine     | IOCBASE )
 #define Get_transferredbytes ( _Get_transferredbytes | IOCBASEWR )
 #define Get_errstat          ( _Get_errstat          | IOCBASEWR )
+#define Set_lowwater         ( _Set_lowwater         | IOCBASEW )
+#define Get_drivercaps       ( _Get_drivercaps       | IOCBASEWR )
+#define Set_urbnumber        ( _Set_urbnumber        | IOCBASEW )
+#define Get_ringsize         ( _Get_ringsize         | IOCBASEWR )
+#define Set_consumerpointer  ( _Set_consumerpointer  | IOCBASEW )
+#define Set_overrunpolicy    ( _Set_overrunpolicy    | IOCBASEW )
+#define Get_lostbytes        ( _Get_lostbytes        | IOCBASEWR )
+#define Write_rambulk        ( _Write_rambulk        | IOCBASEW )
+#define Set_luttag           ( _Set_luttag           | IOCBASEW )
+#define Get_luttag           ( _Get_luttag           | IOCBASEWR )
+#define Get_status           ( _Get_status           | IOCBASEWR )
+#define Set_latency          ( _Set_latency          | IOCBASEW )
+
+/* feature bits returned by Get_drivercaps */
+#define DRIVERCAP_POLL       0x0001 /* poll() with low-water mark */
+#define DRIVERCAP_URBNUMBER  0x0002 /* Set_urbnumber and Get_ringsize */
+#define DRIVERCAP_CONSUMER   0x0004 /* consumer pointer and overrun policy */
+#define DRIVERCAP_RAMBULK    0x0008 /* Write_rambulk and the RAM tag */
+#define DRIVERCAP_PREMAP     0x0010 /* mmap has mapped the whole ring */
+#define DRIVERCAP_STATUS     0x0020 /* Get_status */
+#define DRIVERCAP_LATENCY    0x0040 /* Set_latency */
+
+/* overrun policies for Set_overrunpolicy */
+#define OVERRUN_IGNORE       0 /* legacy: DMA buffer is overwritten silently */
+#define OVERRUN_BACKPRESSURE 1 /* hold back urbs until reader caught up */
+#define OVERRUN_COUNT        2 /* overwrite, but count lost bytes */
+
+/* argument of Write_rambulk: count words go to the RAM byte addresses
+   address, address+2, ... The lookup table is 2048 words at address 0,
+   followed by 128 bytes of preprocess info */
+#define RAMBLOCK_MAXWORDS    (2048+64)
+struct ramblock {
+    int address;
+    int count;
+    unsigned short words[RAMBLOCK_MAXWORDS];
+};
+
+/* argument of Get_status */
+struct ringstatus {
+    unsigned long long received; /* bytes arrived in the ring since open */
+    unsigned long long lost;     /* bytes overwritten before processed */
+    int errstat;                 /* as Get_errstat */
+    int transferlength;          /* current urb transfer length in bytes */
+    int urbs;                    /* urbs in flight */
+    int parked;                  /* urbs held back for the reader */
+};
 
 #endif
@@ -0,0 +1,162 @@
+/* tmstcompact.h: compact block format for postprocessed events, as written
+   by readevents7 -a5, with the encoder and decoder for one block.
+
+   The events of outmode 1 are stored in independent blocks of up to 65536
+   events. Each block starts with a 24 byte header; all numbers are in host
+   byte order like the binary output of outmode 1 (little endian on all
+   machines this runs on):
+
+   ofs  size  what
+   0    4     magic, TMSTCOMPACT_MAGIC
+   4    4     number of events n in this block (1..65536)
+   8    8     first event of the block, complete as in outmode 1
+   16   4     length of the delta section in bytes
+   20   1     shift: all time differences in this block are multiples
+              of 2^shift (e.g. 5 with readevents7 -s)
+   21   1     flags: TMSTCOMPACT_FULLPATTERN if the patterns are stored
+              with 10 bits instead of 4
+   22   2     reserved, 0
+   24   ...   delta section: n-1 differences of the timing info (event>>10)
+              to the previous event, divided by 2^shift, in zigzag
+	      encoding (so that negative differences from detector skews
+	      stay short) as little endian base-128 varints
+   ...  ...   pattern section: the 4 bit detector patterns of all n events,
+              two per byte, first event in the low nibble. Bits 4..9 of
+	      all events are the same as in the first event. If they are
+	      not, the flag is set and bits 0..9 of every event are stored
+	      in 16 bit words instead.
+
+   Since each header carries the absolute time of the block and its
+   length, a reader can skip through a file from header to header, and
+   decode the blocks independently of each other.  */
+
+#ifndef TMSTCOMPACT_H
+#define TMSTCOMPACT_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define TMSTCOMPACT_MAGIC 0x31424d54 /* "TMB1" in memory */
+#define TMSTCOMPACT_HEADERSIZE 24
+#define TMSTCOMPACT_MAXEVENTS 65536
+#define TMSTCOMPACT_MAXSHIFT 32
+#define TMSTCOMPACT_FULLPATTERN 1
+/* worst case size of a block: 10 byte varints and 16 bit patterns */
+#define TMSTCOMPACT_MAXBLOCK (TMSTCOMPACT_HEADERSIZE + \
+			      12*TMSTCOMPACT_MAXEVENTS)
+
+struct tmstcompact_header {
+    uint32_t magic;
+    uint32_t events;
+    uint64_t first;
+    uint32_t deltabytes;
+    uint8_t shift;
+    uint8_t flags;
+    uint16_t reserved;
+};
+
+/* size of a whole block from its header */
+static inline long tmstcompact_blocksize(struct tmstcompact_header *h) {
+    return TMSTCOMPACT_HEADERSIZE + h->deltabytes +
+	((h->flags & TMSTCOMPACT_FULLPATTERN) ? 2*h->events :
+	 (h->events+1)/2);
+}
+
+/* encode n events (1..TMSTCOMPACT_MAXEVENTS) into one block at buf, which
+   needs space for TMSTCOMPACT_MAXBLOCK bytes. Returns the block size. */
+static inline long tmstcompact_encode(uint64_t *events, int n, uint8_t *buf) {
+    struct tmstcompact_header h;
+    uint64_t t0 = events[0]>>10, prev, t, z, differences=0;
+    uint64_t low = events[0] & 0x3f0;
+    int64_t d;
+    uint8_t *p;
+    int i, shift=0, full=0;
+
+    for (i=1; i<n; i++) {
+	differences |= (events[i]>>10) - t0;
+	if ((events[i] & 0x3f0) != low) full=1;
+    }
+    if (differences) shift = __builtin_ctzll(differences);
+    if (shift > TMSTCOMPACT_MAXSHIFT) shift = TMSTCOMPACT_MAXSHIFT;
+
+    p = buf + TMSTCOMPACT_HEADERSIZE;
+    for (i=1, prev=t0; i<n; i++) {
+	t = events[i]>>10;
+	d = (int64_t)(t-prev) >> shift; /* exact, a multiple of 2^shift */
+	z = ((uint64_t)d<<1) ^ (uint64_t)(d>>63);
+	while (z >= 0x80) {
+	    *p++ = z | 0x80; z >>= 7;
+	}
+	*p++ = z;
+	prev = t;
+    }
+    h.deltabytes = p - (buf + TMSTCOMPACT_HEADERSIZE);
+
+    if (full) {
+	for (i=0; i<n; i++) {
+	    p[0] = events[i] & 0xff; p[1] = (events[i]>>8) & 0x3;
+	    p += 2;
+	}
+    } else {
+	for (i=0; i+1<n; i+=2)
+	    *p++ = (events[i] & 0xf) | ((events[i+1] & 0xf)<<4);
+	if (i<n) *p++ = events[i] & 0xf;
+    }
+
+    h.magic = TMSTCOMPACT_MAGIC; h.events = n; h.first = events[0];
+    h.shift = shift; h.flags = full ? TMSTCOMPACT_FULLPATTERN : 0;
+    h.reserved = 0;
+    memcpy(buf, &h, sizeof(h));
+    return p-buf;
+}
+
+/* decode the block at buf, of which len bytes are available, into events
+   (space for TMSTCOMPACT_MAXEVENTS). Returns the block size and sets *n to
+   the number of events, returns 0 if the block is not complete within len,
+   or -1 if it is corrupted. */
+static inline long tmstcompact_decode(uint8_t *buf, long len,
+				      uint64_t *events, int *n) {
+    struct tmstcompact_header h;
+    uint64_t t, z, low;
+    uint8_t *p, *end;
+    long size;
+    int i, s;
+
+    if (len < TMSTCOMPACT_HEADERSIZE) return 0;
+    memcpy(&h, buf, sizeof(h));
+    if ((h.magic != TMSTCOMPACT_MAGIC) || (h.events < 1) ||
+	(h.events > TMSTCOMPACT_MAXEVENTS) ||
+	(h.shift > TMSTCOMPACT_MAXSHIFT)) return -1;
+    size = tmstcompact_blocksize(&h);
+    if (size > len) return 0;
+
+    /* timing info, into events for now */
+    p = buf + TMSTCOMPACT_HEADERSIZE; end = p + h.deltabytes;
+    events[0] = t = h.first>>10;
+    for (i=1; i<(int)h.events; i++) {
+	z=0; s=0;
+	while (p<end && (*p & 0x80)) {
+	    z |= (uint64_t)(*p++ & 0x7f) << s; s+=7;
+	}
+	if ((p>=end) || (s>63)) return -1;
+	z |= (uint64_t)(*p++) << s;
+	t += ((z>>1) ^ -(z&1)) << h.shift;
+	events[i] = t;
+    }
+    if (p != end) return -1;
+
+    /* add the patterns */
+    if (h.flags & TMSTCOMPACT_FULLPATTERN) {
+	for (i=0; i<(int)h.events; i++, p+=2)
+	    events[i] = (events[i]<<10) | p[0] | ((p[1] & 0x3)<<8);
+    } else {
+	low = h.first & 0x3f0;
+	for (i=0; i<(int)h.events; i++)
+	    events[i] = (events[i]<<10) | low |
+		((p[i>>1] >> ((i&1)<<2)) & 0xf);
+    }
+    *n = h.events;
+    return size;
+}
+
+#endif
@@ -0,0 +1,54 @@
+/* tmstindex.h: layout of the time index that readevents7 -x writes next to
+   the event stream of outmode 1 or 5, so that a reader can go straight to
+   a given time in a long capture instead of scanning it from the start.
+
+   The index file starts with a 32 byte header, followed by entries of two
+   64 bit words; all numbers are in host byte order like the binary output
+   of outmode 1:
+
+   ofs  size  what
+   0    8     magic, TMSTINDEX_MAGIC
+   8    4     version of this layout, TMSTINDEX_VERSION
+   12   4     outmode of the indexed stream, 1 or 5
+   16   8     interval of the entries in 1/256 nsec
+   24   8     reserved, 0
+
+   Each entry holds the timing info (event>>10, in 1/256 nsec) of an event
+   and the byte offset in the stream where it starts; in outmode 5, this is
+   the first event of a block, and the offset is that of the block header.
+   An entry is made for the first event, and then for the first event (or
+   block) at or after every multiple of the interval, so the times and
+   offsets of the entries both increase strictly. With detector skews,
+   events can come out of order by the skew spread, which is assumed to be
+   less than the interval. A reader that wants the events in [t1,t2) finds
+   k1 and k2, the last entries at or before t1 and t2 (-1 if there is
+   none), reads from the offset of entry k1-1 (or the start of the stream)
+   to the offset of entry k2+2 (or the end of the stream), and filters the
+   events by time. inst_efficiency.read_events_window does exactly this.
+
+   The entries are written as the stream is, so the index of a capture in
+   progress may point a bit beyond the end of the stream file. */
+
+#ifndef TMSTINDEX_H
+#define TMSTINDEX_H
+
+#include <stdint.h>
+
+#define TMSTINDEX_MAGIC 0x3158444954534d54ULL /* "TMSTIDX1" in memory */
+#define TMSTINDEX_VERSION 1
+#define TMSTINDEX_DEFAULT_INTERVAL 100 /* msec */
+
+struct tmstindex_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t outmode;
+    uint64_t interval;
+    uint64_t reserved;
+};
+
+struct tmstindex_entry {
+    uint64_t time;
+    uint64_t offset;
+};
+
+#endif
@@ -0,0 +1,146 @@
+/* tmstreader.c: Event decoding of readevents7 as a shared library
+   (libtmstreader.so), so that analysis programs can turn timestamp data
+   into arrays without a temporary text or binary file and without parsing
+   it in the interpreter. Built for use with ctypes from inst_efficiency.py,
+   but usable from any language that can call C.
+
+   All functions write into caller-provided arrays: the timing info in units
+   of 1/256 nsec into an int64 array, and the detector pattern (bit 0..3 for
+   detector 1..4) into a uint8 array.
+
+   long tmst_decode_events(uint64_t *events, long n, int legacyswap,
+                           int64_t *times, uint8_t *patterns)
+          Splits n postprocessed events as written by readevents7 -a1. With
+	  legacyswap set, the events are expected with their 32 bit halves
+	  swapped, as written with -a1 -X. times may be the events array
+	  itself, for a conversion in place. Returns n.
+
+   void tmst_init_decoder(struct tmst_decoder *d, int fast, int shortmode,
+                          int skew[4])
+          Prepares a decoder for raw card data as written by readevents7
+	  -a -1, or as found in the DMA buffer. fast selects the 32 bit
+	  format (-f), shortmode the reduced timing resolution (-s), and skew
+	  is the detector skew in units of 1/256 nsec as with -D, or NULL.
+
+   long tmst_decode_raw(struct tmst_decoder *d, uint32_t *raw, long nwords,
+                        int64_t *times, uint8_t *patterns)
+          Decodes nwords 32 bit words of raw card data with the same code
+	  as readevents7 -a1 uses. Void entries are dropped, so up to nwords
+	  (fast format) or nwords/2 events are written. The decoder keeps the
+	  rollover state of the 32 bit format, so consecutive blocks of a
+	  stream can be decoded one after each other. Returns the number of
+	  events, or a negative value on error.
+
+   long tmst_compact_events(uint8_t *data, long len)
+          Counts the events in the complete blocks of data in the compact
+	  format of readevents7 -a5 (see tmstcompact.h) with len bytes.
+	  Returns the number of events, or -1 if there is a corrupted block.
+
+   long tmst_decode_compact(uint8_t *data, long len, uint64_t *events)
+          Decodes the complete blocks in data back into the events of
+	  outmode 1, which can then be split with tmst_decode_events.
+	  Returns the number of events, or -1 if there is a corrupted
+	  block.
+
+   The decoding of raw data works on the global state of readevents7, which is loaded
+   from and saved into the decoder on every call, so the functions must not
+   be called from several threads at the same time. The functions for the
+   compact format have no state and can run in parallel, e.g. on separate
+   ranges of blocks.
+
+*/
+
+#define READEVENTS7_NO_MAIN
+#include "readevents7.c"
+
+#define DECODE_CHUNK (1<<24) /* words per process_data call */
+
+struct tmst_decoder {
+    uint32_t rolloveroffset, oldevent; /* state of the 32 bit format */
+    int fast, shortmode;
+    uint64_t offsettime[16];
+};
+
+static int tmst_initialized=0;
+
+static void tmst_init_library(void) {
+    if (tmst_initialized) return;
+    init_fastexpand();
+    tmst_initialized=1;
+}
+
+long tmst_compact_events(uint8_t *data, long len) {
+    struct tmstcompact_header h;
+    long pos, n=0;
+    for (pos=0; pos+TMSTCOMPACT_HEADERSIZE <= len;
+	 pos+=tmstcompact_blocksize(&h)) {
+	memcpy(&h, &data[pos], sizeof(h));
+	if (h.magic != TMSTCOMPACT_MAGIC) return -1;
+	if (pos+tmstcompact_blocksize(&h) > len) break;
+	n += h.events;
+    }
+    return n;
+}
+
+long tmst_decode_compact(uint8_t *data, long len, uint64_t *events) {
+    long pos, size, n=0;
+    int k;
+    for (pos=0; ; pos+=size, n+=k) {
+	size = tmstcompact_decode(&data[pos], len-pos, &events[n], &k);
+	if (size<0) return -1;
+	if (!size) break;
+    }
+    return n;
+}
+
+long tmst_decode_events(uint64_t *events, long n, int legacyswap,
+			int64_t *times, uint8_t *patterns) {
+    long i;
+    uint64_t e;
+    for (i=0; i<n; i++) {
+	e = events[i];
+	if (legacyswap) e = (e<<32) | (e>>32);
+	patterns[i] = e & 0xf;
+	times[i] = e >> 10;
+    }
+    return n;
+}
+
+void tmst_init_decoder(struct tmst_decoder *d, int fast, int shortmode,
+		       int skew[4]) {
+    int i;
+    memset(d, 0, sizeof(*d));
+    d->fast = (fast!=0); d->shortmode = shortmode;
+    for (i=0; i<16; i++)
+	d->offsettime[i] = (skew && (patt2det[i]>=0)) ?
+	    ((long long int)skew[(int)patt2det[i]] << 10) : 0;
+}
+
+long tmst_decode_raw(struct tmst_decoder *d, uint32_t *raw, long nwords,
+		     int64_t *times, uint8_t *patterns) {
+    long i, j, n;
+    int retval;
+
+    tmst_init_library();
+    if (!d->fast) nwords &= ~1L; /* only complete 64 bit events */
+    outmode = 1; fastmode = d->fast; shortmode = d->shortmode;
+    numberofsamples = 0; skipnumber = 0;
+    rolloveroffset = d->rolloveroffset; oldevent = d->oldevent;
+    memcpy(offsettime, d->offsettime, sizeof(offsettime));
+
+    /* decode straight into the times array, without an output stage */
+    for (i=0, n=0; i<nwords; i+=DECODE_CHUNK) {
+	outbuf = (uint64_t *)&times[n];
+	retval = process_data(&raw[i], 0, (nwords-i > DECODE_CHUNK) ?
+			      DECODE_CHUNK : nwords-i, NULL);
+	if (retval<0) return retval;
+	n += fastmode ? retval : retval/2;
+    }
+    d->rolloveroffset = rolloveroffset; d->oldevent = oldevent;
+
+    for (j=0; j<n; j++) {
+	patterns[j] = times[j] & 0xf;
+	times[j] = (uint64_t)times[j] >> 10;
+    }
+    return n;
+}
@@ -0,0 +1,110 @@
+/* tmstshm.h: layout of the shared memory ring in which readevents7 -M
+   publishes its postprocessed events, so several programs can read the
+   events of one timestamp card at the same time.
+
+   The ring is a POSIX shared memory object (/dev/shm/<name>) with a header
+   page, followed by a ring of capacity 64 bit events in the format of
+   outmode 1. capacity is a power of 2. All header entries are 64 bit words:
+
+   word  what
+   0     magic, TMSTSHM_MAGIC. Written last by the producer on setup.
+   1     version of this layout, TMSTSHM_VERSION
+   2     offset of the event ring in bytes from the start of the object
+   3     capacity of the ring in events
+   4     commit: number of events published so far. Event number n lives in
+         ring slot n % capacity.
+   5     reserve: number of events the producer has started to write. This
+         is ahead of commit while a block is copied into the ring.
+   6     pid of the producer, or 0 after it has terminated
+   7     number of reader slots
+   8..   reader slots, two words each: pid of a reader (0 if the slot is
+         free) and its cursor, i.e. the next event number it wants to read.
+
+   There is one producer and any number of readers; nobody ever waits for
+   anybody. The producer first advances reserve, then copies the events
+   into the ring, then advances commit. A reader keeps its own cursor. It
+   loads commit, copies the events from its cursor up to commit, and then
+   loads reserve again: if reserve-capacity is beyond the cursor it started
+   with, the producer may have overwritten part of what was copied, and the
+   reader has been overrun. It then restarts at reserve-capacity and counts
+   the skipped events as lost. If commit-cursor exceeds capacity even
+   before the copy, the reader knows it was lapped without copying.
+
+   The reader slots are optional. A reader can claim one with a compare
+   and swap of its pid into a free slot and keep its cursor there; the
+   producer only uses them to report how far behind the readers are.
+
+   The helper functions below implement the reader side. */
+
+#ifndef TMSTSHM_H
+#define TMSTSHM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define TMSTSHM_MAGIC 0x31524d5354534d54ULL /* "TMSTSMR1" in memory */
+#define TMSTSHM_VERSION 1
+#define TMSTSHM_HEADERSIZE 4096 /* bytes before the event ring */
+#define TMSTSHM_MAX_READERS 64
+#define TMSTSHM_DEFAULT_CAPACITY (1<<22) /* events, 32 MB */
+
+struct tmstshm_reader {
+    uint64_t pid;
+    uint64_t cursor;
+};
+
+struct tmstshm_header {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t ringoffset;
+    uint64_t capacity;
+    uint64_t commit;
+    uint64_t reserve;
+    uint64_t producer;
+    uint64_t readers;
+    struct tmstshm_reader reader[TMSTSHM_MAX_READERS];
+};
+
+/* pointer to the event ring of a mapped object */
+static inline uint64_t *tmstshm_ring(struct tmstshm_header *h) {
+    return (uint64_t *)((char *)h + h->ringoffset);
+}
+
+/* copy up to maxevents events from the position *cursor into dst and
+   advance *cursor. Returns the number of copied events; *lost is set to
+   the number of events that were overwritten before they could be read. */
+static inline int tmstshm_read(struct tmstshm_header *h, uint64_t *cursor,
+			       uint64_t *dst, int maxevents, uint64_t *lost) {
+    uint64_t *ring = tmstshm_ring(h);
+    uint64_t mask = h->capacity-1;
+    uint64_t commit, reserve, c, n, first;
+    *lost=0;
+    for (;;) {
+	commit = __atomic_load_n(&h->commit, __ATOMIC_ACQUIRE);
+	c = *cursor;
+	if (commit-c > h->capacity) { /* lapped already */
+	    reserve = __atomic_load_n(&h->reserve, __ATOMIC_ACQUIRE);
+	    *lost += reserve-h->capacity-c;
+	    *cursor = reserve-h->capacity;
+	    continue;
+	}
+	n = commit-c;
+	if (n > (uint64_t)maxevents) n = maxevents;
+	first = h->capacity - (c & mask); /* events up to the end of ring */
+	if (first > n) first=n;
+	memcpy(dst, &ring[c & mask], first*sizeof(uint64_t));
+	memcpy(dst+first, ring, (n-first)*sizeof(uint64_t));
+	/* did the producer touch what we just copied? */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	reserve = __atomic_load_n(&h->reserve, __ATOMIC_RELAXED);
+	if ((reserve > h->capacity) && (reserve-h->capacity > c)) {
+	    *lost += reserve-h->capacity-c;
+	    *cursor = reserve-h->capacity;
+	    continue;
+	}
+	*cursor = c+n;
+	return n;
+    }
+}
+
+#endif
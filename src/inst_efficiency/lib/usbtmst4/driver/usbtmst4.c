@@ -31,6 +31,14 @@
 #include <linux/jiffies.h>  /* for irq rate servo */
 #include <linux/version.h>
 #include <linux/uaccess.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/debugfs.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/hrtimer.h>
 
 #include "timestampcontrol.h"    /* contains ioctls */
 #include "usbprog_io.h"    /* contains ioctls for programming */
@@ -67,11 +75,34 @@
 #define HAS_VM_FLAG_API
 #endif
 
+/* pages can be inserted into a user vma at mmap time */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,15))
+#define HAS_VM_INSERT_PAGE
+#endif
+/* ...and a whole array of them in one go */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0))
+#define HAS_VM_INSERT_PAGES
+#endif
+
+/* hrtimer_init replaced by hrtimer_setup */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6,13,0))
+#define HAS_HRTIMER_SETUP
+#endif
+
+/* poll method returns __poll_t */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,16,0))
+#define HAS_POLL_T
+#endif
+
 /* make vm_fault_t to int as in older kernels */
 #ifndef HAS_VM_FAULT_TYPE
 #define vm_fault_t int
 #endif
 
+#ifndef HAS_POLL_T
+#define __poll_t unsigned int
+#endif
+
 
 
 /* to include legacy stuff, will be thrown out as soon as confirmed to work */
@@ -103,9 +134,33 @@ MODULE_LICENSE("GPL");
 #define USB_DEVICE_ID_S_FIFTEEN 0x200a
 
 
-#define URBS_NUMBER 4 /* consecutive urbs to be allocated */
-
-
+#define DEFAULT_URBS_NUMBER 4 /* consecutive urbs to be allocated */
+#define MAX_URBS_NUMBER 64
+#define DEFAULT_RINGSIZE (1<<22) /* suggested DMA buffer size in bytes */
+
+static int urbs_number = DEFAULT_URBS_NUMBER;
+module_param(urbs_number, int, 0644);
+MODULE_PARM_DESC(urbs_number, "Number of urbs in flight after open (1..64)");
+static int latency_us = 0;
+module_param(latency_us, int, 0644);
+MODULE_PARM_DESC(latency_us, "Delivery latency target in usec after open, 0: jiffies servo");
+static int ringsize = DEFAULT_RINGSIZE;
+module_param(ringsize, int, 0644);
+MODULE_PARM_DESC(ringsize, "DMA buffer size suggested to applications, bytes");
+
+
+/* always-on counters of the transfer engine, in debugfs under
+   tmst4/usbtmstN/. All can be reset by writing 0 into them */
+struct enginestats {
+    u64 completions;     /* urbs completed without error */
+    u64 shorttransfers;  /* ...of which with less data than requested */
+    u64 urberrors;       /* urbs completed with an error status */
+    u64 submitfailures;  /* urbs usb_submit_urb refused */
+    u64 tfl_up, tfl_down; /* steps of the transfer length servo */
+    u64 gaps;            /* time between consecutive completions: */
+    u64 gap_sum_us, gap_sumsq_us2, gap_max_us; /* sum, sum of squares, max */
+    u64 flushes;         /* partial transfers unlinked by the flush timer */
+};
 
 /* local status variables for cards */
 typedef struct cardinfo {
@@ -121,6 +176,9 @@ typedef struct cardinfo {
     struct cardinfo *next, *previous; /* for device management */
 
     struct dma_page_pointer * dma_main_pointer; /* scatter list base */
+    struct page **pagelist; /* all pages of the DMA buffer in mmap order */
+    unsigned long pages;    /* number of entries in pagelist */
+    int premapped;          /* set if premap_ring inserted every page */
     struct urb **urblist; /* pointer to urblist */
     int totalurbs; /* number of urbs allocated */
     int transfers_running; /* if !=0, new urbs can be submitted as soon as
@@ -128,9 +186,34 @@ typedef struct cardinfo {
     struct dma_page_pointer *current_free_mempiece; /* next page to be used */
     unsigned long current_free_offset; /* address within that block */
     int received_bytes;    /* number of received bytes so far */
+    unsigned long long received_total; /* the same without rollover */
+    int urbsinflight;      /* submitted urbs not completed yet */
+    struct urb *inflight[MAX_URBS_NUMBER]; /* ...in the order of submission */
+    int inflighthead;      /* index of the oldest one */
+    struct enginestats stats; /* protected by ringlock like the above */
+    s64 lastcompletion;    /* time of last completion in nsec, 0: none */
+    struct dentry *debugdir; /* for the counters */
     int errstat;           /* error status set during a callback */
+
+    /* for poll() on new data */
+    wait_queue_head_t readqueue; /* woken up by the completion handler */
+    int pollreference;     /* received_bytes at last Get_transferredbytes
+			      or Get_status */
+    int lowwater;          /* bytes beyond pollreference to be readable */
+
+    /* overrun protection; the ring lock protects the free buffer location,
+       the received and the byte counters below, and the urbs in flight */
+    spinlock_t ringlock;
+    int submitted_bytes;   /* bytes handed to urbs so far */
+    int consumed_bytes;    /* bytes the reader has processed */
+    int overrunpolicy;     /* see OVERRUN_xx in timestampcontrol.h */
+    unsigned long long lost_bytes; /* overwritten before being processed */
+    struct urb *parkedurb[MAX_URBS_NUMBER]; /* held back for the reader */
+    int parkedurbs;
     char *scratchbuf;       /* points to a DMA-capable scratch buffer for
 			      small urbs */
+    unsigned long long luttag; /* tag of the RAM content from Set_luttag,
+				  0 if unknown */
 
     /* for interrupt frequency servo. This tries to arrange for a usb irq rate
        between 1 and 10 jiffies */
@@ -143,8 +226,20 @@ typedef struct cardinfo {
     int current_transferlength;  /* length sent to the submit_urb command */
     int initial_transferlength; /* when starting USB line */
 
+    /* latency controller, used instead of the jiffies servo if the target
+       is set. The transfer length is chosen such that a transfer fills in
+       about the target time, and a timer unlinks a transfer that takes
+       longer, so its data gets delivered. */
+    s64 latency_ns;        /* target, 0: jiffies servo */
+    s64 avggap_ns;         /* lowpass of the time between completions */
+    s64 lastdelivery;      /* last completion or start, in nsec */
+    struct urb *flushurb;  /* unlinked by the timer, not completed yet */
+    struct hrtimer flushtimer;
+
     int smallpageorder; /* smallest page order we got in malloc */
     int minmempiece;   /* granularity of DMA buffer */
+    int maxtransferlength; /* servo limit, so that urbs never overlap */
+    unsigned long dmasize; /* total size of the DMA buffer in bytes */
 
     /* for proper disconnecting behaviour */
     wait_queue_head_t closingqueue; /* for the unload to wait until closed */
@@ -156,6 +251,7 @@ typedef struct cardinfo {
 #define DEFAULT_JIFFSERVOPERIODE 5 /* update rate */
 
 static struct cardinfo *cif=NULL; /* no device registered */
+static struct dentry *debugroot=NULL; /* tmst4 directory in debugfs */
 
 /* search cardlists for a particular minor number */
 static struct cardinfo *search_cardlist(int index) {
@@ -237,6 +333,32 @@ void release_dma_buffer(struct cardinfo *cp){
 	} while (currbuf != cp->dma_main_pointer);
 	cp->dma_main_pointer=NULL; /* mark buffer empty */
     };
+    if (cp->pagelist) {
+	vfree(cp->pagelist);
+	cp->pagelist=NULL; cp->pages=0;
+    }
+}
+
+/* index all pages of the DMA buffer, so that a page of the mmapped ring is
+   found without walking the mem piece chain. Returns 0 or -ENOMEM */
+static int build_pagelist(struct cardinfo *cp) {
+    struct dma_page_pointer *currbuf = cp->dma_main_pointer;
+    unsigned long n=0, i;
+
+    do {
+	n += currbuf->fullsize >> PAGE_SHIFT;
+	currbuf = currbuf->next;
+    } while (currbuf != cp->dma_main_pointer);
+    cp->pagelist = (struct page **)vmalloc(n*sizeof(struct page *));
+    if (!cp->pagelist) return -ENOMEM;
+    n=0;
+    do {
+	for (i=0; i<(currbuf->fullsize >> PAGE_SHIFT); i++)
+	    cp->pagelist[n++] = virt_to_page(currbuf->buffer + i*PAGE_SIZE);
+	currbuf = currbuf->next;
+    } while (currbuf != cp->dma_main_pointer);
+    cp->pages = n;
+    return 0;
 }
 /* routine to allocate DMA buffer RAM of size (in bytes).
    Returns 0 on success, and <0 on fail */ 
@@ -253,8 +375,11 @@ static int get_dma_buffer(ssize_t size, struct cardinfo *cp) {
     /* reset dma pointer buffer */
     currbuf=NULL; /* dma_main_pointer; */ /* NULL if no buffer exists */
     
-    /* still have to get only small pieces....?? */
+    /* still have to get only small pieces....?? Larger buffers get larger
+       pieces, so their count stays limited and transfers can grow with it */
     page_order = 4;
+    while ((page_order < 10) && ((PAGE_SIZE<<page_order)*64 < bytes_to_get))
+	page_order++;
     
     /* page_order = get_order(bytes_to_get); */
     if (page_order >= MAX_ORDER) page_order=MAX_ORDER;
@@ -328,9 +453,10 @@ static int get_dma_buffer(ssize_t size, struct cardinfo *cp) {
 	    };
 	}
     }
-    if (bytes_to_get <=0) {
+    if ((bytes_to_get <=0) && !build_pagelist(cp)) {
 	cp->smallpageorder = page_order;
 	cp->minmempiece = (PAGE_SIZE << page_order);
+	cp->dmasize = size & ~0x3;
 	return 0; /* everything went fine.... */
     }
     /* cleanup of unused buffers and pointers with standard release code */
@@ -345,10 +471,201 @@ static int get_dma_buffer(ssize_t size, struct cardinfo *cp) {
 */
 
 static int already_transferred_bytes(struct cardinfo *cp) {
+    unsigned long flags;
+    int rb;
+    spin_lock_irqsave(&cp->ringlock, flags);
+    rb=cp->received_bytes;
+    spin_unlock_irqrestore(&cp->ringlock, flags);
     /* still to fix: error treatment */
     if (cp->errstat) return -1;
+    /* the next poll() only returns after lowwater new bytes */
+    cp->pollreference = rb;
     /* everything went fine... */
-    return (cp->received_bytes & 0x7fffffff); /* do some spinlock stuff? */
+    return (rb & 0x7fffffff);
+}
+
+/* consistent snapshot of the transfer engine for Get_status */
+static void get_ringstatus(struct cardinfo *cp, struct ringstatus *st) {
+    unsigned long flags;
+    spin_lock_irqsave(&cp->ringlock, flags);
+    st->received = cp->received_total;
+    st->lost = cp->lost_bytes;
+    st->errstat = cp->errstat;
+    st->transferlength = cp->current_transferlength;
+    st->urbs = cp->urbsinflight;
+    st->parked = cp->parkedurbs;
+    cp->pollreference = cp->received_bytes; /* as Get_transferredbytes */
+    spin_unlock_irqrestore(&cp->ringlock, flags);
+}
+
+/* length of the next transfer; make sure we never exceed a mem page
+   boundary with transfer */
+static int next_transferlength(struct cardinfo *cp) {
+    int tfl=cp->current_transferlength;
+    if (cp->current_free_offset + tfl > cp->current_free_mempiece->size)
+	tfl=(cp->current_free_mempiece->size)-cp->current_free_offset;
+    return tfl;
+}
+
+/* number of unprocessed bytes a transfer of tfl bytes would overwrite.
+   Needs ringlock. */
+static int ring_overlap(struct cardinfo *cp, int tfl) {
+    int ov = (cp->submitted_bytes - cp->consumed_bytes) + tfl - cp->dmasize;
+    return (ov>0)?ov:0;
+}
+
+/* take a finished urb off the list of urbs in flight. Needs ringlock. */
+static void inflight_remove(struct cardinfo *cp, struct urb *urb) {
+    int i, k;
+    for (i=0; i<cp->urbsinflight; i++)
+	if (cp->inflight[(cp->inflighthead+i) % MAX_URBS_NUMBER] == urb) break;
+    if (i == cp->urbsinflight) return; /* not in flight */
+    for (k=i; k>0; k--) /* normally, it is the oldest one */
+	cp->inflight[(cp->inflighthead+k) % MAX_URBS_NUMBER] =
+	    cp->inflight[(cp->inflighthead+k-1) % MAX_URBS_NUMBER];
+    cp->inflighthead = (cp->inflighthead+1) % MAX_URBS_NUMBER;
+    cp->urbsinflight--;
+}
+
+/* submit urb into the next free DMA buffer location. Needs ringlock. */
+static void submit_urb_locked(struct cardinfo *cp, struct urb *urb, int tfl) {
+    urb->transfer_flags = URB_NO_TRANSFER_DMA_MAP;
+    urb->transfer_dma = cp->current_free_mempiece->physicaladdress +
+	cp->current_free_offset;
+    /* for possibly zeroing afterwards */
+    urb->transfer_buffer = 
+	&cp->current_free_mempiece->buffer[cp->current_free_offset];
+    /* hopefully this complies with the system to read larger
+       quantities for IN transfers  */
+    urb->transfer_buffer_length = tfl; 
+    /* may be called in irq context */
+    if (!usb_submit_urb(urb,GFP_ATOMIC)) {
+	cp->inflight[(cp->inflighthead + cp->urbsinflight) % MAX_URBS_NUMBER]
+	    = urb;
+	cp->urbsinflight++;
+    } else {
+	cp->stats.submitfailures++;
+    }
+    cp->submitted_bytes += tfl;
+    
+    /* get prepare next free address */
+    cp->current_free_offset += tfl;
+    if (cp->current_free_offset >= cp->current_free_mempiece->size) {
+	/* we exceeded this page thing */
+	cp->current_free_mempiece = cp->current_free_mempiece->next;
+	cp->current_free_offset = 0;
+    }
+}
+
+/* re-populate a urb that fell free, honoring the overrun policy */
+static void resubmit_urb(struct cardinfo *cp, struct urb *urb) {
+    unsigned long flags;
+    int tfl, ov;
+    spin_lock_irqsave(&cp->ringlock, flags);
+    tfl = next_transferlength(cp);
+    ov = (cp->overrunpolicy == OVERRUN_IGNORE) ? 0 : ring_overlap(cp, tfl);
+    if (ov && (cp->overrunpolicy == OVERRUN_BACKPRESSURE)) {
+	/* reader lags behind; keep urb until it has caught up */
+	cp->parkedurb[cp->parkedurbs++] = urb;
+    } else {
+	if (ov) { /* data gets lost, but we know how much */
+	    cp->lost_bytes += ov;
+	    cp->consumed_bytes += ov;
+	}
+	submit_urb_locked(cp, urb, tfl);
+    }
+    spin_unlock_irqrestore(&cp->ringlock, flags);
+}
+
+/* resubmit parked urbs as far as the reader has made space */
+static void release_parked_urbs(struct cardinfo *cp) {
+    unsigned long flags;
+    int tfl, i;
+    spin_lock_irqsave(&cp->ringlock, flags);
+    while (cp->parkedurbs && cp->transfers_running) {
+	tfl = next_transferlength(cp);
+	if (ring_overlap(cp, tfl)) break;
+	submit_urb_locked(cp, cp->parkedurb[0], tfl);
+	cp->parkedurbs--;
+	for (i=0; i<cp->parkedurbs; i++) cp->parkedurb[i]=cp->parkedurb[i+1];
+    }
+    spin_unlock_irqrestore(&cp->ringlock, flags);
+}
+
+/* buffer length servo to keep interrupt rate below 100 Hz */
+static void jiffies_servo(struct cardinfo *cp) {
+    unsigned int jf,jd; /* stores jiffies and difference */
+    jf=jiffies; jd=(jf-cp->oldjiffies)*256; cp->oldjiffies = jf;
+    cp->avgdiff += (((int)jd)-cp->avgdiff)/8; /* lowpass over 8 irq calls */
+    /* This is some upper limit to avoid a latch-up of the servo */
+    if (cp->avgdiff > 0x10000) cp->avgdiff=0x10000;
+    if ((cp->jiffservocounter--)<=0) { /* now we can consider changing */
+	cp->jiffservocounter=DEFAULT_JIFFSERVOPERIODE; /* reload counter */
+	if (cp->avgdiff <256) {/* less than 1 jiffie difference */
+	    /* increase periode if possible */
+	    if (cp->current_transferlength < cp->maxtransferlength) {
+		cp->current_transferlength <<=1;
+		cp->stats.tfl_up++;
+		/* printk("%s: transfer len increased to %d; avgdiff: %d, jd: %d\n",
+		       USBDEV_NAME, 
+		       cp->current_transferlength,cp->avgdiff,jd); */
+	    }
+	}
+	if (cp->avgdiff >2500) {/* more  than 10 jiffies difference */
+	    /* decrease periode if possible */ 
+	    if (cp->current_transferlength > cp->maxpacket) {
+		cp->current_transferlength >>=1;
+		cp->stats.tfl_down++;
+		/*  printk("%s: transfer len decreased to %d; avgdiff: %d, jd:%d\n",
+		       USBDEV_NAME,
+		       cp->current_transferlength,cp->avgdiff,jd);*/
+	    }
+	}
+    }
+}
+
+/* transfer length servo for a latency target: a transfer should fill in
+   less than the target, but not in less than a quarter of it, so that the
+   irq rate stays as low as the target allows. Uses the same update periode
+   as the jiffies servo. */
+static void latency_servo(struct cardinfo *cp) {
+    if ((cp->jiffservocounter--)>0) return;
+    cp->jiffservocounter=DEFAULT_JIFFSERVOPERIODE; /* reload counter */
+    if ((cp->avggap_ns > cp->latency_ns) &&
+	(cp->current_transferlength > cp->maxpacket)) {
+	cp->current_transferlength >>=1;
+	cp->stats.tfl_down++;
+    } else if ((cp->avggap_ns*4 < cp->latency_ns) &&
+	       (cp->current_transferlength < cp->maxtransferlength)) {
+	cp->current_transferlength <<=1;
+	cp->stats.tfl_up++;
+    }
+}
+
+/* flush timer, runs every half latency target while transfers run. If
+   nothing was delivered for longer than the target, the oldest transfer is
+   unlinked; it completes with the packets it got so far, and the rest is
+   zeroed like for a short transfer. A transfer of a single packet can only
+   be waited for, since the device sends full packets. */
+static enum hrtimer_restart flushtimer_handler(struct hrtimer *timer) {
+    struct cardinfo *cp = container_of(timer, struct cardinfo, flushtimer);
+    struct urb *urb = NULL;
+    unsigned long flags;
+    if (!cp->transfers_running) return HRTIMER_NORESTART;
+    spin_lock_irqsave(&cp->ringlock, flags);
+    if (!cp->flushurb && cp->urbsinflight &&
+	(ktime_to_ns(ktime_get()) - cp->lastdelivery > cp->latency_ns)) {
+	urb = cp->inflight[cp->inflighthead];
+	if (urb->transfer_buffer_length > cp->maxpacket) {
+	    cp->flushurb = urb;
+	} else {
+	    urb = NULL;
+	}
+    }
+    spin_unlock_irqrestore(&cp->ringlock, flags);
+    if (urb) usb_unlink_urb(urb); /* completes asynchronously */
+    hrtimer_forward_now(timer, ns_to_ktime(cp->latency_ns/2));
+    return HRTIMER_RESTART;
 }
 
 /* completion handler for urbs; this callback should re-populate urbs as
@@ -359,13 +676,27 @@ static int already_transferred_bytes(struct cardinfo *cp) {
    static void completion_handler(struct urb *urb, struct pt_regs *regs) { */
 static void completion_handler(struct urb *urb) {
     struct cardinfo *cp=(struct cardinfo *)urb->context;
-    unsigned int jf,jd; /* stores jiffies and difference */
-    int tfl; /* transfer length for the next round */
+    unsigned long flags;
+    int status = urb->status;
+    s64 now;
+    u64 gap;
     /* test about the status */
-    if (urb->status) { /* something happened */
+    now = ktime_to_ns(ktime_get());
+    spin_lock_irqsave(&cp->ringlock, flags);
+    inflight_remove(cp, urb);
+    if (urb == cp->flushurb) { /* a partial transfer is as good as a short */
+	cp->flushurb = NULL;
+	if (status == -ECONNRESET) {
+	    status = 0; cp->stats.flushes++;
+	}
+    }
+    if (status) cp->stats.urberrors++;
+    spin_unlock_irqrestore(&cp->ringlock, flags);
+    if (status) { /* something happened */
 	cp->transfers_running=0;
-	printk("urb accident; status: %d\n",urb->status);
-	cp->errstat=urb->status;
+	printk("urb accident; status: %d\n",status);
+	cp->errstat=status;
+	wake_up_interruptible(&cp->readqueue); /* let reader see the error */
     } else { /* urb is finished */
 	/* fix current_received count and clean up mem if necessary */
 	if (urb->actual_length < urb->transfer_buffer_length) {
@@ -377,70 +708,42 @@ static void completion_handler(struct urb *urb) {
 		  0, urb->transfer_buffer_length-urb->actual_length);
 	}
 	/* notify reader */
+	spin_lock_irqsave(&cp->ringlock, flags);
 	cp->received_bytes += urb->transfer_buffer_length;
-
-	/* buffer length servo to keep interrupt rate below 100 Hz */
-	jf=jiffies; jd=(jf-cp->oldjiffies)*256; cp->oldjiffies = jf;
-	cp->avgdiff += (((int)jd)-cp->avgdiff)/8; /* lowpass over 8 irq calls */
-	/* This is some upper limit to avoid a latch-up of the servo */
-	if (cp->avgdiff > 0x10000) cp->avgdiff=0x10000;
-	if ((cp->jiffservocounter--)<=0) { /* now we can consider changing */
-	    cp->jiffservocounter=DEFAULT_JIFFSERVOPERIODE; /* reload counter */
-	    if (cp->avgdiff <256) {/* less than 1 jiffie difference */
-		/* increase periode if possible */
-		if (cp->current_transferlength < cp->minmempiece) {
-		    cp->current_transferlength <<=1;
-		    /* printk("%s: transfer len increased to %d; avgdiff: %d, jd: %d\n",
-		    	   USBDEV_NAME, 
-			   cp->current_transferlength,cp->avgdiff,jd); */
-		}
-	    }
-	    if (cp->avgdiff >2500) {/* more  than 10 jiffies difference */
-		/* decrease periode if possible */ 
-		if (cp->current_transferlength > cp->maxpacket) {
-		    cp->current_transferlength >>=1;
-		    /*  printk("%s: transfer len decreased to %d; avgdiff: %d, jd:%d\n",
-		    	   USBDEV_NAME,
-			   cp->current_transferlength,cp->avgdiff,jd);*/
-		}
-	    }
-	    
+	cp->received_total += urb->transfer_buffer_length;
+	cp->stats.completions++;
+	if (urb->actual_length < urb->transfer_buffer_length)
+	    cp->stats.shorttransfers++;
+	if (cp->lastcompletion) {
+	    gap = div_u64(now - cp->lastcompletion, 1000);
+	    cp->stats.gaps++;
+	    cp->stats.gap_sum_us += gap;
+	    cp->stats.gap_sumsq_us2 += gap*gap;
+	    if (gap > cp->stats.gap_max_us) cp->stats.gap_max_us = gap;
 	}
-
-	if (cp->transfers_running) { /* we still can submit urbs... */
-	    /* submit new URB */
-	    urb->transfer_flags = URB_NO_TRANSFER_DMA_MAP;
-	    urb->transfer_dma = cp->current_free_mempiece->physicaladdress +
-		cp->current_free_offset;
-	    /* for possibly zeroing afterwards */
-	    urb->transfer_buffer = 
-		&cp->current_free_mempiece->buffer[cp->current_free_offset];
-	    /* make sure we never exceed a mem page boundary with transfer */
-	    tfl=cp->current_transferlength;
-	    if (cp->current_free_offset + tfl > 
-		cp->current_free_mempiece->size)
-		tfl=(cp->current_free_mempiece->size)-cp->current_free_offset;
-
-	    /* hopefully this complies with the system to read larger
-	       quantities for IN transfers  */
-	    urb->transfer_buffer_length = tfl; 
-	    usb_submit_urb(urb,GFP_ATOMIC); /* this is not irq context */
-	    
-	    /* get prepare next free address */
-	    cp->current_free_offset += tfl;
-	    if (cp->current_free_offset >= cp->current_free_mempiece->size) {
-		/* we exceeded this page thing */
-		cp->current_free_mempiece = cp->current_free_mempiece->next;
-		cp->current_free_offset = 0;
-	    }
+	cp->lastcompletion = now;
+	cp->avggap_ns += ((now - cp->lastdelivery) - cp->avggap_ns)/8;
+	cp->lastdelivery = now;
+	spin_unlock_irqrestore(&cp->ringlock, flags);
+	if (cp->received_bytes - cp->pollreference >= cp->lowwater)
+	    wake_up_interruptible(&cp->readqueue);
+
+	if (cp->latency_ns) {
+	    latency_servo(cp);
+	} else {
+	    jiffies_servo(cp);
 	}
+
+	if (cp->transfers_running) /* we still can submit urbs... */
+	    resubmit_urb(cp, urb);
     }
 }
 
 /* initial filling of a urb queue */
 static void initial_fillurbqueue(struct cardinfo *cp) {
     static int i;
-    struct urb *urb;
+    unsigned long flags;
+    spin_lock_irqsave(&cp->ringlock, flags);
     cp->current_free_mempiece = cp->dma_main_pointer;
     cp->current_free_offset = 0;
     /* initialize IRQ rate variables */
@@ -448,27 +751,64 @@ static void initial_fillurbqueue(struct cardinfo *cp) {
     cp->jiffservocounter = DEFAULT_JIFFSERVOPERIODE;
     cp->current_transferlength = cp->initial_transferlength;
     cp->oldjiffies = jiffies;
+    cp->lastcompletion = 0; /* no gap across a restart */
+    cp->lastdelivery = ktime_to_ns(ktime_get());
+    cp->avggap_ns = 0;
+    cp->flushurb = NULL;
+    cp->inflighthead = 0;
+    /* buffer starts empty */
+    cp->submitted_bytes = cp->received_bytes;
+    cp->consumed_bytes = cp->received_bytes;
+    cp->parkedurbs = 0;
 
     for (i=0;i<cp->totalurbs;i++) {
-	urb=cp->urblist[i];
-	/* set flags properly */
-	urb->transfer_flags = URB_NO_TRANSFER_DMA_MAP;
-	urb->transfer_dma = cp->current_free_mempiece->physicaladdress +
-	    cp->current_free_offset;
-	/* for possibly zeroing afterwards */
-	urb->transfer_buffer = 
-	    &cp->current_free_mempiece->buffer[cp->current_free_offset];
-	/* get prepare next free address */
-	cp->current_free_offset += cp->current_transferlength;
-	if (cp->current_free_offset >= cp->current_free_mempiece->size) {
-	    /* we exceeded this page thing */
-	    cp->current_free_mempiece = cp->current_free_mempiece->next;
-	    cp->current_free_offset = 0;
-	}
 	/* dynamic packet adjustment */
-	urb->transfer_buffer_length = cp->current_transferlength;
-	/* submit urb - or do we need some status cleanup? */
-	usb_submit_urb(urb,GFP_KERNEL); /* this is not irq context */
+	submit_urb_locked(cp, cp->urblist[i], cp->current_transferlength);
+    }
+    spin_unlock_irqrestore(&cp->ringlock, flags);
+    if (cp->latency_ns)
+	hrtimer_start(&cp->flushtimer, ns_to_ktime(cp->latency_ns/2),
+		      HRTIMER_MODE_REL);
+}
+
+/* allocate a number of urbs into the urblist. Returns 0 or -ENOMEM */
+static int allocate_urbs(struct cardinfo *cp, int number) {
+    struct urb *fresh_urb;
+    int i;
+    cp->urblist = (struct urb **)kmalloc(sizeof(struct urb *)*number,
+					 GFP_KERNEL);
+    if (!cp->urblist) return -ENOMEM;
+    for (i=0;i<number; i++) {
+	fresh_urb=usb_alloc_urb(0,GFP_KERNEL); /* may be atomic?? */
+	if (!fresh_urb) { /* something bad happened; give back previous urbs */
+	    while (i--) usb_free_urb(cp->urblist[i]);
+	    kfree(cp->urblist); cp->urblist=NULL;
+	    printk("%s: could not allocate all %d urbs\n",USBDEV_NAME,number);
+	    return -ENOMEM;
+	}
+	cp->urblist[i]=fresh_urb; /* save to list */
+    }
+    cp->totalurbs=number; /* keep them */
+    return 0;
+}
+
+/* give back the allocated urbs */
+static void free_urbs(struct cardinfo *cp) {
+    int i;
+    for (i=0;i<cp->totalurbs;i++) usb_free_urb(cp->urblist[i]);
+    cp->totalurbs=0;
+    kfree(cp->urblist); cp->urblist=NULL;
+}
+
+/* prepare urbs for bulk transfers into the DMA buffer */
+static void fill_bulk_urbs(struct cardinfo *cp) {
+    int i;
+    for (i=0;i<cp->totalurbs;i++) {
+	usb_fill_bulk_urb(cp->urblist[i],cp->dev, cp->inpipe2,
+			  NULL, /* transferbuffer, will be filled later */
+			  2*cp->maxpacket, /* buffer length */
+			  completion_handler,  /* the complete callback */
+			  (void *)cp /* context pointer */ );
     }
 }
 
@@ -476,6 +816,8 @@ static void initial_fillurbqueue(struct cardinfo *cp) {
 static void shutdown_urbs(struct cardinfo *cp){
     int i;
     cp->transfers_running=0;
+    hrtimer_cancel(&cp->flushtimer); /* no unlinks from now on */
+    cp->parkedurbs=0; /* not submitted anyway */
     for (i=0;i<cp->totalurbs;i++) {
 	usb_kill_urb(cp->urblist[i]); /* is there anything to check? */
     }
@@ -501,27 +843,12 @@ vm_fault_t usbdev_vm_fault(struct vm_fault *vmf) {
 vm_fault_t usbdev_vm_fault( struct vm_area_struct *area, struct vm_fault *vmf) {
     struct cardinfo *cp = (struct cardinfo *)area->vm_private_data;
 #endif
-    unsigned long ofs = (vmf->pgoff << PAGE_SHIFT); /* should be addr_t ? */
-    unsigned long intofs;
-    unsigned char * virtad = NULL; /* start ad of page in kernel space */
-    struct dma_page_pointer *pgindex;
-
-    /* find right page */
-    /* TODO: fix references... */
-    pgindex = cp->dma_main_pointer; /* start with first mem piece */
-    intofs=0; /* linear offset of current mempiece start */
-    while (intofs+pgindex->fullsize<=ofs) {
-	intofs +=pgindex->fullsize;
-	pgindex=pgindex->next;
-	if (pgindex == cp->dma_main_pointer) {
-            /* offset is not mapped */
-	    return VM_FAULT_SIGBUS; /* cannot find a proper page  */
-	}
-    }; /* pgindex contains now the relevant page index */
-  
-    /* do remap by hand */
-    virtad = &pgindex->buffer[ofs-intofs];
-    vmf->page = virt_to_page(virtad); /* return page index */
+
+    /* the ring is normally mapped completely in mmap, so this only
+       happens for pages that could not be inserted there */
+    if (vmf->pgoff >= cp->pages)
+	return VM_FAULT_SIGBUS; /* offset is not mapped */
+    vmf->page = cp->pagelist[vmf->pgoff]; /* return page index */
     get_page(vmf->page); /* increment page use counter */
 
     return 0;  /* everything went fine */ 
@@ -536,28 +863,13 @@ static struct page *usbdev_vm_nopage(struct vm_area_struct * area, unsigned long
     
     /* address relative to dma memory */
     unsigned long ofs = (address - area->vm_start) + VMA_OFFSET(area);
-    unsigned long intofs;
-    unsigned char * virtad = NULL; /* start ad of page in kernel space */
-    struct dma_page_pointer *pgindex;
-    
-    /* find right page */
-    /* TODO: fix references... */
-    pgindex = cp->dma_main_pointer; /* start with first mem piece */
-    intofs=0; /* linear offset of current mempiece start */
-    while (intofs+pgindex->fullsize<=ofs) {
-	intofs +=pgindex->fullsize;
-	pgindex=pgindex->next;
-	if (pgindex == cp->dma_main_pointer) {
-	    *nopage_type = VM_FAULT_SIGBUS; /* new in kernel 2.6 */
-	    return NOPAGE_SIGBUS; /* ofs not mapped */
-	}
-    }; /* pgindex contains now the relevant page index */
-    
-    /* do remap by hand */
-    virtad = &pgindex->buffer[ofs-intofs];  
-    
+
+    if ((ofs >> PAGE_SHIFT) >= cp->pages) {
+	*nopage_type = VM_FAULT_SIGBUS; /* new in kernel 2.6 */
+	return NOPAGE_SIGBUS; /* ofs not mapped */
+    }
     /* page table index */
-    page=virt_to_page(virtad); 
+    page=cp->pagelist[ofs >> PAGE_SHIFT];
     get_page(page); /* increment page use counter */
     *nopage_type = VM_FAULT_MINOR; /* new in kernel 2.6 */
     return page;
@@ -575,10 +887,41 @@ static struct vm_operations_struct usbdev_vm_ops = {
 #endif
 };
 
+/* map the whole ring at mmap time, so that the reader never takes a page
+   fault on it. Pages that cannot be inserted are left to the fault method,
+   and premapped is only set if every page made it into the vma */
+static void premap_ring(struct cardinfo *cp, struct vm_area_struct *vma) {
+#ifdef HAS_VM_INSERT_PAGE
+    unsigned long n = (vma->vm_end - vma->vm_start) >> PAGE_SHIFT;
+    unsigned long done; /* number of inserted pages */
+#ifdef HAS_VM_INSERT_PAGES
+    unsigned long left;
+    int erc;
+#endif
+    cp->premapped = 0;
+    if (n > cp->pages) n = cp->pages;
+#ifdef HAS_VM_INSERT_PAGES
+    left = n; /* vm_insert_pages leaves the number of unmapped pages here */
+    erc = vm_insert_pages(vma, vma->vm_start, cp->pagelist, &left);
+    done = n - left;
+    if (!erc && !left) cp->premapped = 1;
+#else
+    for (done=0; done<n; done++)
+	if (vm_insert_page(vma, vma->vm_start + (done << PAGE_SHIFT),
+			   cp->pagelist[done])) break;
+    if (done == n) cp->premapped = 1;
+#endif
+    if (!cp->premapped)
+	printk(KERN_WARNING "usbtmst: premapped only %lu of %lu pages\n",
+	       done, n);
+#else
+    cp->premapped = 0;
+#endif
+}
+
 static int usbdev_mmap(struct file * file, struct vm_area_struct *vma) {
     struct cardinfo *cp = (struct cardinfo *)file->private_data;
     int erc; /* returned error code in case of trouble */
-    int i;   /* create urb framework */
     /* try to save cp into mem private data */
     vma->vm_private_data = cp;
 
@@ -617,15 +960,11 @@ static int usbdev_mmap(struct file * file, struct vm_area_struct *vma) {
     vma->vm_flags |= VM_IO | VM_DONTEXPAND;/* replaces obsoleted VM_RESERVED */
 #endif
 #endif
+    premap_ring(cp, vma);
+
     /* populate the urbs - perhaps this should go to an ioctl starting
        the engine ? */
-    for (i=0;i<cp->totalurbs;i++) {
-	usb_fill_bulk_urb(cp->urblist[i],cp->dev, cp->inpipe2,
-			  NULL, /* transferbuffer, will be filled later */
-			  2*cp->maxpacket, /* buffer length */
-			  completion_handler,  /* the complete callback */
-			  (void *)cp /* context pointer */ );
-    }
+    fill_bulk_urbs(cp);
     cp->current_free_mempiece = cp->dma_main_pointer; /* first free page */
     cp->current_free_offset = 0; /* beginning of page */
     printk("usbtmst mmap successful.\n"); /* for debugging...*/
@@ -637,9 +976,7 @@ static int usbdev_mmap(struct file * file, struct vm_area_struct *vma) {
 /* minor device 0 (simple access) structures */
 static int usbdev_flat_open(struct inode *inode, struct file *filp) {
     struct cardinfo *cp;
-    struct urb *fresh_urb;
     int err; /* for error messages in opening */
-    int i;
     cp= search_cardlist(iminor(inode));
     if (!cp) return -ENODEV;
     if (cp->iocard_opened) 
@@ -655,41 +992,34 @@ static int usbdev_flat_open(struct inode *inode, struct file *filp) {
       return -ENODEV; /* something happened */
     }
     /* allocate the urbs */
-    cp->urblist = (struct urb **)kmalloc(sizeof(struct urb *)*URBS_NUMBER,
-					 GFP_KERNEL);
-    for (i=0;i<URBS_NUMBER; i++) {
-	fresh_urb=usb_alloc_urb(0,GFP_KERNEL); /* may be atomic?? */
-	if (!fresh_urb) { /* something bad happened; give back previous urbs */
-	    while (i--) usb_free_urb(cp->urblist[i]);
-	    break;
-	}
-	cp->urblist[i]=fresh_urb; /* save to list */
-    }
-    if (i<URBS_NUMBER) { /* urb allocation failed */
-	printk("%s: could not allocate all %d urbs\n",USBDEV_NAME,URBS_NUMBER);
+    if (allocate_urbs(cp, clamp(urbs_number, 1, MAX_URBS_NUMBER))) {
 	cp->iocard_opened = 0; /* mark as closed */	
 	return -ENOMEM;
     }
-    cp->totalurbs=URBS_NUMBER; /* keep them */
     /* initialize transfer engine state */
     cp->transfers_running=0; /* everything is off */
     cp->errstat=0;
     cp->received_bytes=0; /* nothing transferred so far */
+    cp->received_total=0;
+    cp->urbsinflight=0;
+    cp->pollreference=0;
+    cp->lowwater=1; /* readable as soon as anything arrives */
+    cp->overrunpolicy=OVERRUN_IGNORE; /* legacy behaviour */
+    cp->lost_bytes=0;
+    cp->parkedurbs=0;
     cp->initial_transferlength=cp->maxpacket; /* default size */
+    cp->latency_ns = (latency_us>0) ? latency_us*1000LL : 0;
 
     return 0;
 }
 static int usbdev_flat_close(struct inode *inode, struct file *filp) {
     struct cardinfo *cp = (struct cardinfo *)filp->private_data;
-    int i; 
 
     /* kill eventually running urbs... */
     shutdown_urbs(cp);
 
     /* give back the allcoated urbs */
-    for (i=0;i<cp->totalurbs;i++) usb_free_urb(cp->urblist[i]);
-    cp->totalurbs=0;
-    kfree(cp->urblist);
+    free_urbs(cp);
 
     release_dma_buffer(cp);
   
@@ -705,6 +1035,21 @@ static int usbdev_flat_close(struct inode *inode, struct file *filp) {
 }
 
 
+/* poll method: readable if at least lowwater bytes arrived since the last
+   Get_transferredbytes call. */
+static __poll_t usbdev_flat_poll(struct file *filp, poll_table *wait) {
+    struct cardinfo *cp = (struct cardinfo *)filp->private_data;
+    __poll_t mask = 0;
+
+    poll_wait(filp, &cp->readqueue, wait);
+    if (!cp->dev) return POLLERR | POLLHUP; /* got unplugged */
+    if (cp->errstat) mask |= POLLERR;
+    if (cp->received_bytes - cp->pollreference >= cp->lowwater)
+	mask |= POLLIN | POLLRDNORM;
+    return mask;
+}
+
+
 /* -----------------------------------------------------------------*/
 /* basic methods for communicating with the device */
 
@@ -873,6 +1218,59 @@ long ioctl_spi_read(unsigned int cmd, unsigned long arg, struct cardinfo *cp) {
   
 }
 
+/* send one WRITE_RAM command with the content in the upper and the address
+   in the lower 16 bits of value, and check the reply. The packet is the
+   same as the one of the WRITE_RAM ioctl, checksum included */
+static int write_ram_word(struct cardinfo *cp, unsigned int value) {
+    unsigned char *data = cp->scratchbuf; /* dma-compat buffer */
+    unsigned char chksum=0;
+    int atrf, localerr;
+
+    data[5]=(value>>24) & 0xff; chksum+=data[5];
+    data[4]=(value>>16) & 0xff; chksum+=data[4];
+    data[3]=(value>>8) & 0xff; chksum+=data[4];
+    data[2]=(value) & 0xff; chksum+=data[4];
+    data[0]=7; chksum+=7;
+    data[1]=WRITE_RAM & 0xff; chksum+=data[1];
+    data[6]=chksum;
+    localerr=usb_bulk_msg(cp->dev, cp->outpipe1, data, 7, &atrf, 1000);
+    if (localerr) return localerr;
+    localerr=usb_bulk_msg(cp->dev, cp->inpipe1, data, 64, &atrf, 1000);
+    if (localerr) return localerr;
+    if (atrf>64) return -ENOMEM;
+    if (data[0]) return -EFAULT; /* address error */
+    return 0;
+}
+
+/* ioctl code that writes a struct ramblock into the RAM. This is not a USB
+   bulk transfer of the block: the EP1 protocol of the firmware carries one
+   word per WRITE_RAM command and answers each one, so the block still costs
+   a bulk-out and a bulk-in per word, as many round trips as before. Only
+   the ioctl and user copy per word are saved; a load that is really
+   avoided is the one skipped through the RAM tag */
+static long ioctl_write_rambulk(unsigned long arg, struct cardinfo *cp) {
+    struct ramblock *blk = (struct ramblock *)arg;
+    unsigned short chunk[64]; /* words copied from user space at a time */
+    int address, count, i, k, n, localerr;
+
+    if (copy_from_user(&address, &blk->address, sizeof(int)) ||
+	copy_from_user(&count, &blk->count, sizeof(int))) return -EFAULT;
+    if ((count < 0) || (count > RAMBLOCK_MAXWORDS) || (address < 0) ||
+	(address & 1) || (address + 2*count > 0x10000)) return -EINVAL;
+    cp->luttag = 0; /* content changes */
+    for (i=0; i<count; i+=n) {
+	n = (count-i > 64) ? 64 : count-i;
+	if (copy_from_user(chunk, &blk->words[i], n*sizeof(unsigned short)))
+	    return -EFAULT;
+	for (k=0; k<n; k++) {
+	    localerr = write_ram_word(cp, ((unsigned int)chunk[k]<<16) |
+				      (address + 2*(i+k)));
+	    if (localerr) return localerr;
+	}
+    }
+    return 0;
+}
+
 /* change in the ioctl structure to unlocked_ioctl...removed inode parameter */
 static long usbdev_flat_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
     struct cardinfo *cp = (struct cardinfo *)filp->private_data;
@@ -882,14 +1280,30 @@ static long usbdev_flat_ioctl(struct file *filp, unsigned int cmd, unsigned long
     int value; /* for passing stuff back */
     int localerr;
     int i;
+    unsigned long flags;
+    unsigned long long lost, tag;
+    struct ringstatus status;
     
     if (!cp->dev) return -ENODEV;
+
+    /* commands that change the RAM content or may lose it */
+    if ((cmd == WRITE_RAM) || (cmd == RETREIVE_EEPROM) ||
+	(cmd == SET_POWER_STATE) || ((cmd == CONFIG_TMSTDEVICE) && !arg))
+	cp->luttag = 0;
     
     switch (cmd) { /* to distill out real command */
     case Start_USB_machine:
 	/* first check if we have the mmap done already */
 	if (!cp->dma_main_pointer || cp->transfers_running) 
 	    return -EBUSY; 
+	/* urbs in flight must not overlap in the buffer, so transfers of
+	   small rings stay below a mem piece */
+	if (cp->totalurbs * cp->maxpacket > cp->dmasize)
+	    return -EINVAL;
+	value = cp->maxpacket;
+	while ((value*2 <= cp->minmempiece) &&
+	       (cp->totalurbs * value*2 <= cp->dmasize)) value *= 2;
+	cp->maxtransferlength = value;
 	/* Ok, we can start. Let's populate the urbs first....*/
 	cp->transfers_running=1;
 	initial_fillurbqueue(cp);
@@ -912,6 +1326,73 @@ static long usbdev_flat_ioctl(struct file *filp, unsigned int cmd, unsigned long
     case Get_errstat:
 	return cp->errstat;
 	break;
+    case Get_status: /* argument points to a struct ringstatus */
+	if (!cp->dma_main_pointer) return -EBUSY;
+	get_ringstatus(cp, &status);
+	if (copy_to_user((struct ringstatus *)arg, &status, sizeof(status)))
+	    return -EFAULT;
+	break;
+    case Set_lowwater: /* argument is number of bytes */
+	if ((arg < 1) || (arg > 0x40000000)) return -EINVAL;
+	cp->lowwater = arg;
+	wake_up_interruptible(&cp->readqueue); /* re-evaluate condition */
+	break;
+    case Get_drivercaps:
+	/* PREMAP only once the ring is mapped and all pages got inserted */
+	return DRIVERCAP_POLL | DRIVERCAP_URBNUMBER | DRIVERCAP_CONSUMER |
+	    DRIVERCAP_RAMBULK | DRIVERCAP_STATUS | DRIVERCAP_LATENCY |
+	    ((cp->dma_main_pointer && cp->premapped) ? DRIVERCAP_PREMAP : 0);
+	break;
+    case Set_consumerpointer: /* argument is processed bytes mod 2**31 */
+	spin_lock_irqsave(&cp->ringlock, flags);
+	value = ((int)arg - cp->consumed_bytes) & 0x7fffffff;
+	/* ignore pointers behind, e.g. after lost data was skipped */
+	if (value <= cp->received_bytes - cp->consumed_bytes)
+	    cp->consumed_bytes += value;
+	spin_unlock_irqrestore(&cp->ringlock, flags);
+	release_parked_urbs(cp);
+	break;
+    case Set_overrunpolicy:
+	if (arg > OVERRUN_COUNT) return -EINVAL;
+	cp->overrunpolicy = arg;
+	if (arg != OVERRUN_BACKPRESSURE) release_parked_urbs(cp);
+	break;
+    case Get_lostbytes:
+	spin_lock_irqsave(&cp->ringlock, flags);
+	lost = cp->lost_bytes;
+	spin_unlock_irqrestore(&cp->ringlock, flags);
+	if (copy_to_user((unsigned long long *)arg, &lost, sizeof(lost)))
+	    return -EFAULT;
+	break;
+    case Write_rambulk: /* argument points to a struct ramblock */
+	return ioctl_write_rambulk(arg, cp);
+	break;
+    case Set_luttag: /* argument points to a 64 bit tag */
+	if (copy_from_user(&tag, (unsigned long long *)arg, sizeof(tag)))
+	    return -EFAULT;
+	cp->luttag = tag;
+	break;
+    case Get_luttag:
+	if (copy_to_user((unsigned long long *)arg, &cp->luttag,
+			 sizeof(cp->luttag))) return -EFAULT;
+	break;
+    case Set_urbnumber: /* argument is the number of urbs */
+	if ((arg < 1) || (arg > MAX_URBS_NUMBER)) return -EINVAL;
+	if (cp->transfers_running) return -EBUSY;
+	if (arg == cp->totalurbs) break;
+	free_urbs(cp);
+	localerr = allocate_urbs(cp, arg);
+	if (localerr) return localerr;
+	if (cp->dma_main_pointer) fill_bulk_urbs(cp); /* mmap done already */
+	break;
+    case Get_ringsize:
+	return ringsize;
+	break;
+    case Set_latency: /* argument in usec, 0: jiffies servo */
+	if (arg > 1000000) return -EINVAL;
+	if (cp->transfers_running) return -EBUSY;
+	cp->latency_ns = arg*1000LL;
+	break;
     case CLOCKCHIP_WRITE: case ADCCHIP_WRITE:
 	return ioctl_spi_write(cmd, arg, cp);
 	break;
@@ -1073,6 +1554,7 @@ static struct file_operations usbdev_simple_fops = {
     /* migration to newer ioctl definition */
     unlocked_ioctl:   usbdev_flat_ioctl,
     mmap:    usbdev_mmap,   /* port_mmap */
+    poll:    usbdev_flat_poll,
 
 };
 
@@ -1092,6 +1574,31 @@ static struct usb_class_driver tmst4class = {
 };
 
 
+/* counters of a card in debugfs; failures here are not fatal */
+static void create_debugfs_entries(struct cardinfo *cp,
+				   struct usb_interface *intf) {
+    struct dentry *d;
+    cp->debugdir = debugfs_create_dir(dev_name(intf->usb_dev), debugroot);
+    d = cp->debugdir;
+    if (IS_ERR_OR_NULL(d)) return;
+    debugfs_create_u64("completions", 0644, d, &cp->stats.completions);
+    debugfs_create_u64("short_transfers", 0644, d, &cp->stats.shorttransfers);
+    debugfs_create_u64("urb_errors", 0644, d, &cp->stats.urberrors);
+    debugfs_create_u64("submit_failures", 0644, d, &cp->stats.submitfailures);
+    debugfs_create_u64("transferlength_up", 0644, d, &cp->stats.tfl_up);
+    debugfs_create_u64("transferlength_down", 0644, d, &cp->stats.tfl_down);
+    debugfs_create_u64("gaps", 0644, d, &cp->stats.gaps);
+    debugfs_create_u64("gap_sum_us", 0644, d, &cp->stats.gap_sum_us);
+    debugfs_create_u64("gap_sumsq_us2", 0644, d, &cp->stats.gap_sumsq_us2);
+    debugfs_create_u64("gap_max_us", 0644, d, &cp->stats.gap_max_us);
+    debugfs_create_u64("flushes", 0644, d, &cp->stats.flushes);
+    debugfs_create_u32("transferlength", 0444, d,
+		       (u32 *)&cp->current_transferlength);
+    debugfs_create_u32("urbs_in_flight", 0444, d, (u32 *)&cp->urbsinflight);
+    debugfs_create_u64("received_bytes", 0444, d, &cp->received_total);
+    debugfs_create_u64("lost_bytes", 0444, d, &cp->lost_bytes);
+}
+
 /* initialisation of the driver: getting resources etc. */
 static int usbdev_init_one(struct usb_interface *intf, const struct usb_device_id *id ) {
     int iidx; /* index of different interfaces */
@@ -1112,9 +1619,24 @@ static int usbdev_init_one(struct usb_interface *intf, const struct usb_device_i
 
     cp->iocard_opened = 0; /* no open */
     cp->dma_main_pointer = NULL ; /* no DMA buffer */
+    cp->pagelist = NULL; cp->pages = 0; cp->premapped = 0;
+    cp->maxtransferlength = 0;
     cp->totalurbs=0;   /* initially reserved urbs */
     cp->maxpacket=0; /* do we really need to initialize?? */
     cp->transfers_running = 0; /* no transfers are active */
+    cp->luttag = 0; /* RAM content unknown */
+    memset(&cp->stats, 0, sizeof(cp->stats));
+    cp->lastcompletion = 0; cp->current_transferlength = 0;
+    cp->urbsinflight = 0; cp->received_total = 0; cp->lost_bytes = 0;
+    cp->debugdir = NULL;
+    cp->latency_ns = 0; cp->flushurb = NULL; cp->inflighthead = 0;
+#ifdef HAS_HRTIMER_SETUP
+    hrtimer_setup(&cp->flushtimer, flushtimer_handler, CLOCK_MONOTONIC,
+		  HRTIMER_MODE_REL);
+#else
+    hrtimer_init(&cp->flushtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    cp->flushtimer.function = flushtimer_handler;
+#endif
     
     retval=usb_register_dev(intf, &tmst4class);
     if (retval) { /* coul not get minor */
@@ -1122,6 +1644,7 @@ static int usbdev_init_one(struct usb_interface *intf, const struct usb_device_i
 	goto out2;
     }
     cp->minor = intf->minor;
+    create_debugfs_entries(cp, intf);
 
     /* find device */
     for (iidx=0;iidx<intf->num_altsetting;iidx++){ /* probe interfaces */
@@ -1162,6 +1685,9 @@ static int usbdev_init_one(struct usb_interface *intf, const struct usb_device_i
 
     /* construct a wait queue for proper disconnect action */
     init_waitqueue_head(&cp->closingqueue);
+    /* ...and one for poll() */
+    init_waitqueue_head(&cp->readqueue);
+    spin_lock_init(&cp->ringlock);
 
     /* insert in list */
     cp->next=cif;cp->previous=NULL; 
@@ -1171,6 +1697,7 @@ static int usbdev_init_one(struct usb_interface *intf, const struct usb_device_i
 
     return 0; /* everything is fine */
  out1:
+    debugfs_remove_recursive(cp->debugdir);
     usb_deregister_dev(intf, &tmst4class);
  out2:
     /* first give back DMA buffer, then cardinfo structure */
@@ -1202,6 +1729,7 @@ static void usbdev_remove_one(struct usb_interface *interface) {
 	    shutdown_urbs(cp); /* is there something which does not cause
 				  a call to the callback? */
 	}
+	wake_up_interruptible(&cp->readqueue); /* get poll() out */
 	/* ... and now we hope that someone realizes that we took away the
 	   memory and closes the device */
 	wait_event(cp->closingqueue, !(cp->iocard_opened));
@@ -1218,6 +1746,8 @@ static void usbdev_remove_one(struct usb_interface *interface) {
     }
     if (cp->next) cp->next->previous = cp->previous;
 
+    debugfs_remove_recursive(cp->debugdir); /* before the counters go */
+
     /* mark interface as dead */
     usb_set_intfdata(interface, NULL);
     usb_deregister_dev(interface, &tmst4class);
@@ -1249,12 +1779,15 @@ static struct usb_driver usbdev_driver = {
 
 static void  __exit usbdev_clean(void) {
     usb_deregister( &usbdev_driver );
+    debugfs_remove_recursive(debugroot);
 }
 
 static int __init usbdev_init(void) {
     int rc;
     cif=NULL;
+    debugroot = debugfs_create_dir(USBDEV_NAME, NULL); /* may fail */
     rc = usb_register( &usbdev_driver );
+    if (rc) debugfs_remove_recursive(debugroot);
     if (rc) 
 	pr_err("%s: usb_register failed. Err: %d",USBDEV_NAME,rc);
     return rc;